@@ -0,0 +1,93 @@
+#ifndef __HCS_BENCH_H__
+#define __HCS_BENCH_H__
+
+/**
+ * Latency histogram in the style of HdrHistogram.
+ *
+ * Values are counted in buckets that are linear within each power of two, with
+ * 2^HISTOGRAM_SUB_BITS buckets per power. The relative error of a reported value is
+ * below 1%, over the whole range of int64_t, in fixed memory.
+ */
+#define HISTOGRAM_SUB_BITS    7
+
+class Histogram
+{
+public:
+    Histogram();
+
+    /**
+     * @param value The value to count, negative values count as 0.
+     */
+    void add ( int64_t value );
+
+    /**
+     * @param percentile The percentile, 0-100.
+     *
+     * @returns the highest value equivalent to the value at percentile, 0 if empty.
+     */
+    int64_t percentile ( double percentile ) const;
+
+    unsigned long get_count () const
+    {
+        return count;
+    }
+    int64_t get_min () const
+    {
+        return min;
+    }
+    int64_t get_max () const
+    {
+        return max;
+    }
+    double get_mean () const
+    {
+        return count > 0 ? sum / count : 0.0;
+    }
+
+private:
+    std::vector<uint64_t> buckets;
+    unsigned long         count = 0;
+    int64_t               min   = 0;
+    int64_t               max   = 0;
+    double                sum   = 0.0;
+
+    static size_t index ( int64_t value );
+    static int64_t highest_equivalent ( size_t index );
+};
+
+/**
+ * Repeatedly runs PSU operations and reports their latency.
+ */
+class Bench
+{
+public:
+    /**
+     * @param psu The (opened) power supply.
+     */
+    Bench( PSU *psu );
+
+    /**
+     * @param name       The operation or "all".
+     * @param iterations The number of timed runs of each operation.
+     * @param out        The file to write the report to.
+     */
+    void run ( const char *name, unsigned long iterations, FILE *out ) throw ( PSUError & );
+
+private:
+    struct Operation
+    {
+        const char                 *name;
+        std::function<void ( PSU *psu )> run;
+        // Run once before the measurement, not timed. May be empty.
+        std::function<void ( PSU *psu )> prepare;
+    };
+    PSU                    *psu;
+    std::vector<Operation> operations;
+    // Setpoints the write operations put back, read once before they run.
+    float                  voltage = 0.0f;
+    float                  current = 0.0f;
+
+    void run_operation ( const Operation &operation, unsigned long iterations, FILE *out ) throw ( PSUError & );
+};
+
+#endif // __HCS_BENCH_H__
@@ -0,0 +1,77 @@
+#ifndef __HCS_CACHE_H__
+#define __HCS_CACHE_H__
+
+/**
+ * Small persistent key/value store per device.
+ *
+ * Each entry is a text file with one 'key=value' per line in the cache directory:
+ * $HCS_CACHE_DIR, $XDG_CACHE_HOME/hcs or ~/.cache/hcs. Files are replaced atomically,
+ * so concurrent hcs instances never see a half written entry.
+ */
+class DeviceCache
+{
+public:
+    /**
+     * @param name The name of the entry, typically the device type and serial number.
+     *             Characters that are not safe in a file name are replaced.
+     */
+    DeviceCache( const std::string &name );
+
+    /**
+     * @param path Full path of the file to use, instead of an entry in the cache directory.
+     *
+     * @returns an entry stored at path.
+     */
+    static DeviceCache from_file ( const std::string &path );
+
+    /**
+     * Load the entry from disk.
+     *
+     * @returns false if there is no (readable) entry.
+     */
+    bool load ();
+
+    /**
+     * Write the entry to disk.
+     *
+     * @returns false if the entry could not be written, the cache is then just not used.
+     */
+    bool store () const;
+
+    /**
+     * @returns true if key is set.
+     */
+    bool has ( const std::string &key ) const
+    {
+        return values.find ( key ) != values.end ();
+    }
+
+    std::string get ( const std::string &key ) const;
+    double get_double ( const std::string &key, double fallback = 0.0 ) const;
+
+    void set ( const std::string &key, const std::string &value );
+    void set ( const std::string &key, double value );
+
+    /**
+     * @returns the directory the entries are stored in.
+     */
+    static std::string directory ();
+
+    /**
+     * @returns the path of the file the entry is stored in.
+     */
+    const std::string &get_path () const
+    {
+        return path;
+    }
+
+private:
+    DeviceCache()
+    {
+    }
+
+    std::string                        path;
+    std::map<std::string, std::string> values;
+};
+
+#endif // __HCS_CACHE_H__
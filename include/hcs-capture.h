@@ -0,0 +1,148 @@
+#ifndef __HCS_CAPTURE_H__
+#define __HCS_CAPTURE_H__
+
+/**
+ * Compact binary capture of raw device counts.
+ *
+ * File layout, all values in host byte order:
+ *
+ *  CaptureHeader
+ *  CaptureBlock + payload
+ *  CaptureBlock + payload
+ *  ...
+ *
+ * The first sample of a block is stored in full in the CaptureBlock. Every following sample
+ * is stored in the payload as three varints:
+ *
+ *  * The time since the previous sample (in us).
+ *  * zigzag ( voltage delta ) << 2 | mode.
+ *  * zigzag ( current delta ).
+ *
+ * Blocks are written in one go, so a file can be appended to and a crash only loses
+ * the block being filled.
+ */
+#define CAPTURE_MAGIC          "HCSCAP1"
+#define CAPTURE_BLOCK_MAGIC    0x4B4C4248
+#define CAPTURE_VERSION        1
+
+struct CaptureHeader
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    float    nominal_voltage;
+    float    nominal_current;
+    float    nominal_power;
+    // Volts and Amps per count.
+    float    voltage_resolution;
+    float    current_resolution;
+    char     manufacturer[16];
+    char     type[32];
+    char     serial[32];
+    char     article[16];
+    char     software[32];
+};
+
+struct CaptureBlock
+{
+    uint32_t magic;
+    // Number of samples, including the one in this header.
+    uint32_t count;
+    // Size of the payload following this header.
+    uint32_t size;
+    uint32_t mode;
+    // CLOCK_MONOTONIC timestamp of the first sample (in ns).
+    int64_t  timestamp;
+    int32_t  voltage;
+    int32_t  current;
+};
+
+/**
+ * Appends samples to a capture file.
+ */
+class CaptureWriter
+{
+public:
+    /**
+     * @param path     The capture file, created when it does not exist.
+     * @param identity The identity of the sampled power supply.
+     *
+     * Open path for appending. An existing capture must be from the same device.
+     */
+    CaptureWriter( const char *path, const PSU::Identity &identity ) throw ( PSUError & );
+    ~CaptureWriter();
+
+    /**
+     * @param timestamp CLOCK_MONOTONIC timestamp of the sample (in ns).
+     * @param snapshot  The sample, uses the raw actual values and mode.
+     */
+    void append ( int64_t timestamp, const PSU::Snapshot &snapshot ) throw ( PSUError & );
+
+    /**
+     * Write out the block being filled.
+     */
+    void flush () throw ( PSUError & );
+
+private:
+    // Maximum encoded size of one sample.
+    static const size_t max_sample_size = 15;
+    static const size_t max_block_count = 1024;
+
+    int                 fd = -1;
+    CaptureBlock        block;
+    uint8_t             payload[4096];
+    size_t              payload_size = 0;
+    // Previous sample, time in us since the start of the block.
+    int64_t             last_time    = 0;
+    int32_t             last_voltage = 0;
+    int32_t             last_current = 0;
+};
+
+/**
+ * Reads a capture file through mmap.
+ */
+class CaptureReader
+{
+public:
+    struct Sample
+    {
+        // CLOCK_MONOTONIC timestamp (in ns).
+        int64_t            timestamp;
+        int32_t            voltage_raw;
+        int32_t            current_raw;
+        PSU::OperatingMode mode;
+    };
+
+    CaptureReader( const char *path ) throw ( PSUError & );
+    ~CaptureReader();
+
+    const CaptureHeader &get_header () const
+    {
+        return *header;
+    }
+
+    /**
+     * @param callback Called for every sample in the file.
+     *
+     * Decode the file. Decoding stops at the first truncated or corrupt block.
+     *
+     * @returns the number of samples decoded.
+     */
+    unsigned long for_each ( std::function<void(const Sample &)> callback ) const;
+
+    /**
+     * @param out The file to write to.
+     *
+     * Write all samples as CSV, in the same columns monitor uses.
+     *
+     * @throws PSUError when a sample has a mode that does not exist.
+     */
+    unsigned long export_csv ( FILE *out ) const throw ( PSUError & );
+
+private:
+    const uint8_t       *data = nullptr;
+    size_t              size  = 0;
+    const CaptureHeader *header = nullptr;
+};
+
+#endif // __HCS_CAPTURE_H__
@@ -0,0 +1,223 @@
+#ifndef __HCS_CHANNEL_H__
+#define __HCS_CHANNEL_H__
+
+/**
+ * Non-blocking request/reply transport to one power supply.
+ *
+ * Requests are queued, written when the device can take them and matched to
+ * replies in order. Up to PSU::get_pipeline_depth () requests are written back
+ * to back before the first reply arrives. The channel is driven by an event loop
+ * that calls handle_write (), handle_read () and handle_timeout (), or by wait ()
+ * for a single device.
+ *
+ * A request moves through: queued -> writing -> waiting for reply -> done.
+ *
+ * When a reply does not arrive in time or fails PSU::check_reply (), pending input is
+ * dropped and the channel waits for the line to go quiet before writing again, so late or
+ * misaligned bytes are not taken for the next reply. Requests that failed this way are
+ * then written again, in their original order, up to PSU::get_max_retries () times.
+ */
+class Channel
+{
+public:
+    /**
+     * A single request and what to do with its reply.
+     */
+    struct Request
+    {
+        // The encoded request.
+        uint8_t                                                data[32];
+        size_t                                                 size = 0;
+        // Called with the full reply frame, may throw PSUError to fail the request.
+        std::function<void ( const uint8_t *reply, size_t size )> on_reply;
+        // Called when the request failed or timed out, optional.
+        std::function<void ( const PSUError &error )>            on_error;
+        // Maximum time to wait for the reply (in ns), 0 for PSU::get_reply_timeout ().
+        int64_t                                                timeout     = 0;
+        // Doing it twice has the same effect as doing it once: a read or setting an absolute
+        // value. Only these are written again after they reached the device.
+        bool                                                   idempotent  = false;
+        // Number of failed attempts blamed on this request.
+        unsigned int                                           failures    = 0;
+        // CLOCK_MONOTONIC times (in ns) writing started, the request was written
+        // and the first byte of the reply arrived.
+        int64_t                                                write_start = 0;
+        int64_t                                                sent        = 0;
+        int64_t                                                first_byte  = 0;
+    };
+
+    /**
+     * @param psu The (opened) power supply, used for framing replies.
+     */
+    Channel( PSU *psu );
+
+    int get_fd () const
+    {
+        return psu->get_fd ();
+    }
+
+    /**
+     * @param request The request to queue.
+     */
+    void submit ( Request &&request );
+
+    /**
+     * @returns true when nothing is queued or waiting for a reply.
+     */
+    bool idle () const
+    {
+        return queue.empty () && in_flight.empty ();
+    }
+
+    /**
+     * @returns true when there is a request that can be written now.
+     */
+    bool wants_write () const
+    {
+        return !queue.empty () && quiet_until == 0 && in_flight.size () < psu->get_pipeline_depth () &&
+               ( psu->get_write_gap () == 0 || hcs_monotonic_ns () >= last_write + psu->get_write_gap () );
+    }
+
+    /**
+     * Drive the channel until it is idle.
+     *
+     * @throws PSUError with the first error of the queued requests.
+     */
+    void wait () throw ( PSUError & );
+
+    /**
+     * Write as much of the queued requests as allowed.
+     */
+    void handle_write ();
+
+    /**
+     * Read what is available and complete the requests whose reply arrived.
+     */
+    void handle_read ();
+
+    /**
+     * @returns the deadline (CLOCK_MONOTONIC in ns) of the oldest request waiting for a reply,
+     *          the end of the quiet period after an error or the time the next request may be
+     *          written, whichever comes first, 0 if none.
+     */
+    int64_t deadline () const;
+
+    /**
+     * @param now The current CLOCK_MONOTONIC time (in ns).
+     *
+     * Retry or fail all requests when the oldest request waiting for a reply passed its
+     * deadline, resume writing when the line has been quiet long enough.
+     */
+    void handle_timeout ( int64_t now );
+
+    /**
+     * @param error The error to report.
+     * @param retry Queue the requests that may be retried again instead of failing them.
+     *
+     * Fail all queued and outstanding requests, and drop pending input.
+     */
+    void fail_all ( const PSUError &error, bool retry = false );
+
+    /**
+     * @returns the first error since the last clear_error (), empty if none.
+     */
+    const std::string &get_error () const
+    {
+        return error;
+    }
+    void clear_error ()
+    {
+        error.clear ();
+    }
+
+    /**
+     * @returns the time between writing the last completed request and receiving its reply (in ns).
+     */
+    int64_t get_last_round_trip () const
+    {
+        return last_round_trip;
+    }
+
+    /**
+     * @returns the CLOCK_MONOTONIC time (in ns) the last completed request was written.
+     */
+    int64_t get_last_sent () const
+    {
+        return last_sent;
+    }
+
+    /**
+     * @returns the CLOCK_MONOTONIC time (in ns) the reply of the last completed request was in.
+     */
+    int64_t get_last_completed () const
+    {
+        return last_completed;
+    }
+
+private:
+    /**
+     * First in, first out list of requests. Unlike std::deque it keeps its storage when requests
+     * are taken out, so once it has grown to the longest burst, queueing a request does not
+     * allocate.
+     */
+    class RequestQueue
+    {
+    public:
+        bool empty () const
+        {
+            return count == 0;
+        }
+        size_t size () const
+        {
+            return count;
+        }
+        Request &front ()
+        {
+            return slots[first];
+        }
+        const Request &front () const
+        {
+            return slots[first];
+        }
+        Request &operator[] ( size_t index )
+        {
+            return slots[( first + index ) % slots.size ()];
+        }
+        void push_back ( Request &&request );
+        void pop_front ();
+        void clear ();
+
+    private:
+        std::vector<Request> slots;
+        size_t               first = 0;
+        size_t               count = 0;
+    };
+
+    PSU                 *psu;
+    RequestQueue        queue;
+    RequestQueue        in_flight;
+    // Number of bytes of the head of queue already written.
+    size_t              written = 0;
+    // Received bytes not yet matched to a request.
+    uint8_t             rx[256];
+    size_t              rx_size = 0;
+    std::string         error;
+    int64_t             last_round_trip = 0;
+    int64_t             last_completed  = 0;
+    int64_t             last_sent       = 0;
+    // CLOCK_MONOTONIC time (in ns) writing the last request started, for PSU::get_write_gap ().
+    int64_t             last_write      = 0;
+    // CLOCK_MONOTONIC time (in ns) the last byte was received.
+    int64_t             last_byte       = 0;
+    // After an error: nothing is written until this CLOCK_MONOTONIC time (in ns), pushed
+    // back by every byte that still comes in. 0 when not resyncing.
+    int64_t             quiet_until     = 0;
+
+    void mark_first_byte ();
+    int64_t reply_deadline () const;
+    void complete ( const uint8_t *reply, size_t size );
+    void fail ( Request &request, const PSUError &error );
+    bool may_retry ( const Request &request ) const;
+};
+
+#endif // __HCS_CHANNEL_H__
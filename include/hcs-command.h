@@ -0,0 +1,165 @@
+#ifndef __HCS_COMMAND_H__
+#define __HCS_COMMAND_H__
+
+/**
+ * An hcs command with its arguments parsed.
+ *
+ * One table lists every command and the arguments it takes, both the command line and scripts
+ * parse through it. Arguments are checked and converted when the command is parsed, so a
+ * script finds its errors before anything runs and executing a command does no parsing.
+ *
+ * Optional arguments are only taken when the next word fits, e.g. 'monitor 0.5 voltage' takes
+ * 0.5 as the interval and leaves 'voltage' for the next command.
+ */
+class Command
+{
+public:
+    enum class Id
+    {
+    AUTO,
+    PPS,
+    EAPS,
+    LIST,
+    REFRESH,
+    FORMAT,
+    LOGFILE,
+    METRICS,
+    DECODE,
+    OPEN,
+    GROUP,
+    TARGET,
+    STATS,
+    SCRIPT,
+    STATUS,
+    ON,
+    OFF,
+    MODE,
+    VOLTAGE,
+    CURRENT,
+    OVP,
+    OCP,
+    MONITOR,
+    BENCH,
+    RAMP,
+    SEQUENCE,
+    CP,
+    TRIGGER,
+    PUBLISH,
+    ENERGY,
+    SYNC
+    };
+
+    enum class Type
+    {
+    // End of the arguments.
+    NONE,
+    // Any word.
+    WORD,
+    // A word that is not a number.
+    NAME,
+    // A finite floating point number.
+    NUMBER,
+    // A whole number, 0 or more.
+    COUNT,
+    // One of keywords.
+    KEYWORD
+    };
+
+    static const size_t max_args = 6;
+
+    struct Param
+    {
+        Type       type;
+        bool       optional;
+        // KEYWORD: the words it takes, separated by '|'.
+        const char *keywords;
+    };
+
+    struct Spec
+    {
+        const char *name;
+        Id         id;
+        const char *usage;
+        Param      params[max_args];
+    };
+
+    struct Arg
+    {
+        // False when an optional argument was left out.
+        bool          set    = false;
+        // The word as given.
+        const char    *word  = nullptr;
+        double        number = 0.0;
+        // COUNT: the value, KEYWORD: the index in keywords.
+        unsigned long count  = 0;
+    };
+
+    /**
+     * @param argc The number of words.
+     * @param argv The words, the first is the command. Referred to, so they have to stay.
+     *
+     * Parse the command and the arguments it takes, the words after those are left.
+     *
+     * @throws PSUError when the command is unknown, or its arguments are missing or invalid.
+     *
+     * @returns the command.
+     */
+    static Command parse ( int argc, char **argv ) throw ( PSUError & );
+
+    Id get_id () const
+    {
+        return spec->id;
+    }
+    const char *get_name () const
+    {
+        return spec->name;
+    }
+    const char *get_usage () const
+    {
+        return spec->usage;
+    }
+
+    /**
+     * @returns the number of words used, the command included.
+     */
+    int get_words () const
+    {
+        return words;
+    }
+
+    /**
+     * @param index The argument.
+     *
+     * @returns true when the argument was given.
+     */
+    bool has ( size_t index ) const
+    {
+        return args[index].set;
+    }
+    const char *get_word ( size_t index, const char *fallback = nullptr ) const
+    {
+        return args[index].set ? args[index].word : fallback;
+    }
+    double get_number ( size_t index, double fallback = 0.0 ) const
+    {
+        return args[index].set ? args[index].number : fallback;
+    }
+    unsigned long get_count ( size_t index, unsigned long fallback = 0 ) const
+    {
+        return args[index].set ? args[index].count : fallback;
+    }
+    /**
+     * @returns the index of the keyword given, -1 if left out.
+     */
+    int get_keyword ( size_t index ) const
+    {
+        return args[index].set ? (int) args[index].count : -1;
+    }
+
+private:
+    const Spec *spec = nullptr;
+    Arg        args[max_args];
+    int        words = 0;
+};
+
+#endif // __HCS_COMMAND_H__
@@ -0,0 +1,58 @@
+#ifndef __HCS_DAEMON_H__
+#define __HCS_DAEMON_H__
+
+/**
+ * Unix socket between hcs and hcsd.
+ *
+ * hcsd keeps the power supplies open and initialized, hcs forwards its command line to it
+ * when it is running. A request is a single message:
+ *
+ *  uint32_t size of the payload
+ *  payload: working directory, HCS_DEVICE (empty if unset) and the arguments, each 0 terminated.
+ *
+ * The client's stdout and stderr are passed along with it (SCM_RIGHTS), so output of the
+ * command goes straight to the client. The reply is the exit status as int32_t.
+ * Closing the connection interrupts a running monitor.
+ */
+class Daemon
+{
+public:
+    /**
+     * @returns the socket path: $HCS_SOCKET, $XDG_RUNTIME_DIR/hcs.sock or /tmp/hcs-<uid>.sock.
+     */
+    static std::string socket_path ();
+
+    /**
+     * @param argc   Number of arguments.
+     * @param argv   The arguments.
+     * @param status Set to the exit status of the command.
+     *
+     * Run the command line in hcsd, unless HCS_NO_DAEMON is set.
+     *
+     * @returns false when no daemon is running, the caller should then run it itself.
+     */
+    static bool forward ( int argc, char **argv, int &status );
+
+    Daemon();
+    ~Daemon();
+
+    /**
+     * Create the socket, fails when another daemon is already listening on it.
+     */
+    void listen () throw ( PSUError & );
+
+    /**
+     * @param handler Runs a command line, returns the exit status.
+     *
+     * Serve requests one at a time, until SIGINT or SIGTERM.
+     */
+    void serve ( std::function<int ( int argc, char **argv )> handler );
+
+private:
+    int         sock = -1;
+    std::string path;
+
+    void handle ( int client, std::function<int ( int argc, char **argv )> &handler );
+};
+
+#endif // __HCS_DAEMON_H__
@@ -6,8 +6,8 @@
  */
 class EAPS2K : public PSU
 {
-private:
-    const int baudrate = B115200;
+public:
+    /** Protocol constants, shared with the simulator. */
     enum ErrorTypes
     {
         NO_ERROR              = 0x0,
@@ -21,22 +21,6 @@ private:
         OBJECT_OVERFLOW       = 0x30,
         OBJECT_UNDERFLOW      = 0x31
     };
-    struct
-    {
-        ErrorTypes type;
-        const char *name;
-    } ErrorTypeStr[10] =
-    {
-        { NO_ERROR,              "No error"                                   },
-        { CRC_INVALID,           "Check sum incorrect"                        },
-        { DELIMITER_INVALID,     "Start delimiter incorrect"                  },
-        { OUTPUT_ADDR_INVALID,   "Wrong address for output"                   },
-        { OBJECT_INVALID,        "Object not defined"                         },
-        { OBJECT_LENGTH_INVALID, "Object length incorrect"                    },
-        { ACCESS_VIOLATION,      "Read/Write permissions violated, no access" },
-        { DEVICE_LOCKED,         "Device is in \"Lock\" state"                },
-        { OBJECT_OVERFLOW,       "Upper limit of object exceeded"             }
-    };
     // See object table manual.
     enum ObjectTypes
     {
@@ -57,41 +41,136 @@ private:
         STATUS_ACTUAL        = 71,
         STATUS_SET           = 72,
     };
+    enum SendType
+    {
+        SEND    = 0xC0,
+        RECEIVE = 0x40
+    };
+    // Start delimiter bits: cast type and direction (from the host).
+    static const int cast_type = 0x20;
+    static const int direction = 0x10;
+
+    /**
+     * @param ba   The telegram.
+     * @param size The number of bytes to checksum.
+     *
+     * @returns the checksum, the sum of all bytes.
+     */
+    static int crc16 ( const uint8_t *ba, int size )
+    {
+        int work = 0;
+        for ( int i = 0; i < size; i++ ) {
+            work += ba[i];
+        }
+        return work & 0xFFFF;
+    }
+
+private:
+    const int baudrate = B115200;
+    struct
+    {
+        ErrorTypes type;
+        const char *name;
+    } ErrorTypeStr[10] =
+    {
+        { NO_ERROR,              "No error"                                   },
+        { CRC_INVALID,           "Check sum incorrect"                        },
+        { DELIMITER_INVALID,     "Start delimiter incorrect"                  },
+        { OUTPUT_ADDR_INVALID,   "Wrong address for output"                   },
+        { OBJECT_INVALID,        "Object not defined"                         },
+        { OBJECT_LENGTH_INVALID, "Object length incorrect"                    },
+        { ACCESS_VIOLATION,      "Read/Write permissions violated, no access" },
+        { DEVICE_LOCKED,         "Device is in \"Lock\" state"                },
+        { OBJECT_OVERFLOW,       "Upper limit of object exceeded"             }
+    };
     // These values are needed to convert the result.
     float nominal_voltage = 1;
     float nominal_current = 1;
     float nominal_power   = 1;
+    // Identity and ratings, probed or loaded from the DeviceCache.
+    Identity identity;
+    bool     identity_valid = false;
 
-    /** Telegram functions */
-
-    // Max length is SD (1) + DN (1) + OBJ (2) + CS(2) + DATA (0-16)
-    uint8_t _telegram[22]  = { 0, };
-    uint8_t _telegram_size = 0;
-
-    void telegram_validate ();
-    enum SendType
+    // Remote control state as last seen, so batches of writes do not toggle it.
+    enum class RemoteState
     {
-        SEND   =0xC0,
-        RECEIVE=0x40
+        UNKNOWN,
+        LOCAL,
+        REMOTE
     };
-    const int cast_type = 0x20;
-    const int direction = 0x10;
-    void telegram_start ( SendType dir, int size );
-    void telegram_set_object ( ObjectTypes object );
-    void telegram_push ( uint8_t val );
-    const char *telegram_get_error ( ErrorTypes type ) const;
-    void telegram_send ();
-    void telegram_receive ();
+    RemoteState remote       = RemoteState::UNKNOWN;
+    // True if this session took remote control, only then it is released on close.
+    bool        remote_taken = false;
+
+    // Transport the telegrams are queued on.
+    Channel channel;
+    // Number of telegrams written before the first reply is awaited, at most. One by default,
+    // the device's input buffer is not documented; HCS_EA_PIPELINE raises it.
+    size_t  pipeline_depth = 1;
+    // Reply timeouts per object, and how far the pipeline is opened, as learned from the replies.
+    Pacing  pacing;
 
+    /** Telegram functions */
+
+    const char *telegram_get_error ( ErrorTypes type ) const;
+    /**
+     * Wait until all queued telegrams are answered.
+     * The round trip time of the last one is stored in last_round_trip.
+     */
+    void telegram_wait ();
+    /**
+     * @param telegram The received telegram.
+     *
+     * Throw an error when the telegram is an error reply, and count it.
+     */
+    void telegram_check_error ( const uint8_t *telegram );
+    /**
+     * @param telegram A STATUS_ACTUAL reply.
+     *
+     * Update the remote state from the reply.
+     */
+    void update_remote ( const uint8_t *telegram );
+    /**
+     * Queue taking remote control, if not already held. Called before each write.
+     */
+    void queue_remote ( Channel &channel );
+    /**
+     * Queue a telegram on channel.
+     * For SEND, value is send as the 2 data bytes. on_reply is called with
+     * the reply after the CRC and error checks passed. It is stored in the request
+     * as is: a callback capturing no more than two pointers does not allocate.
+     */
+    void queue_telegram ( Channel &channel, SendType dir, int size, ObjectTypes object, uint16_t value,
+                          std::function<void(const uint8_t *telegram, size_t size)> on_reply );
     /**
-     * Set the crc of the telegram.
+     * Decode the replies to STATUS_SET, STATUS_ACTUAL and the OVP/OCP thresholds.
      */
-    void telegram_crc_set ();
+    void decode_status_set ( const uint8_t *telegram, Snapshot &snapshot ) const;
+    void decode_status_actual ( const uint8_t *telegram, Snapshot &snapshot ) const;
+    void decode_threshold ( const uint8_t *telegram, ObjectTypes object, Snapshot &snapshot ) const;
+    /**
+     * @param object The string object to read.
+     * @param value  Set to the string value of object when the reply arrives.
+     */
+    void queue_read_string ( ObjectTypes object, std::string &value );
+    /**
+     * Queue the reads of the identity strings and the nominal ratings.
+     */
+    void queue_identity ();
+    void queue_nominal ();
+    void probe_identity ();
+    /**
+     * Fill in the ratings part of identity from the nominal values.
+     */
+    void set_identity_ratings ();
 
     /**
-     * Check the crc of the telegram.
+     * @param serial The serial number reported by the device.
+     *
+     * @returns true when the cache had a valid entry for serial.
      */
-    bool telegram_crc_check ();
+    bool load_cache ( const std::string &serial );
+    void store_cache () const;
 
     void init ();
 
@@ -115,12 +194,33 @@ public:
     float get_over_current () throw ( PSUError & );
 
     OperatingMode get_operating_mode () throw( PSUError & );
+    void read_snapshot ( Snapshot &snapshot, unsigned int fields = SNAPSHOT_ALL ) throw( PSUError & );
     void set_voltage ( float value ) throw( PSUError & );
     void set_current ( float value ) throw( PSUError & );
     void set_over_voltage ( float value ) throw( PSUError & );
     void set_over_current ( float value ) throw( PSUError & );
 
     void print_device_info () throw( PSUError & );
+    void get_identity ( Identity &identity ) throw( PSUError & );
+    const char *get_device_error_str ( int code ) const;
+
+    size_t reply_length ( const uint8_t *buffer, size_t size ) const;
+    bool is_reply_start ( uint8_t byte ) const;
+    const char *check_reply ( const uint8_t *request, size_t request_size,
+                              const uint8_t *reply, size_t size ) const;
+    void check_reply_error ( const uint8_t *reply, size_t size ) throw( PSUError & );
+    size_t get_pipeline_depth () const
+    {
+        return pacing.get_depth ();
+    }
+    int64_t get_write_gap () const
+    {
+        return pacing.get_gap ();
+    }
+    void exchange_done ( const uint8_t *request, size_t size, int64_t latency, bool ok );
+    void print_pacing ( FILE *out ) const;
+    void queue_operation ( Channel &channel, Operation op, float value,
+                           Snapshot *snapshot, unsigned int fields = SNAPSHOT_ALL ) throw( PSUError & );
 
     EAPS2K();
     ~EAPS2K();
@@ -0,0 +1,74 @@
+#ifndef __HCS_ENERGY_H__
+#define __HCS_ENERGY_H__
+
+/**
+ * Energy and charge delivered by the power supply.
+ *
+ * The actual voltage and current are read back to back, as fast as the device answers, and the
+ * power and current are integrated over the monotonic clock with the trapezoidal rule. Each
+ * sample is timed at the middle of its read, the best estimate of when the device measured it.
+ *
+ * The totals are kept in a checkpoint file: $HCS_ENERGY_FILE or a cache entry per device (see
+ * DeviceCache). It is written every second and at the end of a run, and a run adds to what is
+ * in it, so an interrupted measurement resumes where it left off. The time between the last
+ * checkpoint and the restart is not counted.
+ */
+class Energy
+{
+public:
+    struct Totals
+    {
+        // In J, C and s.
+        double   energy  = 0.0;
+        double   charge  = 0.0;
+        double   time    = 0.0;
+        uint64_t samples = 0;
+    };
+
+    /**
+     * @param psu The (opened) power supply.
+     *
+     * Load the checkpoint of the power supply, if there is one.
+     */
+    Energy( PSU *psu ) throw ( PSUError & );
+
+    /**
+     * @param duration How long to run (in ns), 0 until stopped.
+     * @param out      File to write a line with the totals to at every checkpoint, nullptr for none.
+     *
+     * Integrate until the duration passed or SIGINT. The checkpoint is also written when a read fails.
+     */
+    void run ( int64_t duration, FILE *out ) throw ( PSUError & );
+
+    /**
+     * Clear the totals and the checkpoint.
+     */
+    void reset () throw ( PSUError & );
+
+    /**
+     * @param out The file to print the totals in the checkpoint to.
+     */
+    void print_totals ( FILE *out ) const;
+
+    /**
+     * @param out The file to write the report to.
+     *
+     * Print the sample rate, the largest interval between samples and what the last run added.
+     */
+    void print_report ( FILE *out ) const;
+
+private:
+    PSU         *psu;
+    DeviceCache checkpoint;
+    // What was in the checkpoint before the run, and what the run added.
+    Totals      base;
+    Totals      added;
+    int64_t     max_interval = 0;
+
+    /**
+     * Write base plus added to the checkpoint file.
+     */
+    void store () throw ( PSUError & );
+};
+
+#endif // __HCS_ENERGY_H__
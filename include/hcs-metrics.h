@@ -0,0 +1,80 @@
+#ifndef __HCS_METRICS_H__
+#define __HCS_METRICS_H__
+
+/**
+ * Exports the state of the open power supplies in the Prometheus text format.
+ *
+ * The page is built on the thread that owns the power supplies, from their last known snapshot
+ * (see PSU::get_last_snapshot ()), identity and transport counters, so serving it never talks
+ * to a device. It is either served over HTTP on the loopback interface by a thread of its own,
+ * or written to a file that is replaced atomically, for the textfile collector of the node
+ * exporter.
+ *
+ * Every series is labelled with the device node, type and serial number of its power supply.
+ */
+class Metrics
+{
+public:
+    // Rebuild the page at most this often (in ns), unless forced.
+    static const int64_t refresh_interval = 1000000000LL;
+
+    /**
+     * @param target A TCP port to serve on (on 127.0.0.1), or the file to write.
+     *
+     * @throws PSUError when the port can not be bound.
+     */
+    Metrics( const std::string &target ) throw ( PSUError & );
+    ~Metrics();
+
+    /**
+     * @param psus The power supplies to export, owned by the caller.
+     *
+     * Set the power supplies to export from now on. They are only used in update ().
+     */
+    void set_devices ( const std::vector<PSU *> &psus );
+
+    /**
+     * @param force Rebuild even if the page was rebuilt less than refresh_interval ago.
+     *
+     * Rebuild the page from the last known state of the power supplies.
+     */
+    void update ( bool force = false );
+
+    /**
+     * @returns where the metrics go, a port or a file.
+     */
+    const std::string &get_target () const
+    {
+        return target;
+    }
+
+private:
+    std::string         target;
+    // Listening socket when serving, -1 when writing a file.
+    int                 sock    = -1;
+    // Written to, to stop the server thread.
+    int                 wake[2] = { -1, -1 };
+    std::thread         server;
+    std::mutex          lock;
+    // The current page, shared with the server thread under lock.
+    std::string         page;
+    std::vector<PSU *>  psus;
+    int64_t             last_update = 0;
+
+    /**
+     * @returns the page for the current state of the power supplies.
+     */
+    std::string render () const;
+
+    /**
+     * The server thread.
+     */
+    void serve ();
+
+    /**
+     * @param client Connection to answer a request on.
+     */
+    void handle ( int client );
+};
+
+#endif // __HCS_METRICS_H__
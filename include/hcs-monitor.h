@@ -0,0 +1,95 @@
+#ifndef __HCS_MONITOR_H__
+#define __HCS_MONITOR_H__
+
+class CaptureWriter;
+class Metrics;
+
+/**
+ * Samples a power supply at a fixed period (or as fast as possible)
+ * and streams timestamped samples to a file.
+ */
+class Monitor
+{
+public:
+    enum class Format
+    {
+    CSV,
+    NDJSON,
+    CAPTURE
+    };
+
+    /**
+     * @param psu    The (opened) power supply to sample.
+     * @param out    The file to write the samples to.
+     * @param format The format of the samples.
+     */
+    Monitor( PSU *psu, FILE *out, Format format );
+    /**
+     * @param psu     The (opened) power supply to sample.
+     * @param capture The capture file to append the samples to.
+     */
+    Monitor( PSU *psu, CaptureWriter *capture );
+
+    /**
+     * @param interval The sample period (in ns), 0 to sample as fast as the device allows.
+     * @param count    The number of samples to take, 0 to run until interrupted (SIGINT).
+     *
+     * Sample the power supply. Samples are scheduled on absolute CLOCK_MONOTONIC deadlines,
+     * ticks that are missed completely are skipped, not made up for.
+     */
+    void run ( int64_t interval, unsigned long count ) throw ( PSUError & );
+
+    /**
+     * @param out The file to write the report to.
+     *
+     * Print achieved sample rate and jitter of the last run.
+     */
+    void print_report ( FILE *out ) const;
+
+    /**
+     * @param name The name of the format, "csv", "ndjson" or "capture".
+     * @param format Set to the parsed format.
+     *
+     * @returns true when name is a valid format.
+     */
+    static bool parse_format ( const char *name, Format &format );
+
+    /**
+     * @param metrics Exporter to refresh while sampling, nullptr for none.
+     *
+     * The settings and protection levels are read once at the start of a run, so the exporter
+     * has them too.
+     */
+    void set_metrics ( Metrics *metrics )
+    {
+        this->metrics = metrics;
+    }
+
+private:
+    PSU           *psu;
+    FILE          *out;
+    Format        format;
+    CaptureWriter *capture = nullptr;
+    Metrics       *metrics = nullptr;
+
+    // Statistics of the last run.
+    int64_t       interval  = 0;
+    unsigned long samples   = 0;
+    unsigned long missed    = 0;
+    int64_t       first     = 0;
+    int64_t       last      = 0;
+    // Running mean and variance (Welford) of the time between samples (ns).
+    double        dt_mean   = 0.0;
+    double        dt_m2     = 0.0;
+    int64_t       dt_min    = 0;
+    int64_t       dt_max    = 0;
+    // Time samples started after their deadline (ns), fixed period only.
+    double        late_sum  = 0.0;
+    int64_t       late_max  = 0;
+
+    void write_header ();
+    void write_sample ( int64_t timestamp, const PSU::Snapshot &snapshot );
+    void add_statistics ( int64_t timestamp, int64_t lateness );
+    void flush ();
+};
+#endif // __HCS_MONITOR_H__
@@ -0,0 +1,120 @@
+#ifndef __HCS_PACING_H__
+#define __HCS_PACING_H__
+
+/**
+ * Learns how hard a device can be driven.
+ *
+ * Reply latencies are kept per request type (e.g. the EA object) over the last window_size
+ * replies. Once half the window is filled, the reply timeout of a type follows from the 99th
+ * percentile of its window, so a fast unit does not wait as long as a slow one for a lost
+ * reply. It does not drop below a tenth of the default timeout.
+ *
+ * The gap between writes is not derived from the latencies: a reply only says when the device
+ * was done, not how much of its input buffer was free. Errors back off instead: the number of
+ * requests in flight is halved and a gap between writes is started or doubled. Every good reply shrinks the gap by an eighth, so errors that come from
+ * driving the device too hard push it up while the odd corrupt reply hardly slows down. Once
+ * the gap is gone, the pipeline opens a step per recover_after good replies in a row.
+ *
+ * The result can be stored in and loaded from a DeviceCache entry, so the next session starts
+ * from what was learned.
+ */
+class Pacing
+{
+public:
+    static const size_t       window_size   = 64;
+    static const unsigned int recover_after = 16;
+
+    /**
+     * @param max_depth       Maximum number of requests in flight.
+     * @param default_timeout Timeout (in ns) for types without enough samples, and the upper limit.
+     */
+    Pacing( size_t max_depth, int64_t default_timeout );
+
+    void set_max_depth ( size_t depth );
+    void set_default_timeout ( int64_t timeout );
+
+    /**
+     * @param type    The type of request.
+     * @param latency Time from writing the request until its reply arrived (in ns).
+     *
+     * Record a successful exchange.
+     */
+    void add_sample ( int type, int64_t latency );
+
+    /**
+     * Record an error: a lost or corrupt reply, or the device complaining about a garbled request.
+     */
+    void backoff ();
+
+    /**
+     * @param type The type of request.
+     *
+     * @returns the time to wait for the reply (in ns).
+     */
+    int64_t get_timeout ( int type ) const;
+
+    /**
+     * @returns the minimum time between writing two requests (in ns).
+     */
+    int64_t get_gap () const
+    {
+        return gap;
+    }
+
+    /**
+     * @returns the number of requests that may be in flight.
+     */
+    size_t get_depth () const
+    {
+        return depth;
+    }
+
+    /**
+     * @param cache The entry to read from.
+     *
+     * Start from a stored profile.
+     */
+    void load ( const DeviceCache &cache );
+
+    /**
+     * @param cache The entry to write to, stored by the caller.
+     *
+     * The samples of this session are folded into the loaded profile, so short sessions add to it.
+     *
+     * @returns true if the entry changed.
+     */
+    bool store ( DeviceCache &cache ) const;
+
+    /**
+     * @param out File to print the learned latencies and pacing to.
+     */
+    void print ( FILE *out ) const;
+
+private:
+    struct Window
+    {
+        int64_t samples[window_size];
+        size_t  count = 0;
+        size_t  next  = 0;
+        // The 99th percentile loaded from a profile, used until the window has enough samples.
+        int64_t learned = 0;
+    };
+    std::map<int, Window> windows;
+    size_t                max_depth;
+    size_t                depth;
+    int64_t               default_timeout;
+    int64_t               gap       = 0;
+    unsigned int          successes = 0;
+
+    /**
+     * @returns the percentile (0-100) of the samples in window, 0 if it has too few.
+     */
+    static int64_t percentile ( const Window &window, double percentile );
+
+    /**
+     * @returns the 99th percentile of window blended into its learned value, 0 if neither is known.
+     */
+    static int64_t estimate ( const Window &window );
+};
+
+#endif // __HCS_PACING_H__
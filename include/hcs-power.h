@@ -0,0 +1,73 @@
+#ifndef __HCS_POWER_H__
+#define __HCS_POWER_H__
+
+/**
+ * Constant power output, regulated in software.
+ *
+ * A closed loop reads the actual voltage and current and moves the voltage setpoint until their
+ * product matches the requested power. The PI controller is tuned to the loop's dead time, taken
+ * from the measured round trip of a read, and scales its steps by the local slope of power
+ * against voltage, so it behaves the same on any load. Integration stops while the setpoint is at
+ * its limit or the supply is in current limit.
+ *
+ * The loop runs as fast as the device answers, so its rate is also a measure of the latency of
+ * the read and write path.
+ */
+class ConstantPower
+{
+public:
+    /**
+     * @param psu The (opened) power supply, with its output on.
+     */
+    ConstantPower( PSU *psu );
+
+    /**
+     * @param watts    The power to regulate to.
+     * @param duration How long to run (in ns), 0 until stopped.
+     * @param limit    Highest voltage to set, 0 for the protection level or rating of the supply.
+     * @param out      File to write a line per iteration to as it runs, nullptr for none.
+     *
+     * Run the loop. Stops early on SIGINT, the voltage is left where the loop had it.
+     */
+    void run ( float watts, int64_t duration, float limit, FILE *out ) throw ( PSUError & );
+
+    /**
+     * @param out The file to write the report to.
+     *
+     * Print the loop rate, the controller tuning, the settling time and the steady state error
+     * of the last run.
+     */
+    void print_report ( FILE *out ) const;
+
+private:
+    PSU           *psu;
+    float         target     = 0.0f;
+    // Measured round trip of a read (in ns) and the resulting gains.
+    int64_t       round_trip = 0;
+    double        kp         = 0.0;
+    double        ki         = 0.0;
+    unsigned long iterations = 0;
+    unsigned long writes     = 0;
+    // Offset from the start of the loop of the first and last iteration (in ns).
+    int64_t       first      = 0;
+    int64_t       last       = 0;
+    // The iterations since the power last left the settling band: how many, the offset of the
+    // first, and the sum of their errors and squared errors.
+    unsigned long settled    = 0;
+    int64_t       settle     = 0;
+    double        error_sum  = 0.0;
+    double        error_sq   = 0.0;
+
+    /**
+     * @param time        Offset from the start of the loop (in ns).
+     * @param voltage_set The voltage setpoint during the read.
+     * @param voltage     The actual voltage read.
+     * @param current     The actual current read.
+     * @param out         File to write the line for the iteration to, nullptr for none.
+     *
+     * Account for an iteration.
+     */
+    void add ( int64_t time, float voltage_set, float voltage, float current, FILE *out );
+};
+
+#endif // __HCS_POWER_H__
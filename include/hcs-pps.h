@@ -1,6 +1,75 @@
 #ifndef __HCS_PPS_H__
 #define __HCS_PPS_H__
 
+/**
+ * Splits what a PPS sends into replies.
+ *
+ * Bytes are read into a ring buffer and scanned once for the 'OK' + line end that closes every
+ * reply, so a reply split over several reads, or several replies in one read, are both handled
+ * without copying. Replies are handed out as a pointer and length into the buffer.
+ */
+class ReplyReader
+{
+public:
+    /**
+     * A reply, valid until the next call to read ().
+     */
+    struct View
+    {
+        const char *data = nullptr;
+        size_t     size  = 0;
+    };
+
+    /**
+     * @param fd       The device to read from.
+     * @param deadline Absolute CLOCK_MONOTONIC deadline (in ns).
+     * @param stats    The counters to update.
+     *
+     * Wait for the next full reply. On a timeout pending input is dropped, so a late reply is
+     * not taken for the answer to the next command.
+     *
+     * @returns the reply up to (not including) the 'OK' that ends it.
+     */
+    View read ( int fd, int64_t deadline, PSU::Stats &stats ) throw ( PSUError & );
+
+    /**
+     * @returns the CLOCK_MONOTONIC time (in ns) the first byte of the last reply arrived.
+     */
+    int64_t get_first_byte () const
+    {
+        return first_byte;
+    }
+
+    /**
+     * Drop everything buffered.
+     */
+    void reset ()
+    {
+        head = tail = scan = 0;
+    }
+
+private:
+    // Power of two, so positions can run on and be masked.
+    static const size_t ring_size = 256;
+    char                ring[ring_size];
+    // Frames that wrap around the end of the ring are made contiguous here.
+    char                frame[ring_size];
+    // Start of the unread data, end of the data and how far it has been scanned for 'OK'.
+    size_t              head       = 0;
+    size_t              tail       = 0;
+    size_t              scan       = 0;
+    int64_t             first_byte = 0;
+
+    char at ( size_t position ) const
+    {
+        return ring[position & ( ring_size - 1 )];
+    }
+    /**
+     * @returns the length of the first full reply, 0 if there is none yet.
+     */
+    size_t find_frame ();
+};
+
 class PPS11360 : public PSU
 {
 public:
@@ -25,13 +94,100 @@ public:
 
     PSU::OperatingMode get_operating_mode() throw ( PSUError & );
 
+    void read_snapshot ( Snapshot &snapshot, unsigned int fields = SNAPSHOT_ALL ) throw ( PSUError & );
+
+    size_t reply_length ( const uint8_t *buffer, size_t size ) const;
+    void queue_operation ( Channel &channel, Operation op, float value,
+                           Snapshot *snapshot, unsigned int fields = SNAPSHOT_ALL ) throw ( PSUError & );
+
+    void get_identity ( Identity &identity ) throw ( PSUError & );
+
+    /**
+     * @param age The maximum age (in ns) of a cached reply.
+     *
+     * Set how long the per-field getters reuse the last GETD/GETS reply.
+     * 0 makes every getter query the device.
+     */
+    void set_max_age ( int64_t age ) noexcept
+    {
+        max_age = age;
+    }
+    int64_t get_max_age () const noexcept
+    {
+        return max_age;
+    }
+
 private:
+    // Decoded GETD reply: actual values and limiter state.
+    struct Telemetry
+    {
+        float         voltage   = 0.0f;
+        float         current   = 0.0f;
+        // Values as send by the device, 10mV and 10mA per count.
+        int32_t       voltage_raw = 0;
+        int32_t       current_raw = 0;
+        OperatingMode mode      = OperatingMode::CV;
+        // CLOCK_MONOTONIC time of the reply (in ns), 0 when not valid.
+        int64_t       timestamp = 0;
+    };
+    // Decoded GETS reply: set voltage and current.
+    struct Setpoints
+    {
+        float   voltage   = 0.0f;
+        float   current   = 0.0f;
+        int64_t timestamp = 0;
+    };
+    Telemetry telemetry;
+    Setpoints setpoints;
+    // Maximum age of cached replies (in ns), default 100ms.
+    int64_t   max_age = 100000000LL;
+
     void init ();
     void uninitialize ();
     void get_voltage_current ( float &voltage, float &current );
 
+    /**
+     * @param max_age Reuse the last reply when it is younger than this (in ns).
+     *
+     * Read actual voltage, current and mode with a single GETD.
+     */
+    const Telemetry &read_telemetry ( int64_t max_age );
+    /**
+     * @param max_age Reuse the last reply when it is younger than this (in ns).
+     *
+     * Read set voltage and current with a single GETS.
+     */
+    const Setpoints &read_setpoints ( int64_t max_age );
+    /**
+     * Decode a GETD (VVVVCCCCM) and GETS (VVVCCC) reply, fixed width fields of digits.
+     * Throws when the reply does not have them.
+     */
+    void decode_telemetry ( const ReplyReader::View &reply, Telemetry &telemetry ) const throw ( PSUError & );
+    void decode_setpoints ( const ReplyReader::View &reply, Setpoints &setpoints ) const throw ( PSUError & );
+    /**
+     * Queue command on channel, on_reply gets the reply up to the closing 'OK'.
+     */
+    void queue_cmd ( Channel &channel, const char *command, const char *arg,
+                     std::function<void(const ReplyReader::View &reply)> on_reply );
+    /**
+     * Drop cached replies, called after changing the device state.
+     */
+    void invalidate () noexcept
+    {
+        telemetry.timestamp = 0;
+        setpoints.timestamp = 0;
+    }
+
+    // When the last command started and finished being written, for the Timing.
+    int64_t     cmd_start = 0;
+    int64_t     cmd_sent  = 0;
+    ReplyReader reader;
+
     void send_cmd ( const char *command, const char *arg );
 
-    size_t read_cmd ( char *buffer, size_t max_length );
+    /**
+     * Wait for the reply to the last command sent, at most reply_timeout.
+     */
+    ReplyReader::View read_cmd () throw ( PSUError & );
 };
 #endif // __HCS_PPS_H__
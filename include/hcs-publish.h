@@ -0,0 +1,63 @@
+#ifndef __HCS_PUBLISH_H__
+#define __HCS_PUBLISH_H__
+
+/**
+ * Polls a power supply and publishes its samples in a shared memory segment, see hcs-shm.h.
+ *
+ * The segment is created when the publisher is, and removed again when it is destroyed;
+ * readers that still have it open keep their mapping. A segment left behind by a publisher
+ * that died is taken over, one of a publisher that still runs is not.
+ */
+class Publisher
+{
+public:
+    /**
+     * @param psu  The (opened) power supply.
+     * @param name Name of the segment, nullptr for '/hcs-<serial>' or '/hcs-<device node>' when
+     *             the power supply has no serial number.
+     *
+     * @throws PSUError when the segment can not be created or is in use.
+     */
+    Publisher( PSU *psu, const char *name ) throw ( PSUError & );
+    ~Publisher();
+
+    /**
+     * @param interval Time between samples (in ns), 0 for as fast as the device answers.
+     * @param count    Number of samples to publish, 0 until stopped.
+     *
+     * Publish samples until count is reached or SIGINT.
+     */
+    void run ( int64_t interval, unsigned long count ) throw ( PSUError & );
+
+    /**
+     * @returns the name of the segment.
+     */
+    const std::string &get_name () const
+    {
+        return name;
+    }
+
+    /**
+     * @param out The file to write the report to.
+     *
+     * Print the segment name and the achieved sample rate.
+     */
+    void print_report ( FILE *out ) const;
+
+private:
+    PSU           *psu;
+    std::string   name;
+    ShmSegment    *segment = nullptr;
+    unsigned long samples  = 0;
+    int64_t       first    = 0;
+    int64_t       last     = 0;
+
+    /**
+     * @param sample The sample to add.
+     *
+     * Write sample into the ring under the sequence lock.
+     */
+    void publish ( const ShmSample &sample );
+};
+
+#endif // __HCS_PUBLISH_H__
@@ -0,0 +1,70 @@
+#ifndef __HCS_REGISTRY_H__
+#define __HCS_REGISTRY_H__
+
+struct udev;
+struct udev_monitor;
+struct udev_device;
+
+/**
+ * List of connected power supplies, kept current by udev.
+ *
+ * The tty subsystem is scanned once, on first use. After that the registry follows
+ * the udev add and remove events from a netlink monitor, so listing devices does not
+ * rescan and callers learn about unplugged supplies as soon as udev does.
+ *
+ * Without libudev the registry is always empty.
+ */
+class DeviceRegistry
+{
+public:
+    struct Entry
+    {
+        PSU::PSUTypes type;
+        // Device node, e.g. /dev/ttyACM0.
+        std::string   device_name;
+        // The udev ID_SERIAL property, empty if not known.
+        std::string   serial;
+    };
+
+    DeviceRegistry();
+    ~DeviceRegistry();
+
+    /**
+     * Process pending udev events, doing the initial scan on the first call.
+     *
+     * @returns true when devices were added or removed.
+     */
+    bool update ();
+
+    /**
+     * @returns the connected power supplies, in order of appearance.
+     */
+    const std::vector<Entry> &get_devices ()
+    {
+        update ();
+        return devices;
+    }
+
+    /**
+     * @returns the file descriptor to poll for udev events, -1 when not monitoring.
+     */
+    int get_fd () const;
+
+    /**
+     * Called from update () for every supply that appeared or disappeared.
+     */
+    std::function<void ( const Entry &entry )> on_add;
+    std::function<void ( const Entry &entry )> on_remove;
+
+private:
+    std::vector<Entry>    devices;
+    bool                  scanned = false;
+    // Opaque, so the layout does not depend on HAVE_LIBUDEV_H.
+    struct udev           *ud      = nullptr;
+    struct udev_monitor   *monitor = nullptr;
+
+    void add ( struct udev_device *dev, bool notify );
+    void remove ( struct udev_device *dev );
+};
+
+#endif // __HCS_REGISTRY_H__
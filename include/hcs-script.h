@@ -0,0 +1,78 @@
+#ifndef __HCS_SCRIPT_H__
+#define __HCS_SCRIPT_H__
+
+/**
+ * Batch script, compiled once and then executed.
+ *
+ * A script has a command per line, '#' starts a comment. Besides the hcs commands it knows:
+ *
+ *  wait <seconds>   Sleep for a while.
+ *  until <seconds>  Sleep until this long after the start of the script.
+ *  loop [count]     Repeat the lines up to the matching 'end' count times, forever without count.
+ *  end              End of a loop.
+ *
+ * The whole script is checked before anything runs, all errors are reported at once. Commands
+ * are parsed with their arguments when compiling, running one is a call with the parsed command.
+ */
+class Script
+{
+public:
+    enum class Op
+    {
+    // An hcs command.
+    COMMAND,
+    WAIT,
+    UNTIL,
+    LOOP,
+    END
+    };
+
+    struct Instruction
+    {
+        Op            op;
+        // Line in the script, for errors.
+        unsigned int  line  = 0;
+        // Time to wait (in ns).
+        int64_t       time  = 0;
+        // LOOP: number of iterations, 0 for endless. Also the index of its counter.
+        unsigned long count = 0;
+        size_t        loop  = 0;
+        // END: the matching LOOP.
+        size_t        jump  = 0;
+        // COMMAND: the command, its words are kept by the script.
+        Command       command;
+    };
+
+    /**
+     * @param file The script to compile.
+     *
+     * @throws PSUError listing every error in the script.
+     */
+    Script( const char *file ) throw ( PSUError & );
+
+    /**
+     * @param psu     Returns the power supply waiting is counted on, nullptr for none.
+     * @param execute Runs an hcs command, throws PSUError when it failed.
+     *
+     * Execute the script. Stops early on SIGINT.
+     */
+    void run ( std::function<PSU *( )> psu, std::function<void ( const Command &command )> execute ) throw ( PSUError & );
+
+    const std::vector<Instruction> &get_instructions () const
+    {
+        return instructions;
+    }
+
+private:
+    std::string              name;
+    std::vector<Instruction> instructions;
+    // Storage for the words the commands refer to, never moves its elements.
+    std::deque<std::string>  words;
+    // Number of loops, for the counters.
+    size_t                   loops = 0;
+
+    void compile_line ( const std::vector<std::string> &tokens, unsigned int line,
+                        std::vector<size_t> &open_loops, std::vector<std::string> &errors );
+};
+
+#endif // __HCS_SCRIPT_H__
@@ -0,0 +1,86 @@
+#ifndef __HCS_SEQUENCE_H__
+#define __HCS_SEQUENCE_H__
+
+/**
+ * Applies a list of setpoints to a power supply on a fixed time line.
+ *
+ * Every step is issued on its absolute CLOCK_MONOTONIC deadline, relative to the start of
+ * the run. A step whose successor is already due when it comes up is skipped, so a slow
+ * device makes the sequence coarser instead of making it drift. The setpoints of a skipped
+ * step are applied with the next step that leaves them unchanged.
+ */
+class Sequence
+{
+public:
+    struct Step
+    {
+        // Offset from the start of the sequence (in ns).
+        int64_t time    = 0;
+        // Setpoints, NAN to leave unchanged.
+        float   voltage = NAN;
+        float   current = NAN;
+        // Filled in by run (): issue time relative to the deadline (in ns), and if it was
+        // applied or skipped for being late.
+        int64_t error   = 0;
+        bool    applied = false;
+        bool    skipped = false;
+    };
+
+    enum class Shape
+    {
+    LINEAR,
+    EXPONENTIAL
+    };
+
+    /**
+     * @param psu The (opened) power supply.
+     */
+    Sequence( PSU *psu );
+
+    /**
+     * @param spec Comma separated time:voltage[:current] points, time in seconds, or the name
+     *             of a file with a 'time voltage [current]' point per line ('#' starts a comment).
+     *             A '-' leaves the voltage as it is.
+     *
+     * Set the steps from a list of points, times have to increase.
+     */
+    void load ( const char *spec ) throw ( PSUError & );
+
+    /**
+     * @param current  Ramp the current instead of the voltage.
+     * @param from     Start value.
+     * @param to       End value.
+     * @param duration Length of the ramp (in ns).
+     * @param steps    Number of steps, including start and end.
+     * @param shape    Linear or exponential (constant ratio between steps, values > 0).
+     *
+     * Set the steps to a ramp.
+     */
+    void ramp ( bool current, float from, float to, int64_t duration, unsigned int steps,
+                Shape shape ) throw ( PSUError & );
+
+    /**
+     * @param out File to write a line per step to, nullptr for none.
+     *
+     * Apply the steps. Stops early on SIGINT.
+     */
+    void run ( FILE *out ) throw ( PSUError & );
+
+    /**
+     * @param out The file to write the report to.
+     *
+     * Print the achieved update rate and the timing error of the last run.
+     */
+    void print_report ( FILE *out ) const;
+
+private:
+    PSU               *psu;
+    std::vector<Step> steps;
+    // Start and end of the last run.
+    int64_t           first = 0;
+    int64_t           last  = 0;
+
+    void add_step ( int64_t time, float voltage, float current ) throw ( PSUError & );
+};
+
+#endif // __HCS_SEQUENCE_H__
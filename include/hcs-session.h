@@ -0,0 +1,101 @@
+#ifndef __HCS_SESSION_H__
+#define __HCS_SESSION_H__
+
+/**
+ * A set of opened power supplies that are driven together from one epoll loop.
+ *
+ * Every device has its own Channel (the per device protocol state machine), the loop
+ * writes requests to each device as soon as it can take them and dispatches replies
+ * as they come in. A command on N devices takes about as long as the slowest single
+ * exchange, not the sum of them.
+ */
+class Session
+{
+public:
+    struct Device
+    {
+        std::string   name;
+        PSU           *psu;
+        Channel       channel;
+        // Result of the last SNAPSHOT operation.
+        PSU::Snapshot snapshot;
+        // Error of the last operation, empty if it succeeded.
+        std::string   error;
+        // Events currently registered with epoll.
+        uint32_t      events = 0;
+
+        Device( const std::string &name, PSU *psu ) : name ( name ), psu ( psu ), channel ( psu )
+        {
+        }
+    };
+
+    Session() throw ( PSUError & );
+    ~Session();
+
+    /**
+     * @param name The name to address the device by.
+     * @param psu  The opened power supply, the session takes ownership.
+     */
+    void add ( const std::string &name, PSU *psu ) throw ( PSUError & );
+
+    /**
+     * @param device The device to close, it is removed from the groups too.
+     */
+    void remove ( Device *device );
+
+    /**
+     * Close and remove all devices and groups.
+     */
+    void clear ();
+
+    bool empty () const
+    {
+        return devices.empty ();
+    }
+
+    const std::vector<Device *> &get_devices () const
+    {
+        return devices;
+    }
+
+    /**
+     * @param name    The name of the group.
+     * @param members Comma separated list of device names.
+     */
+    void add_group ( const std::string &name, const char *members ) throw ( PSUError & );
+
+    /**
+     * @param target 'all', a group name or a device name.
+     *
+     * @returns the devices target refers to.
+     */
+    std::vector<Device *> resolve ( const std::string &target ) const throw ( PSUError & );
+
+    /**
+     * @param targets The devices to run the operation on.
+     * @param op      The operation.
+     * @param value   The value for the SET_ operations.
+     * @param fields  For SNAPSHOT, the fields to read.
+     *
+     * Run an operation on all targets concurrently. The result and error of each
+     * device are stored in the Device.
+     *
+     * @returns the number of devices that failed.
+     */
+    unsigned int execute ( const std::vector<Device *> &targets, PSU::Operation op, float value = 0.0f,
+                           unsigned int fields = PSU::SNAPSHOT_ALL );
+
+    /**
+     * Run the event loop until all channels are idle.
+     */
+    void run ();
+
+private:
+    int                                           epfd = -1;
+    std::vector<Device *>                         devices;
+    std::map<std::string, std::vector<Device *> > groups;
+
+    void update_events ( Device *device );
+};
+
+#endif // __HCS_SESSION_H__
@@ -0,0 +1,261 @@
+#ifndef __HCS_SHM_H__
+#define __HCS_SHM_H__
+
+/**
+ * Live samples of a power supply in POSIX shared memory.
+ *
+ * 'hcs publish' polls one power supply and writes every sample into a shared memory segment,
+ * any number of other processes can follow it with ShmReader without talking to the device.
+ * This header does not depend on the rest of hcs, so it can be copied into other programs.
+ *
+ * The segment holds the identity of the power supply and a ring of the last SHM_HISTORY
+ * samples, guarded by a sequence lock: the publisher makes the sequence odd, writes the next
+ * sample, bumps the count and makes the sequence even again. A reader copies what it needs
+ * and checks the sequence did not change meanwhile, otherwise it copies again. The publisher
+ * never waits on readers and readers never write to the segment, so they can not slow down
+ * the publisher or each other; a read only has to be repeated when it overlapped a write,
+ * which takes well under a microsecond every few milliseconds.
+ *
+ * Times are CLOCK_MONOTONIC, so they compare with the clock of any process on the host.
+ */
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SHM_MAGIC      0x314D4853
+#define SHM_VERSION    1
+// Number of samples kept, a power of two.
+#define SHM_HISTORY    1024
+
+struct ShmSample
+{
+    // CLOCK_MONOTONIC time of the sample (in ns), the middle of its read.
+    int64_t  time;
+    float    voltage;
+    float    current;
+    // 0: output off, 1: constant voltage, 2: constant current.
+    uint32_t mode;
+    uint32_t reserved;
+};
+
+struct ShmSegment
+{
+    // Written last by the publisher, a reader has to wait for it.
+    std::atomic<uint32_t> magic;
+    uint32_t              version;
+    // sizeof ( ShmSegment ) and SHM_HISTORY of the publisher.
+    uint32_t              size;
+    uint32_t              history_size;
+    // Process id of the publisher.
+    int32_t               pid;
+    uint32_t              reserved;
+    char                  manufacturer[16];
+    char                  type[32];
+    char                  serial[32];
+    char                  device[64];
+    float                 nominal_voltage;
+    float                 nominal_current;
+    float                 nominal_power;
+    // Time between samples (in ns), 0 when sampling as fast as the device answers.
+    int64_t               interval;
+    // Odd while the publisher is writing, on a cache line of its own.
+    alignas ( 64 ) std::atomic<uint64_t> sequence;
+    // Number of samples published, the latest is history[( count - 1 ) % SHM_HISTORY].
+    uint64_t              count;
+    ShmSample             history[SHM_HISTORY];
+};
+
+/**
+ * Result of reading from a segment.
+ */
+enum class ShmStatus
+{
+    // Read a consistent copy.
+    OK,
+    // Nothing was published yet.
+    EMPTY,
+    // Every attempt overlapped a write, the publisher is stalled or died half way. Try again later.
+    BUSY,
+    // No segment is open.
+    CLOSED
+};
+
+/**
+ * Follows a segment written by 'hcs publish'.
+ */
+class ShmReader
+{
+public:
+    // Give up on a read after this many overlapping writes.
+    static const unsigned int max_attempts = 1000;
+
+    ShmReader()
+    {
+    }
+    ShmReader( const ShmReader & ) = delete;
+    ShmReader &operator= ( const ShmReader & ) = delete;
+
+    ~ShmReader()
+    {
+        close ();
+    }
+
+    /**
+     * @param name Name of the segment, e.g. '/hcs-2690000001'.
+     *
+     * @returns false if there is no (complete) segment by that name, errno tells why.
+     */
+    bool open ( const char *name )
+    {
+        close ();
+        int fd = shm_open ( name, O_RDONLY, 0 );
+        if ( fd < 0 ) {
+            return false;
+        }
+        struct stat st;
+        if ( fstat ( fd, &st ) < 0 || st.st_size < (off_t) sizeof ( ShmSegment ) ) {
+            ::close ( fd );
+            errno = EAGAIN;
+            return false;
+        }
+        void *map = mmap ( NULL, sizeof ( ShmSegment ), PROT_READ, MAP_SHARED, fd, 0 );
+        ::close ( fd );
+        if ( map == MAP_FAILED ) {
+            return false;
+        }
+        segment = (const ShmSegment *) map;
+        if ( segment->magic.load ( std::memory_order_acquire ) != SHM_MAGIC || segment->version != SHM_VERSION ||
+             segment->size != sizeof ( ShmSegment ) || segment->history_size != SHM_HISTORY ) {
+            close ();
+            errno = EPROTO;
+            return false;
+        }
+        return true;
+    }
+
+    void close ()
+    {
+        if ( segment != nullptr ) {
+            munmap ( (void *) segment, sizeof ( ShmSegment ) );
+            segment = nullptr;
+        }
+    }
+
+    /**
+     * @returns the segment, for the identity of the power supply. Those fields do not change.
+     */
+    const ShmSegment *get_segment () const
+    {
+        return segment;
+    }
+
+    /**
+     * @returns true while the publisher is running.
+     */
+    bool is_alive () const
+    {
+        return segment != nullptr && ( kill ( segment->pid, 0 ) == 0 || errno == EPERM );
+    }
+
+    /**
+     * @param count Set to the number of samples published so far.
+     *
+     * @returns OK, BUSY or CLOSED.
+     */
+    ShmStatus get_count ( uint64_t &count ) const
+    {
+        return read ( [&count] ( uint64_t published ) {
+            count = published;
+        } );
+    }
+
+    /**
+     * @param sample Set to the latest sample.
+     *
+     * @returns OK, EMPTY if nothing was published yet, BUSY or CLOSED.
+     */
+    ShmStatus latest ( ShmSample &sample ) const
+    {
+        bool      found  = false;
+        ShmStatus status = read ( [this, &sample, &found] ( uint64_t count ) {
+            found = count > 0;
+            if ( found ) {
+                sample = segment->history[( count - 1 ) & ( SHM_HISTORY - 1 )];
+            }
+        } );
+        return ( status == ShmStatus::OK && !found ) ? ShmStatus::EMPTY : status;
+    }
+
+    /**
+     * @param samples Array to copy the samples to, oldest first.
+     * @param max     Size of samples, at most SHM_HISTORY are available.
+     * @param copied  Set to the number of samples copied, the last is the latest. 0 unless OK.
+     * @param after   Only copy samples after this count (see get_count ()), 0 for all.
+     *
+     * @returns OK (also when there was nothing new), BUSY or CLOSED.
+     */
+    ShmStatus history ( ShmSample *samples, size_t max, size_t &copied, uint64_t after = 0 ) const
+    {
+        ShmStatus status = read ( [this, samples, max, after, &copied] ( uint64_t count ) {
+            uint64_t first = count > SHM_HISTORY ? count - SHM_HISTORY : 0;
+            if ( first < after ) {
+                first = after;
+            }
+            if ( count > first + max ) {
+                first = count - max;
+            }
+            copied = 0;
+            for ( uint64_t i = first; i < count; i++ ) {
+                samples[copied++] = segment->history[i & ( SHM_HISTORY - 1 )];
+            }
+        } );
+        if ( status != ShmStatus::OK ) {
+            copied = 0;
+        }
+        return status;
+    }
+
+private:
+    const ShmSegment *segment = nullptr;
+
+    /**
+     * @param copy Copies what is needed, given the sample count.
+     *
+     * Run copy until it did not overlap a write. Between attempts the processor is given up,
+     * so a publisher that was preempted half way a write gets to finish it.
+     *
+     * @returns OK, BUSY if it kept overlapping (copy then saw inconsistent data) or CLOSED.
+     */
+    template<typename Copy>
+    ShmStatus read ( Copy copy ) const
+    {
+        if ( segment == nullptr ) {
+            return ShmStatus::CLOSED;
+        }
+        for ( unsigned int attempt = 0; attempt < max_attempts; attempt++ ) {
+            if ( attempt > 0 ) {
+                sched_yield ();
+            }
+            uint64_t before = segment->sequence.load ( std::memory_order_acquire );
+            if ( before & 1 ) {
+                continue;
+            }
+            copy ( segment->count );
+            std::atomic_thread_fence ( std::memory_order_acquire );
+            if ( segment->sequence.load ( std::memory_order_relaxed ) == before ) {
+                return ShmStatus::OK;
+            }
+        }
+        return ShmStatus::BUSY;
+    }
+};
+
+#endif // __HCS_SHM_H__
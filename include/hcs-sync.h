@@ -0,0 +1,60 @@
+#ifndef __HCS_SYNC_H__
+#define __HCS_SYNC_H__
+
+/**
+ * Samples several power supplies on the same ticks, e.g. the rails of one device under test.
+ *
+ * On every tick the reads for all devices are queued on their Channels at once and the Session
+ * writes them out from its event loop, so they go out within microseconds of each other and are
+ * answered in parallel. For each device the time its request was written and the time its reply
+ * was in are kept; the sample is taken to be at the middle. A row per tick is written with the
+ * samples of all devices, and the spread of the sample times within a tick is the skew that is
+ * reported at the end.
+ */
+class Sync
+{
+public:
+    /**
+     * @param session The session the devices are in.
+     * @param devices The devices to sample, in the order of the columns.
+     */
+    Sync( Session &session, const std::vector<Session::Device *> &devices );
+
+    /**
+     * @param interval The tick period (in ns), 0 to start the next tick when all devices answered.
+     * @param count    The number of ticks, 0 to run until interrupted (SIGINT).
+     * @param out      File to write the rows to.
+     *
+     * Sample all devices until count ticks are done or SIGINT. Ticks are scheduled like
+     * Monitor does. A device that fails on a tick gets empty columns in that row.
+     */
+    void run ( int64_t interval, unsigned long count, FILE *out );
+
+    /**
+     * @param out The file to write the report to.
+     *
+     * Print the tick rate, the skew between the devices and the round trip per device.
+     */
+    void print_report ( FILE *out ) const;
+
+private:
+    struct Column
+    {
+        Session::Device *device;
+        unsigned long   samples    = 0;
+        unsigned long   failed     = 0;
+        int64_t         round_trip = 0;
+    };
+
+    Session              &session;
+    std::vector<Column>  columns;
+    unsigned long        ticks  = 0;
+    unsigned long        missed = 0;
+    int64_t              first  = 0;
+    int64_t              last   = 0;
+    // Per tick with two or more samples: spread of the sample times and of the send times (ns).
+    Histogram            skew;
+    Histogram            send_skew;
+};
+
+#endif // __HCS_SYNC_H__
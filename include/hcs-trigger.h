@@ -0,0 +1,100 @@
+#ifndef __HCS_TRIGGER_H__
+#define __HCS_TRIGGER_H__
+
+/**
+ * Captures what happens around an event on the output, like an inrush current or a brown-out.
+ *
+ * A sampling thread reads the power supply back to back into a ring buffer that is allocated
+ * up front and watches a condition. When the condition becomes true, it keeps sampling until
+ * the requested number of samples after the event are in, then stops. Only then the caller
+ * writes the samples before and after the event out, so the sampling thread never waits on a
+ * file. Reads do not allocate either: the channel reuses its request slots and the reply
+ * callbacks of a snapshot are small enough to be stored inline.
+ *
+ * The ring has a single writer, the sampling thread; its position and the trigger point are
+ * published with atomics, so the caller can follow progress without a lock.
+ */
+class Trigger
+{
+public:
+    struct Sample
+    {
+        // CLOCK_MONOTONIC time of the read (in ns).
+        int64_t            time    = 0;
+        float              voltage = 0.0f;
+        float              current = 0.0f;
+        PSU::OperatingMode mode    = PSU::OperatingMode::OFF;
+    };
+
+    /**
+     * @param psu       The (opened) power supply.
+     * @param condition What to trigger on: voltage, current or power followed by '>' or '<' and a
+     *                  value (e.g. 'current>1.5'), 'cc' for entering current limit or 'off' for the
+     *                  output switching off.
+     * @param pre       Number of samples to keep from before the trigger.
+     * @param post      Number of samples to take after it.
+     *
+     * @throws PSUError when the condition can not be parsed.
+     */
+    Trigger( PSU *psu, const char *condition, size_t pre, size_t post ) throw ( PSUError & );
+
+    /**
+     * @param out File to write the samples around the trigger to.
+     *
+     * Sample until the condition fires and the samples after it are in. Stops early on SIGINT,
+     * nothing is written then.
+     *
+     * @returns true when the condition fired.
+     */
+    bool run ( FILE *out ) throw ( PSUError & );
+
+    /**
+     * @param out The file to write the report to.
+     *
+     * Print the sample rate and the trigger point of the last run.
+     */
+    void print_report ( FILE *out ) const;
+
+private:
+    enum class Field
+    {
+    VOLTAGE,
+    CURRENT,
+    POWER,
+    CC,
+    OFF
+    };
+
+    PSU                         *psu;
+    Field                       field;
+    bool                        above = true;
+    float                       level = 0.0f;
+    size_t                      pre;
+    size_t                      post;
+    // Power of two, at least pre + post + 1 so the samples around the trigger are never overwritten.
+    std::vector<Sample>         ring;
+    // Number of samples written, the next one goes to ring[head & (size - 1)].
+    std::atomic<uint64_t>       head;
+    // Index (in samples written) of the sample the condition fired on, -1 while armed.
+    std::atomic<int64_t>        fired;
+    // Set by the sampling thread when it is done, with the error it stopped on if any.
+    std::atomic<bool>           done;
+    std::string                 error;
+    // Of the last run: first and last sample time (in ns) and the sample that fired.
+    int64_t                     start = 0;
+    int64_t                     end   = 0;
+    bool                        triggered = false;
+    Sample                      trigger_sample;
+
+    /**
+     * @returns true when the condition holds for sample.
+     */
+    bool test ( const Sample &sample ) const;
+
+    /**
+     * The sampling thread.
+     */
+    void sample ();
+};
+
+#endif // __HCS_TRIGGER_H__
@@ -10,26 +10,64 @@
 #define FALSE          0
 #define TRUE           1
 
+/**
+ * Current time of the monotonic clock in nanoseconds.
+ */
+static inline int64_t hcs_monotonic_ns ( void )
+{
+    struct timespec ts;
+    clock_gettime ( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Ask the running command (monitor, sequence, script, ...) to stop. Safe to call from a signal
+ * handler and from any thread; hcsd calls it when its client goes away.
+ */
+void hcs_stop ( void );
+
+/**
+ * @returns true once the running command was asked to stop, long running loops poll this.
+ */
+bool hcs_stopped ( void );
+
+/**
+ * Scope of a long running command: clears the stop flag and has SIGINT set it, until the guard
+ * goes out of scope and the previous SIGINT handler is back. Guards nest (a script running a
+ * monitor), only the outermost one touches the flag and the handler.
+ */
+class StopGuard
+{
+public:
+    StopGuard();
+    ~StopGuard();
+    StopGuard( const StopGuard & ) = delete;
+    StopGuard &operator= ( const StopGuard & ) = delete;
+};
+
 class PSUError : public std::exception
 {
 public:
     PSUError( const char* errMessage ) : errMessage_ ( errMessage )
     {
     }
-    PSUError( const std::string errMessage ) : errMessage_ ( errMessage.c_str () )
+    PSUError( const std::string errMessage ) : errMessage_ ( errMessage )
     {
     }
 
     // overriden what() method from exception class
     const char* what () const throw( )
     {
-        return errMessage_;
+        return errMessage_.c_str ();
     }
 
 private:
-    const char* errMessage_;
+    // Keep a copy, the messages are mostly build in temporaries.
+    std::string errMessage_;
 };
 
+class Channel;
+
 /**
  * Base class a PSU implementation should inherit from.
  */
@@ -41,6 +79,21 @@ protected:
     int            fd = -1;
     // Baudrate, set when needed.
     int            baudrate = B9600;
+    // Maximum time to wait for a reply (in ns).
+    int64_t        reply_timeout = 500000000LL;
+    // Times a request that may be repeated is written again after a timeout or bad reply.
+    unsigned int   max_retries = 2;
+    // How long the line has to be quiet after an error before writing again (in ns).
+    int64_t        resync_time = 10000000LL;
+    // Longest gap between the bytes of a reply (in ns), 0 for no limit. A reply that stops
+    // half way lost bytes, this catches that well before the reply timeout.
+    int64_t        byte_timeout = 0;
+    // Time between sending the last request and receiving the full reply (in ns).
+    int64_t        last_round_trip = 0;
+    // Ignore cached device information and probe the device.
+    static bool    refresh_cache;
+    // The device node the power supply was opened on.
+    std::string    device_node;
 
     PSU( int baudrate ) : baudrate ( baudrate )
     {
@@ -49,6 +102,16 @@ protected:
     virtual void init ()         = 0;
     virtual void uninitialize () = 0;
 
+    /**
+     * @param buffer   The buffer to read into.
+     * @param size     The number of bytes to read.
+     * @param deadline Absolute CLOCK_MONOTONIC deadline (in ns).
+     *
+     * Read exactly size bytes from the device, waiting in poll() until they arrive.
+     * Throws when the deadline passes or the device reports an error.
+     */
+    void read_deadline ( uint8_t *buffer, size_t size, int64_t deadline ) throw ( PSUError & );
+
 public:
     /**
      * List of supported power supplies.
@@ -65,16 +128,67 @@ public:
     CV,
     CC
     };
-    const char *OperatingModeStr[3] = {
-        "Off",
-        "CV",
-        "CC"
-    };
-    const char *get_mode_str ( OperatingMode type )
+    static const char *const OperatingModeStr[3];
+    static const char *get_mode_str ( OperatingMode type )
     {
         return OperatingModeStr[static_cast<int>( type )];
     }
 
+    /**
+     * Fields of a Snapshot, or them together to select what to read.
+     */
+    enum SnapshotFields
+    {
+        SNAPSHOT_VOLTAGE        = 1 << 0,
+        SNAPSHOT_CURRENT        = 1 << 1,
+        SNAPSHOT_VOLTAGE_ACTUAL = 1 << 2,
+        SNAPSHOT_CURRENT_ACTUAL = 1 << 3,
+        SNAPSHOT_OVER_VOLTAGE   = 1 << 4,
+        SNAPSHOT_OVER_CURRENT   = 1 << 5,
+        SNAPSHOT_MODE           = 1 << 6,
+        SNAPSHOT_ALL            = ( 1 << 7 ) - 1
+    };
+
+    /**
+     * The state of the power supply, read in as few requests as possible.
+     */
+    struct Snapshot
+    {
+        // The SnapshotFields that are filled in.
+        unsigned int  fields         = 0;
+        // Set output voltage and current limit.
+        float         voltage        = 0.0f;
+        float         current        = 0.0f;
+        // Actual output voltage and current.
+        float         voltage_actual = 0.0f;
+        float         current_actual = 0.0f;
+        // Protection levels.
+        float         over_voltage   = 0.0f;
+        float         over_current   = 0.0f;
+        OperatingMode mode           = OperatingMode::OFF;
+        // Actual output voltage and current in device counts, see Identity for the scale.
+        int32_t       voltage_actual_raw = 0;
+        int32_t       current_actual_raw = 0;
+    };
+
+    /**
+     * Identity and ratings of the power supply.
+     */
+    struct Identity
+    {
+        std::string manufacturer;
+        std::string type;
+        std::string serial;
+        std::string article;
+        std::string software;
+        float       nominal_voltage    = 0.0f;
+        float       nominal_current    = 0.0f;
+        float       nominal_power      = 0.0f;
+        // Volts and Amps per count of the raw values in a Snapshot.
+        float       voltage_resolution = 0.001f;
+        float       current_resolution = 0.001f;
+    };
+
     virtual ~PSU()
     {
         if ( fd >= 0 ) {
@@ -87,10 +201,203 @@ public:
      */
     virtual void open_device ();
 
+    /**
+     * @returns the device node open_device () uses: HCS_DEVICE or MODEMDEVICE.
+     */
+    static const char *get_default_device ();
+
     bool is_open () noexcept
     {
         return fd >= 0;
     }
+
+    int get_fd () const noexcept
+    {
+        return fd;
+    }
+
+    const std::string &get_device_node () const noexcept
+    {
+        return device_node;
+    }
+
+    /**
+     * @param refresh When true, devices opened from now on ignore their cached
+     *                information and probe the device again (refreshing the cache).
+     */
+    static void set_refresh_cache ( bool refresh ) noexcept
+    {
+        refresh_cache = refresh;
+    }
+
+    /**
+     * @returns the maximum time to wait for a reply (in ns).
+     */
+    int64_t get_reply_timeout () const noexcept
+    {
+        return reply_timeout;
+    }
+    /**
+     * @returns the number of times a request is retried, see Channel.
+     */
+    unsigned int get_max_retries () const noexcept
+    {
+        return max_retries;
+    }
+    /**
+     * @returns how long the line has to be quiet before writing after an error (in ns).
+     */
+    int64_t get_resync_time () const noexcept
+    {
+        return resync_time;
+    }
+    /**
+     * @returns the longest gap between the bytes of a reply (in ns), 0 for no limit.
+     */
+    int64_t get_byte_timeout () const noexcept
+    {
+        return byte_timeout;
+    }
+
+    /**
+     * Get the round trip time of the last request.
+     *
+     * @returns the time from sending the request until the full reply was received (in ns).
+     */
+    int64_t get_last_round_trip () const noexcept
+    {
+        return last_round_trip;
+    }
+
+    /**
+     * Time spent on the transport, summed over the exchanges since reset_timing ().
+     */
+    struct Timing
+    {
+        unsigned long exchanges = 0;
+        // Writing the requests (in ns).
+        int64_t       write = 0;
+        // From request written until the first byte of the reply (in ns).
+        int64_t       wait = 0;
+        // From the first until the last byte of the reply (in ns).
+        int64_t       read = 0;
+    };
+
+    const Timing &get_timing () const noexcept
+    {
+        return timing;
+    }
+    void reset_timing () noexcept
+    {
+        timing = Timing ();
+    }
+    /**
+     * Called by the transport for every request/reply exchange.
+     */
+    void add_timing ( int64_t write, int64_t wait, int64_t read ) noexcept
+    {
+        timing.exchanges++;
+        timing.write += write;
+        timing.wait  += wait;
+        timing.read  += read;
+        stats.transactions++;
+    }
+
+    /**
+     * Transport counters, kept for as long as the object lives.
+     */
+    struct Stats
+    {
+        // CLOCK_MONOTONIC time (in ns) the counters started.
+        int64_t                      start         = hcs_monotonic_ns ();
+        // Completed request/reply exchanges.
+        unsigned long                transactions  = 0;
+        // Requests that failed, for whatever reason.
+        unsigned long                failed        = 0;
+        unsigned long                bytes_written = 0;
+        unsigned long                bytes_read    = 0;
+        // read () calls that returned data.
+        unsigned long                reads         = 0;
+        // Replies that failed check_reply (), and replies not in time.
+        unsigned long                crc_errors    = 0;
+        unsigned long                timeouts      = 0;
+        // Requests written again, and the times the channel dropped its input to resync.
+        unsigned long                retries       = 0;
+        unsigned long                resyncs       = 0;
+        // Errors reported by the device, by device specific error code.
+        std::map<int, unsigned long> device_errors;
+        // Time (in ns) spent waiting on the device and sleeping between requests.
+        int64_t                      io_wait       = 0;
+        int64_t                      sleep         = 0;
+    };
+
+    const Stats &get_stats () const noexcept
+    {
+        return stats;
+    }
+    /**
+     * Used by the transport to update the counters.
+     */
+    Stats &get_stats () noexcept
+    {
+        return stats;
+    }
+
+    /**
+     * @param code A device specific error code, see Stats::device_errors.
+     *
+     * @returns a human readable name for code.
+     */
+    virtual const char *get_device_error_str ( int code ) const
+    {
+        return "Unknown";
+    }
+
+    /**
+     * @param out File to print the transport counters to.
+     */
+    void print_stats ( FILE *out ) const;
+
+    /**
+     * @param out File to write the transport counters to, as a JSON object.
+     */
+    void write_stats_json ( FILE *out ) const;
+
+    /**
+     * @param out File to print what the transport learned about the device to, see print_stats ().
+     */
+    virtual void print_pacing ( FILE *out ) const
+    {
+    }
+
+    /**
+     * @param snapshot A snapshot just read from the device.
+     *
+     * Keep the fields read in snapshot as the last known state, see get_last_snapshot ().
+     */
+    void remember ( const Snapshot &snapshot );
+
+    /**
+     * Last known state of the power supply, without talking to it. Only the fields read at some
+     * point are filled in.
+     */
+    const Snapshot &get_last_snapshot () const noexcept
+    {
+        return last_snapshot;
+    }
+    /**
+     * @returns CLOCK_MONOTONIC time (in ns) of the last update of get_last_snapshot (), 0 if none.
+     */
+    int64_t get_last_snapshot_time () const noexcept
+    {
+        return last_snapshot_time;
+    }
+private:
+    Timing   timing;
+    Stats    stats;
+    Snapshot last_snapshot;
+    int64_t  last_snapshot_time = 0;
+public:
     /**
      * @param dev_node The device node to open.
      *
@@ -203,6 +510,128 @@ public:
      */
     virtual bool get_state () throw( PSUError & ) = 0;
 
+    /**
+     * @param snapshot The snapshot to fill in.
+     * @param fields   The SnapshotFields to read.
+     *
+     * Read several values in one go. The default implementation calls the individual getters,
+     * power supplies should override it to combine fields that come in the same reply.
+     */
+    virtual void read_snapshot ( Snapshot &snapshot, unsigned int fields = SNAPSHOT_ALL ) throw( PSUError & );
+
+    /**
+     * Operations that can be queued on a Channel.
+     */
+    enum class Operation
+    {
+    SNAPSHOT,
+    SET_VOLTAGE,
+    SET_CURRENT,
+    SET_OVER_VOLTAGE,
+    SET_OVER_CURRENT,
+    STATE_ENABLE,
+    STATE_DISABLE
+    };
+
+    /**
+     * @param buffer The bytes received so far.
+     * @param size   The number of bytes in buffer.
+     *
+     * Used by Channel to split the received bytes into replies.
+     *
+     * @returns the length of the reply at the start of buffer, 0 when it is not complete yet.
+     */
+    virtual size_t reply_length ( const uint8_t *buffer, size_t size ) const;
+
+    /**
+     * @param byte A received byte.
+     *
+     * Used by Channel to skip noise in front of a reply.
+     *
+     * @returns true when a reply can start with byte.
+     */
+    virtual bool is_reply_start ( uint8_t byte ) const
+    {
+        return true;
+    }
+
+    /**
+     * @param request      The request the reply should answer.
+     * @param request_size The length of request.
+     * @param reply        A reply, as framed by reply_length ().
+     * @param size         The length of reply.
+     *
+     * Used by Channel to detect corrupted or misaligned replies. Errors reported by the
+     * device itself are valid replies.
+     *
+     * @returns nullptr when the reply is intact, else what is wrong with it.
+     */
+    virtual const char *check_reply ( const uint8_t *request, size_t request_size,
+                                      const uint8_t *reply, size_t size ) const
+    {
+        return nullptr;
+    }
+
+    /**
+     * @param reply A reply that passed check_reply ().
+     * @param size  The length of reply.
+     *
+     * Called by Channel before the reply is handed to its request.
+     *
+     * @throws PSUError when the reply is the device reporting an error, this fails the request.
+     */
+    virtual void check_reply_error ( const uint8_t *reply, size_t size ) throw ( PSUError & )
+    {
+    }
+
+    /**
+     * @returns the number of requests a Channel may write before the first reply arrived.
+     */
+    virtual size_t get_pipeline_depth () const
+    {
+        return 1;
+    }
+
+    /**
+     * @returns the minimum time between writing two requests (in ns), 0 for none.
+     */
+    virtual int64_t get_write_gap () const
+    {
+        return 0;
+    }
+
+    /**
+     * @param request The request.
+     * @param size    The length of request.
+     * @param latency Time from writing the request until the reply was complete (in ns).
+     * @param ok      False when the reply was lost or corrupt, latency is then not set.
+     *
+     * Called by Channel for every request that got a reply, or that the channel gave up on.
+     */
+    virtual void exchange_done ( const uint8_t *request, size_t size, int64_t latency, bool ok )
+    {
+    }
+
+    /**
+     * @param channel  The channel to queue the requests on.
+     * @param op       The operation.
+     * @param value    The value for the SET_ operations.
+     * @param snapshot For SNAPSHOT, filled in when the replies arrive.
+     * @param fields   For SNAPSHOT, the SnapshotFields to read.
+     *
+     * Queue the requests for an operation without waiting for the replies,
+     * so several power supplies can be driven from one event loop.
+     */
+    virtual void queue_operation ( Channel &channel, Operation op, float value,
+                                   Snapshot *snapshot, unsigned int fields = SNAPSHOT_ALL ) throw( PSUError & );
+
+    /**
+     * @param identity The identity to fill in.
+     *
+     * Get the identity and ratings of the power supply.
+     */
+    virtual void get_identity ( Identity &identity ) throw( PSUError & );
+
     /**
      * Print device information.
      *
@@ -211,4 +640,50 @@ public:
     virtual void print_device_info () throw( PSUError & );
 };
 
+/**
+ * Paces a sampling loop on absolute CLOCK_MONOTONIC deadlines, so it does not drift with the
+ * time the work takes. A tick that is late by less than an interval runs late (see
+ * get_lateness ()), ticks that are missed completely are skipped, instead of bursting to catch up.
+ */
+class Ticker
+{
+public:
+    /**
+     * @param interval Time between ticks (in ns), 0 for no waiting. The first tick is now.
+     */
+    Ticker( int64_t interval );
+
+    /**
+     * @param psu Power supply to count the time slept to (see PSU::Stats), nullptr for none.
+     *
+     * Wait for the next tick.
+     *
+     * @returns false when the command was stopped, see hcs_stopped ().
+     */
+    bool wait ( PSU *psu );
+
+    /**
+     * @returns how late the current tick started (in ns), 0 without interval.
+     */
+    int64_t get_lateness () const
+    {
+        return lateness;
+    }
+
+    /**
+     * @returns the number of ticks skipped so far.
+     */
+    unsigned long get_missed () const
+    {
+        return missed;
+    }
+
+private:
+    int64_t       interval;
+    int64_t       deadline;
+    int64_t       lateness = 0;
+    unsigned long ticks    = 0;
+    unsigned long missed   = 0;
+};
+
 #endif
@@ -0,0 +1,185 @@
+/**
+ *    This file is part of HCS.
+ *    Written by Qball Cow <qball@gmpclient.org> 2013-2015
+ *
+ *    HCS is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 2 of the License.
+ *
+ *    HCS is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with HCS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <iostream>
+#include <exception>
+#include <functional>
+#include <map>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <termios.h>
+#include <hcs.h>
+#include <hcs-channel.h>
+#include <hcs-pps.h>
+#include <hcs-bench.h>
+
+#include <config.h>
+
+#define HISTOGRAM_SUB_COUNT    ( 1 << HISTOGRAM_SUB_BITS )
+
+Histogram::Histogram() : buckets ( index ( INT64_MAX ) + 1, 0 )
+{
+}
+
+size_t Histogram::index ( int64_t value )
+{
+    if ( value < HISTOGRAM_SUB_COUNT ) {
+        return value;
+    }
+    // Position of the highest bit, at least HISTOGRAM_SUB_BITS.
+    int msb   = 63 - __builtin_clzll ( value );
+    int shift = msb - HISTOGRAM_SUB_BITS;
+    return ( shift + 1 ) * HISTOGRAM_SUB_COUNT + ( ( value >> shift ) - HISTOGRAM_SUB_COUNT );
+}
+
+int64_t Histogram::highest_equivalent ( size_t index )
+{
+    if ( index < HISTOGRAM_SUB_COUNT ) {
+        return index;
+    }
+    int     shift = index / HISTOGRAM_SUB_COUNT - 1;
+    int64_t base  = (int64_t) ( index % HISTOGRAM_SUB_COUNT + HISTOGRAM_SUB_COUNT ) << shift;
+    return base + ( ( (int64_t) 1 << shift ) - 1 );
+}
+
+void Histogram::add ( int64_t value )
+{
+    if ( value < 0 ) {
+        value = 0;
+    }
+    buckets[index ( value )]++;
+    if ( count == 0 || value < min ) {
+        min = value;
+    }
+    if ( value > max ) {
+        max = value;
+    }
+    sum += value;
+    count++;
+}
+
+int64_t Histogram::percentile ( double percentile ) const
+{
+    if ( count == 0 ) {
+        return 0;
+    }
+    // The rank of the value, 1 based.
+    uint64_t rank = ( percentile / 100.0 ) * count + 0.5;
+    if ( rank < 1 ) {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for ( size_t i = 0; i < buckets.size (); i++ ) {
+        seen += buckets[i];
+        if ( seen >= rank ) {
+            // Never report past what was seen.
+            int64_t value = highest_equivalent ( i );
+            return value < max ? value : max;
+        }
+    }
+    return max;
+}
+
+Bench::Bench( PSU *psu ) : psu ( psu )
+{
+    // Writes put back the value that is set, so benchmarking does not change the output. That
+    // value is read up front, so the write is all that is timed.
+    operations = {
+        { "voltage_actual", [] ( PSU *psu ) { psu->get_voltage_actual (); }, nullptr },
+        { "current_actual", [] ( PSU *psu ) { psu->get_current_actual (); }, nullptr },
+        { "voltage", [] ( PSU *psu ) { psu->get_voltage (); }, nullptr },
+        { "current", [] ( PSU *psu ) { psu->get_current (); }, nullptr },
+        { "mode", [] ( PSU *psu ) { psu->get_operating_mode (); }, nullptr },
+        { "snapshot", [] ( PSU *psu ) {
+              PSU::Snapshot snapshot;
+              psu->read_snapshot ( snapshot );
+          }, nullptr },
+        { "set_voltage", [this] ( PSU *psu ) { psu->set_voltage ( voltage ); },
+          [this] ( PSU *psu ) { voltage = psu->get_voltage (); } },
+        { "set_current", [this] ( PSU *psu ) { psu->set_current ( current ); },
+          [this] ( PSU *psu ) { current = psu->get_current (); } },
+    };
+}
+
+void Bench::run ( const char *name, unsigned long iterations, FILE *out ) throw ( PSUError & )
+{
+    fprintf ( out, "%-16s %8s %9s %9s %9s %9s %9s %9s %9s %9s %5s\n",
+              "operation", "n", "ops/s", "p50(ms)", "p90(ms)", "p99(ms)", "max(ms)",
+              "write", "wait", "read", "xchg" );
+    // Time the device, not the reply cache of the PPS.
+    PPS11360 *pps    = dynamic_cast<PPS11360 *> ( psu );
+    int64_t  max_age = 0;
+    if ( pps != nullptr ) {
+        max_age = pps->get_max_age ();
+        pps->set_max_age ( 0 );
+    }
+    bool found = false;
+    try {
+        for ( auto &operation : operations ) {
+            if ( strcmp ( name, "all" ) == 0 || strcmp ( name, operation.name ) == 0 ) {
+                found = true;
+                run_operation ( operation, iterations, out );
+            }
+        }
+    } catch ( PSUError &error ) {
+        if ( pps != nullptr ) {
+            pps->set_max_age ( max_age );
+        }
+        throw;
+    }
+    if ( pps != nullptr ) {
+        pps->set_max_age ( max_age );
+    }
+    if ( !found ) {
+        throw PSUError ( std::string ( "Unknown operation: " ) + name );
+    }
+}
+
+void Bench::run_operation ( const Operation &operation, unsigned long iterations, FILE *out ) throw ( PSUError & )
+{
+    if ( operation.prepare ) {
+        operation.prepare ( psu );
+    }
+    // Warm up: caches, remote control and the like.
+    operation.run ( psu );
+
+    Histogram     latency;
+    PSU::Timing   total;
+    int64_t       start = hcs_monotonic_ns ();
+    for ( unsigned long i = 0; i < iterations; i++ ) {
+        psu->reset_timing ();
+        int64_t begin = hcs_monotonic_ns ();
+        operation.run ( psu );
+        latency.add ( hcs_monotonic_ns () - begin );
+        const PSU::Timing &timing = psu->get_timing ();
+        total.exchanges += timing.exchanges;
+        total.write     += timing.write;
+        total.wait      += timing.wait;
+        total.read      += timing.read;
+    }
+    double duration = ( hcs_monotonic_ns () - start ) / 1e9;
+    double n        = iterations > 0 ? iterations : 1;
+    // Mean time per operation spent in each phase of the exchanges.
+    fprintf ( out, "%-16s %8lu %9.1f %9.3f %9.3f %9.3f %9.3f %9.3f %9.3f %9.3f %5.1f\n",
+              operation.name, iterations, duration > 0 ? iterations / duration : 0.0,
+              latency.percentile ( 50 ) / 1e6, latency.percentile ( 90 ) / 1e6,
+              latency.percentile ( 99 ) / 1e6, latency.get_max () / 1e6,
+              total.write / n / 1e6, total.wait / n / 1e6, total.read / n / 1e6,
+              total.exchanges / n );
+}
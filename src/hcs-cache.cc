@@ -0,0 +1,152 @@
+/**
+ *    This file is part of HCS.
+ *    Written by Qball Cow <qball@gmpclient.org> 2013-2015
+ *
+ *    HCS is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 2 of the License.
+ *
+ *    HCS is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with HCS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <string>
+#include <map>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <hcs-cache.h>
+
+#include <config.h>
+
+#define CACHE_MAGIC    "# hcs cache 1"
+
+DeviceCache::DeviceCache( const std::string &name )
+{
+    std::string file = name;
+    for ( auto &c : file ) {
+        if ( !isalnum ( (unsigned char) c ) && c != '-' && c != '_' && c != '.' ) {
+            c = '_';
+        }
+    }
+    path = directory () + "/" + file;
+}
+
+DeviceCache DeviceCache::from_file ( const std::string &path )
+{
+    DeviceCache cache;
+    cache.path = path;
+    return cache;
+}
+
+std::string DeviceCache::directory ()
+{
+    const char *dir = getenv ( "HCS_CACHE_DIR" );
+    if ( dir != nullptr && dir[0] != '\0' ) {
+        return dir;
+    }
+    dir = getenv ( "XDG_CACHE_HOME" );
+    if ( dir != nullptr && dir[0] != '\0' ) {
+        return std::string ( dir ) + "/hcs";
+    }
+    dir = getenv ( "HOME" );
+    if ( dir != nullptr && dir[0] != '\0' ) {
+        return std::string ( dir ) + "/.cache/hcs";
+    }
+    return "/tmp/hcs-cache";
+}
+
+bool DeviceCache::load ()
+{
+    values.clear ();
+    FILE *fp = fopen ( path.c_str (), "r" );
+    if ( fp == nullptr ) {
+        return false;
+    }
+    char line[512];
+    if ( fgets ( line, sizeof ( line ), fp ) == nullptr || strncmp ( line, CACHE_MAGIC, strlen ( CACHE_MAGIC ) ) != 0 ) {
+        fclose ( fp );
+        return false;
+    }
+    while ( fgets ( line, sizeof ( line ), fp ) != nullptr ) {
+        line[strcspn ( line, "\n" )] = '\0';
+        char *eq = strchr ( line, '=' );
+        if ( eq == nullptr ) {
+            continue;
+        }
+        *eq          = '\0';
+        values[line] = eq + 1;
+    }
+    fclose ( fp );
+    return true;
+}
+
+bool DeviceCache::store () const
+{
+    // Create the directory and its parent, the rest should exist.
+    std::string dir = directory ();
+    if ( path.compare ( 0, dir.size () + 1, dir + "/" ) == 0 ) {
+        mkdir ( dir.substr ( 0, dir.rfind ( '/' ) ).c_str (), 0700 );
+        if ( mkdir ( dir.c_str (), 0700 ) < 0 && errno != EEXIST ) {
+            return false;
+        }
+    }
+    std::string tmp = path + "." + std::to_string ( getpid () );
+    FILE        *fp = fopen ( tmp.c_str (), "w" );
+    if ( fp == nullptr ) {
+        return false;
+    }
+    fprintf ( fp, "%s\n", CACHE_MAGIC );
+    for ( auto &value : values ) {
+        fprintf ( fp, "%s=%s\n", value.first.c_str (), value.second.c_str () );
+    }
+    if ( fclose ( fp ) != 0 || rename ( tmp.c_str (), path.c_str () ) < 0 ) {
+        unlink ( tmp.c_str () );
+        return false;
+    }
+    return true;
+}
+
+std::string DeviceCache::get ( const std::string &key ) const
+{
+    auto value = values.find ( key );
+    return value == values.end () ? "" : value->second;
+}
+
+double DeviceCache::get_double ( const std::string &key, double fallback ) const
+{
+    auto value = values.find ( key );
+    if ( value == values.end () ) {
+        return fallback;
+    }
+    char   *end;
+    double val = strtod ( value->second.c_str (), &end );
+    return end == value->second.c_str () ? fallback : val;
+}
+
+void DeviceCache::set ( const std::string &key, const std::string &value )
+{
+    // Keep the file line based.
+    std::string clean = value;
+    for ( auto &c : clean ) {
+        if ( c == '\n' || c == '\r' ) {
+            c = ' ';
+        }
+    }
+    values[key] = clean;
+}
+
+void DeviceCache::set ( const std::string &key, double value )
+{
+    char buffer[64];
+    snprintf ( buffer, sizeof ( buffer ), "%.9g", value );
+    values[key] = buffer;
+}
@@ -0,0 +1,277 @@
+/**
+ *    This file is part of HCS.
+ *    Written by Qball Cow <qball@gmpclient.org> 2013-2015
+ *
+ *    HCS is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 2 of the License.
+ *
+ *    HCS is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with HCS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <iostream>
+#include <exception>
+#include <functional>
+#include <map>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <termios.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <hcs.h>
+#include <hcs-capture.h>
+
+#include <config.h>
+
+/**
+ * Helpers.
+ */
+static inline uint32_t zigzag ( int32_t val )
+{
+    return ( (uint32_t) val << 1 ) ^ (uint32_t) ( val >> 31 );
+}
+static inline int32_t unzigzag ( uint32_t val )
+{
+    return (int32_t) ( val >> 1 ) ^ -(int32_t) ( val & 1 );
+}
+static inline size_t varint_put ( uint8_t *buffer, uint64_t val )
+{
+    size_t size = 0;
+    while ( val >= 0x80 ) {
+        buffer[size++] = ( val & 0x7F ) | 0x80;
+        val          >>= 7;
+    }
+    buffer[size++] = val;
+    return size;
+}
+/**
+ * @returns false when the varint runs past end.
+ */
+static inline bool varint_get ( const uint8_t *&buffer, const uint8_t *end, uint64_t &val )
+{
+    val = 0;
+    for ( int shift = 0; buffer < end && shift < 64; shift += 7 ) {
+        uint8_t b = *buffer++;
+        val |= (uint64_t) ( b & 0x7F ) << shift;
+        if ( ( b & 0x80 ) == 0 ) {
+            return true;
+        }
+    }
+    return false;
+}
+static void copy_field ( char *dest, size_t size, const std::string &src )
+{
+    memset ( dest, 0, size );
+    strncpy ( dest, src.c_str (), size - 1 );
+}
+
+/**
+ * Writer
+ */
+CaptureWriter::CaptureWriter( const char *path, const PSU::Identity &identity ) throw ( PSUError & )
+{
+    CaptureHeader header;
+    memset ( &header, 0, sizeof ( header ) );
+    memcpy ( header.magic, CAPTURE_MAGIC, sizeof ( header.magic ) );
+    header.version            = CAPTURE_VERSION;
+    header.header_size        = sizeof ( header );
+    header.nominal_voltage    = identity.nominal_voltage;
+    header.nominal_current    = identity.nominal_current;
+    header.nominal_power      = identity.nominal_power;
+    header.voltage_resolution = identity.voltage_resolution;
+    header.current_resolution = identity.current_resolution;
+    copy_field ( header.manufacturer, sizeof ( header.manufacturer ), identity.manufacturer );
+    copy_field ( header.type, sizeof ( header.type ), identity.type );
+    copy_field ( header.serial, sizeof ( header.serial ), identity.serial );
+    copy_field ( header.article, sizeof ( header.article ), identity.article );
+    copy_field ( header.software, sizeof ( header.software ), identity.software );
+
+    fd = open ( path, O_RDWR | O_CREAT | O_APPEND, 0644 );
+    if ( fd < 0 ) {
+        throw PSUError ( std::string ( "Failed to open \"" ) + path + "\": '" + strerror ( errno ) + "'" );
+    }
+    CaptureHeader existing;
+    ssize_t       r = pread ( fd, &existing, sizeof ( existing ), 0 );
+    if ( r == 0 ) {
+        if ( write ( fd, &header, sizeof ( header ) ) != sizeof ( header ) ) {
+            close ( fd );
+            throw PSUError ( std::string ( "Failed to write capture header: " ) + strerror ( errno ) );
+        }
+    }
+    else if ( r != sizeof ( existing ) ||
+              memcmp ( existing.magic, header.magic, sizeof ( header.magic ) ) != 0 ||
+              existing.version != header.version ) {
+        close ( fd );
+        throw PSUError ( std::string ( "Not a capture file: " ) + path );
+    }
+    else if ( strncmp ( existing.type, header.type, sizeof ( header.type ) ) != 0 ||
+              strncmp ( existing.serial, header.serial, sizeof ( header.serial ) ) != 0 ||
+              existing.voltage_resolution != header.voltage_resolution ||
+              existing.current_resolution != header.current_resolution ) {
+        close ( fd );
+        throw PSUError ( std::string ( "Capture file is from another device: " ) + path );
+    }
+    block.count = 0;
+}
+CaptureWriter::~CaptureWriter()
+{
+    if ( fd >= 0 ) {
+        try {
+            flush ();
+        } catch ( PSUError &error ) {
+            std::cerr << "Capture: " << error.what () << std::endl;
+        }
+        close ( fd );
+    }
+}
+
+void CaptureWriter::append ( int64_t timestamp, const PSU::Snapshot &snapshot ) throw ( PSUError & )
+{
+    uint32_t mode = static_cast<uint32_t>( snapshot.mode );
+    if ( block.count == 0 ) {
+        block.magic     = CAPTURE_BLOCK_MAGIC;
+        block.count     = 1;
+        block.size      = 0;
+        block.mode      = mode;
+        block.timestamp = timestamp;
+        block.voltage   = last_voltage = snapshot.voltage_actual_raw;
+        block.current   = last_current = snapshot.current_actual_raw;
+        last_time       = 0;
+        payload_size    = 0;
+        return;
+    }
+    // Quantize relative to the block start, so rounding does not add up.
+    int64_t time = ( timestamp - block.timestamp ) / 1000;
+    payload_size += varint_put ( &payload[payload_size], time - last_time );
+    payload_size += varint_put ( &payload[payload_size],
+                                 ( (uint64_t) zigzag ( snapshot.voltage_actual_raw - last_voltage ) << 2 ) | mode );
+    payload_size += varint_put ( &payload[payload_size], zigzag ( snapshot.current_actual_raw - last_current ) );
+    last_time     = time;
+    last_voltage  = snapshot.voltage_actual_raw;
+    last_current  = snapshot.current_actual_raw;
+    block.count++;
+
+    if ( block.count >= max_block_count || ( payload_size + max_sample_size ) > sizeof ( payload ) ) {
+        flush ();
+    }
+}
+
+void CaptureWriter::flush () throw ( PSUError & )
+{
+    if ( block.count == 0 ) {
+        return;
+    }
+    block.size = payload_size;
+    struct iovec iov[2] = {
+        { &block,   sizeof ( block ) },
+        { payload,  payload_size     }
+    };
+    ssize_t      size = sizeof ( block ) + payload_size;
+    ssize_t      r    = writev ( fd, iov, 2 );
+    block.count = 0;
+    if ( r != size ) {
+        throw PSUError ( std::string ( "Failed to write capture block: " ) + strerror ( errno ) );
+    }
+}
+
+/**
+ * Reader
+ */
+CaptureReader::CaptureReader( const char *path ) throw ( PSUError & )
+{
+    int fd = open ( path, O_RDONLY );
+    if ( fd < 0 ) {
+        throw PSUError ( std::string ( "Failed to open \"" ) + path + "\": '" + strerror ( errno ) + "'" );
+    }
+    struct stat st;
+    if ( fstat ( fd, &st ) < 0 || st.st_size < (off_t) sizeof ( CaptureHeader ) ) {
+        close ( fd );
+        throw PSUError ( std::string ( "Not a capture file: " ) + path );
+    }
+    size = st.st_size;
+    void *map = mmap ( NULL, size, PROT_READ, MAP_PRIVATE, fd, 0 );
+    close ( fd );
+    if ( map == MAP_FAILED ) {
+        throw PSUError ( std::string ( "Failed to map \"" ) + path + "\": '" + strerror ( errno ) + "'" );
+    }
+    madvise ( map, size, MADV_SEQUENTIAL );
+    data   = (const uint8_t *) map;
+    header = (const CaptureHeader *) data;
+    if ( memcmp ( header->magic, CAPTURE_MAGIC, sizeof ( header->magic ) ) != 0 ||
+         header->version != CAPTURE_VERSION || header->header_size > size ) {
+        munmap ( (void *) data, size );
+        throw PSUError ( std::string ( "Not a capture file: " ) + path );
+    }
+}
+CaptureReader::~CaptureReader()
+{
+    munmap ( (void *) data, size );
+}
+
+unsigned long CaptureReader::for_each ( std::function<void(const Sample &)> callback ) const
+{
+    unsigned long samples = 0;
+    size_t        offset  = header->header_size;
+    while ( offset + sizeof ( CaptureBlock ) <= size ) {
+        CaptureBlock block;
+        memcpy ( &block, &data[offset], sizeof ( block ) );
+        offset += sizeof ( block );
+        if ( block.magic != CAPTURE_BLOCK_MAGIC || block.size > ( size - offset ) ) {
+            break;
+        }
+        Sample        sample = {
+            block.timestamp, block.voltage, block.current,
+            static_cast<PSU::OperatingMode>( block.mode )
+        };
+        callback ( sample );
+        samples++;
+
+        const uint8_t *p   = &data[offset];
+        const uint8_t *end = p + block.size;
+        int64_t       time = 0;
+        for ( uint32_t i = 1; i < block.count; i++ ) {
+            uint64_t dt, dv, di;
+            if ( !varint_get ( p, end, dt ) || !varint_get ( p, end, dv ) || !varint_get ( p, end, di ) ) {
+                return samples;
+            }
+            time              += dt;
+            sample.timestamp   = block.timestamp + time * 1000;
+            sample.voltage_raw += unzigzag ( dv >> 2 );
+            sample.current_raw += unzigzag ( di );
+            sample.mode         = static_cast<PSU::OperatingMode>( dv & 3 );
+            callback ( sample );
+            samples++;
+        }
+        offset += block.size;
+    }
+    return samples;
+}
+
+unsigned long CaptureReader::export_csv ( FILE *out ) const throw ( PSUError & )
+{
+    float vres = header->voltage_resolution;
+    float cres = header->current_resolution;
+    fprintf ( out, "time,voltage,current,power,mode\n" );
+    return for_each ( [out, vres, cres] ( const Sample &sample ) {
+        unsigned int mode = static_cast<unsigned int>( sample.mode );
+        if ( mode > static_cast<unsigned int>( PSU::OperatingMode::CC ) ) {
+            throw PSUError ( "Invalid mode " + std::to_string ( mode ) + " in capture file" );
+        }
+        float voltage = sample.voltage_raw * vres;
+        float current = sample.current_raw * cres;
+        fprintf ( out, "%lld.%09lld,%.3f,%.3f,%.3f,%s\n",
+                  (long long) ( sample.timestamp / 1000000000LL ), (long long) ( sample.timestamp % 1000000000LL ),
+                  voltage, current, voltage * current, PSU::get_mode_str ( sample.mode ) );
+    } );
+}
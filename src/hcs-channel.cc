@@ -0,0 +1,349 @@
+/**
+ *    This file is part of HCS.
+ *    Written by Qball Cow <qball@gmpclient.org> 2013-2015
+ *
+ *    HCS is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 2 of the License.
+ *
+ *    HCS is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with HCS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <iostream>
+#include <exception>
+#include <functional>
+#include <map>
+#include <vector>
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <termios.h>
+#include <poll.h>
+#include <hcs.h>
+#include <hcs-channel.h>
+
+#include <config.h>
+
+Channel::Channel( PSU *psu ) : psu ( psu )
+{
+}
+
+void Channel::RequestQueue::push_back ( Request &&request )
+{
+    if ( count == slots.size () ) {
+        // Full, grow while keeping the order.
+        std::vector<Request> grown ( std::max ( 2 * slots.size (), (size_t) 8 ) );
+        for ( size_t i = 0; i < count; i++ ) {
+            grown[i] = std::move ( ( *this )[i] );
+        }
+        slots.swap ( grown );
+        first = 0;
+    }
+    slots[( first + count ) % slots.size ()] = std::move ( request );
+    count++;
+}
+
+void Channel::RequestQueue::pop_front ()
+{
+    // Drop the callbacks, and what they hold on to, right away.
+    slots[first] = Request ();
+    first        = ( first + 1 ) % slots.size ();
+    count--;
+}
+
+void Channel::RequestQueue::clear ()
+{
+    while ( count > 0 ) {
+        pop_front ();
+    }
+}
+
+void Channel::submit ( Request &&request )
+{
+    queue.push_back ( std::move ( request ) );
+}
+
+void Channel::handle_write ()
+{
+    while ( wants_write () ) {
+        Request &request = queue.front ();
+        if ( written == 0 ) {
+            request.write_start = last_write = hcs_monotonic_ns ();
+        }
+        ssize_t r        = write ( get_fd (), &request.data[written], request.size - written );
+        if ( r < 0 ) {
+            if ( errno == EAGAIN || errno == EINTR ) {
+                return;
+            }
+            fail_all ( PSUError ( std::string ( "Failed to send request: " ) + strerror ( errno ) ) );
+            return;
+        }
+        written                          += r;
+        psu->get_stats ().bytes_written += r;
+        if ( written < request.size ) {
+            return;
+        }
+        written      = 0;
+        request.sent = hcs_monotonic_ns ();
+        in_flight.push_back ( std::move ( request ) );
+        queue.pop_front ();
+    }
+}
+
+void Channel::handle_read ()
+{
+    while ( rx_size < sizeof ( rx ) ) {
+        ssize_t r = read ( get_fd (), &rx[rx_size], sizeof ( rx ) - rx_size );
+        if ( r < 0 ) {
+            if ( errno == EAGAIN || errno == EINTR ) {
+                break;
+            }
+            fail_all ( PSUError ( std::string ( "Failed to read reply: " ) + strerror ( errno ) ) );
+            return;
+        }
+        if ( r == 0 ) {
+            fail_all ( PSUError ( "Failed to read reply: device closed" ) );
+            return;
+        }
+        PSU::Stats &stats = psu->get_stats ();
+        stats.reads++;
+        stats.bytes_read += r;
+        if ( quiet_until != 0 ) {
+            // Still replies to failed requests, drop them and wait some more.
+            quiet_until = hcs_monotonic_ns () + psu->get_resync_time ();
+            continue;
+        }
+        rx_size  += r;
+        last_byte = hcs_monotonic_ns ();
+        mark_first_byte ();
+    }
+    // Hand out every complete frame.
+    while ( rx_size > 0 ) {
+        // Noise between replies: skip to the next byte that can start one.
+        size_t skip = 0;
+        while ( skip < rx_size && !psu->is_reply_start ( rx[skip] ) ) {
+            skip++;
+        }
+        if ( skip > 0 ) {
+            rx_size -= skip;
+            memmove ( rx, &rx[skip], rx_size );
+            continue;
+        }
+        size_t length = psu->reply_length ( rx, rx_size );
+        if ( length == 0 ) {
+            break;
+        }
+        if ( !in_flight.empty () ) {
+            const Request &request = in_flight.front ();
+            const char    *invalid = psu->check_reply ( request.data, request.size, rx, length );
+            if ( invalid != nullptr ) {
+                // Framing is lost, the replies still coming in can not be trusted either.
+                psu->get_stats ().crc_errors++;
+                fail_all ( PSUError ( invalid ), true );
+                return;
+            }
+        }
+        uint8_t frame[sizeof ( rx )];
+        memcpy ( frame, rx, length );
+        rx_size -= length;
+        memmove ( rx, &rx[length], rx_size );
+        complete ( frame, length );
+        // The start of the next reply may have come in with this one.
+        if ( rx_size > 0 ) {
+            mark_first_byte ();
+        }
+    }
+    if ( rx_size == sizeof ( rx ) ) {
+        fail_all ( PSUError ( "Failed to read reply: no valid frame received" ), true );
+    }
+}
+
+void Channel::mark_first_byte ()
+{
+    if ( !in_flight.empty () && in_flight.front ().first_byte == 0 ) {
+        in_flight.front ().first_byte = hcs_monotonic_ns ();
+    }
+}
+
+void Channel::complete ( const uint8_t *reply, size_t size )
+{
+    if ( in_flight.empty () ) {
+        // Nobody asked for this, drop it.
+        return;
+    }
+    Request request = std::move ( in_flight.front () );
+    in_flight.pop_front ();
+    // With requests pipelined, the device only started on this one when it was
+    // done with the previous one.
+    int64_t now     = hcs_monotonic_ns ();
+    last_round_trip = now - std::max ( request.sent, last_completed );
+    last_completed  = now;
+    last_sent       = request.sent;
+    int64_t first = request.first_byte != 0 ? request.first_byte : now;
+    psu->add_timing ( request.sent - request.write_start, first - request.sent, now - first );
+    psu->exchange_done ( request.data, request.size, now - request.sent, true );
+    try {
+        psu->check_reply_error ( reply, size );
+        if ( request.on_reply ) {
+            request.on_reply ( reply, size );
+        }
+    } catch ( PSUError &error ) {
+        fail ( request, error );
+    }
+}
+
+void Channel::fail ( Request &request, const PSUError &error )
+{
+    if ( this->error.empty () ) {
+        this->error = error.what ();
+    }
+    psu->get_stats ().failed++;
+    if ( request.on_error ) {
+        request.on_error ( error );
+    }
+}
+
+void Channel::wait () throw ( PSUError & )
+{
+    clear_error ();
+    while ( true ) {
+        handle_write ();
+        if ( idle () ) {
+            break;
+        }
+        int           timeout = -1;
+        int64_t       d       = deadline ();
+        if ( d != 0 ) {
+            int64_t remaining = d - hcs_monotonic_ns ();
+            timeout = remaining > 0 ? ( remaining + 999999 ) / 1000000 : 0;
+        }
+        struct pollfd pfd    = { get_fd (), (short) ( POLLIN | ( wants_write () ? POLLOUT : 0 ) ), 0 };
+        int64_t       before = hcs_monotonic_ns ();
+        int           r      = poll ( &pfd, 1, timeout );
+        psu->get_stats ().io_wait += hcs_monotonic_ns () - before;
+        if ( r < 0 && errno != EINTR ) {
+            fail_all ( PSUError ( std::string ( "Failed to wait for reply: " ) + strerror ( errno ) ) );
+            break;
+        }
+        if ( r > 0 && ( pfd.revents & ( POLLIN | POLLERR | POLLHUP ) ) ) {
+            handle_read ();
+        }
+        handle_timeout ( hcs_monotonic_ns () );
+    }
+    if ( !error.empty () ) {
+        throw PSUError ( error );
+    }
+}
+
+int64_t Channel::deadline () const
+{
+    if ( quiet_until != 0 ) {
+        return quiet_until;
+    }
+    int64_t d   = reply_deadline ();
+    int64_t gap = psu->get_write_gap ();
+    // Waiting out the gap before the next write.
+    if ( gap != 0 && !queue.empty () && in_flight.size () < psu->get_pipeline_depth () &&
+         ( d == 0 || last_write + gap < d ) ) {
+        d = last_write + gap;
+    }
+    return d;
+}
+
+int64_t Channel::reply_deadline () const
+{
+    if ( in_flight.empty () ) {
+        return 0;
+    }
+    const Request &request = in_flight.front ();
+    int64_t       d        = request.sent + ( request.timeout != 0 ? request.timeout : psu->get_reply_timeout () );
+    // Part of a reply came in, the rest should follow right away.
+    if ( request.first_byte != 0 && psu->get_byte_timeout () != 0 ) {
+        d = std::min ( d, last_byte + psu->get_byte_timeout () );
+    }
+    return d;
+}
+
+void Channel::handle_timeout ( int64_t now )
+{
+    if ( quiet_until != 0 ) {
+        if ( now >= quiet_until ) {
+            // The line is quiet, back in sync.
+            quiet_until = 0;
+        }
+        return;
+    }
+    int64_t d = reply_deadline ();
+    if ( d == 0 || now < d ) {
+        return;
+    }
+    if ( in_flight.front ().first_byte != 0 && psu->get_byte_timeout () != 0 &&
+         now >= last_byte + psu->get_byte_timeout () ) {
+        psu->get_stats ().crc_errors++;
+        fail_all ( PSUError ( "Message Invalid, reply incomplete" ), true );
+    }
+    else {
+        psu->get_stats ().timeouts++;
+        fail_all ( PSUError ( "Timeout waiting for reply" ), true );
+    }
+}
+
+bool Channel::may_retry ( const Request &request ) const
+{
+    // Requests not written completely never reached the device.
+    if ( request.sent == 0 ) {
+        return true;
+    }
+    return request.idempotent && request.failures <= psu->get_max_retries ();
+}
+
+void Channel::fail_all ( const PSUError &error, bool retry )
+{
+    // Replies of failed requests could still come in, drop what is pending.
+    tcflush ( get_fd (), TCIFLUSH );
+    rx_size = 0;
+    written = 0;
+    RequestQueue failed;
+    for ( RequestQueue *list : { &in_flight, &queue } ) {
+        while ( !list->empty () ) {
+            failed.push_back ( std::move ( list->front () ) );
+            list->pop_front ();
+        }
+    }
+    PSU::Stats &stats = psu->get_stats ();
+    if ( retry ) {
+        stats.resyncs++;
+        quiet_until = hcs_monotonic_ns () + psu->get_resync_time ();
+    }
+    for ( size_t i = 0; i < failed.size (); i++ ) {
+        Request &request = failed[i];
+        // Only the oldest request is to blame, the replies to the others were just dropped.
+        if ( retry && i == 0 && request.sent != 0 ) {
+            request.failures++;
+            psu->exchange_done ( request.data, request.size, 0, false );
+        }
+        if ( retry && may_retry ( request ) ) {
+            if ( request.sent != 0 ) {
+                stats.retries++;
+            }
+            request.write_start = request.sent = request.first_byte = 0;
+            queue.push_back ( std::move ( request ) );
+        }
+        else if ( retry && request.failures > 1 ) {
+            fail ( request, PSUError ( std::string ( error.what () ) + " (after " +
+                                       std::to_string ( request.failures ) + " attempts)" ) );
+        }
+        else {
+            fail ( request, error );
+        }
+    }
+}
@@ -0,0 +1,170 @@
+/**
+ *    This file is part of HCS.
+ *    Written by Qball Cow <qball@gmpclient.org> 2013-2015
+ *
+ *    HCS is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 2 of the License.
+ *
+ *    HCS is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with HCS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <iostream>
+#include <exception>
+#include <string>
+#include <map>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <termios.h>
+#include <hcs.h>
+#include <hcs-command.h>
+
+#include <config.h>
+
+typedef Command::Id   Id;
+typedef Command::Type Type;
+
+/**
+ * Every hcs command, with the arguments it takes.
+ */
+static const Command::Spec command_specs[] = {
+    { "auto",     Id::AUTO,     "[device]",                 { { Type::COUNT, true, nullptr } } },
+    { "pps",      Id::PPS,      "",                         {} },
+    { "eaps",     Id::EAPS,     "",                         {} },
+    { "list",     Id::LIST,     "",                         {} },
+    { "refresh",  Id::REFRESH,  "",                         {} },
+    { "format",   Id::FORMAT,   "[format]",                 { { Type::WORD, true, nullptr } } },
+    { "logfile",  Id::LOGFILE,  "[file|-]",                 { { Type::WORD, true, nullptr } } },
+    { "metrics",  Id::METRICS,  "[target|none]",            { { Type::WORD, true, nullptr } } },
+    { "decode",   Id::DECODE,   "<file>",                   { { Type::WORD, false, nullptr } } },
+    { "open",     Id::OPEN,     "[type:device,...]",        { { Type::WORD, true, nullptr } } },
+    { "group",    Id::GROUP,    "<name> <devices>",         { { Type::WORD, false, nullptr },
+                                                              { Type::WORD, false, nullptr } } },
+    { "target",   Id::TARGET,   "[name|none]",              { { Type::WORD, true, nullptr } } },
+    { "stats",    Id::STATS,    "[json]",                   { { Type::KEYWORD, true, "json" } } },
+    { "-f",       Id::SCRIPT,   "<script>",                 { { Type::WORD, false, nullptr } } },
+    { "status",   Id::STATUS,   "",                         {} },
+    { "on",       Id::ON,       "",                         {} },
+    { "off",      Id::OFF,      "",                         {} },
+    { "mode",     Id::MODE,     "",                         {} },
+    { "voltage",  Id::VOLTAGE,  "[volts]",                  { { Type::NUMBER, true, nullptr } } },
+    { "current",  Id::CURRENT,  "[amps]",                   { { Type::NUMBER, true, nullptr } } },
+    { "ovp",      Id::OVP,      "[volts]",                  { { Type::NUMBER, true, nullptr } } },
+    { "ocp",      Id::OCP,      "[amps]",                   { { Type::NUMBER, true, nullptr } } },
+    { "monitor",  Id::MONITOR,  "[interval] [count]",       { { Type::NUMBER, true, nullptr },
+                                                              { Type::COUNT, true, nullptr } } },
+    { "bench",    Id::BENCH,    "[operation] [iterations]", { { Type::KEYWORD, true,
+                                                                "all|voltage_actual|current_actual|voltage|current|"
+                                                                "mode|snapshot|set_voltage|set_current" },
+                                                              { Type::COUNT, true, nullptr } } },
+    { "ramp",     Id::RAMP,     "[voltage|current] <from> <to> <seconds> [steps] [lin|exp]",
+                                                            { { Type::KEYWORD, true, "voltage|current" },
+                                                              { Type::NUMBER, false, nullptr },
+                                                              { Type::NUMBER, false, nullptr },
+                                                              { Type::NUMBER, false, nullptr },
+                                                              { Type::COUNT, true, nullptr },
+                                                              { Type::KEYWORD, true, "lin|exp" } } },
+    { "sequence", Id::SEQUENCE, "<time:voltage[:current],...|file>",
+                                                            { { Type::WORD, false, nullptr } } },
+    { "cp",       Id::CP,       "<watts> [seconds] [max voltage]",
+                                                            { { Type::NUMBER, false, nullptr },
+                                                              { Type::NUMBER, true, nullptr },
+                                                              { Type::NUMBER, true, nullptr } } },
+    { "trigger",  Id::TRIGGER,  "<condition> [pre] [post]", { { Type::WORD, false, nullptr },
+                                                              { Type::COUNT, true, nullptr },
+                                                              { Type::COUNT, true, nullptr } } },
+    { "publish",  Id::PUBLISH,  "[name] [interval] [count]",
+                                                            { { Type::NAME, true, nullptr },
+                                                              { Type::NUMBER, true, nullptr },
+                                                              { Type::COUNT, true, nullptr } } },
+    { "energy",   Id::ENERGY,   "[run [seconds]|reset]",    { { Type::KEYWORD, true, "run|reset" },
+                                                              { Type::NUMBER, true, nullptr } } },
+    { "sync",     Id::SYNC,     "[interval] [count]",       { { Type::NUMBER, true, nullptr },
+                                                              { Type::COUNT, true, nullptr } } },
+};
+
+/**
+ * @returns the index of word in keywords ('|' separated), -1 if it is not one of them.
+ */
+static int command_keyword ( const char *keywords, const char *word )
+{
+    size_t length = strlen ( word );
+    int    index  = 0;
+    for ( const char *k = keywords; k != nullptr; k = strchr ( k, '|' ), index++ ) {
+        if ( *k == '|' ) {
+            k++;
+        }
+        if ( strncmp ( k, word, length ) == 0 && ( k[length] == '|' || k[length] == '\0' ) ) {
+            return index;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @returns true when word is of type, the value is stored in arg.
+ */
+static bool command_arg ( const Command::Param &param, const char *word, Command::Arg &arg )
+{
+    char *p;
+    arg.word = word;
+    switch ( param.type )
+    {
+    case Type::WORD:
+        return true;
+    case Type::NAME:
+        strtod ( word, &p );
+        return p == word || *p != '\0';
+    case Type::NUMBER:
+        arg.number = strtod ( word, &p );
+        return p != word && *p == '\0' && isfinite ( arg.number );
+    case Type::COUNT:
+        arg.count = strtoul ( word, &p, 10 );
+        return p != word && *p == '\0' && word[0] != '-';
+    case Type::KEYWORD:
+    {
+        int index = command_keyword ( param.keywords, word );
+        arg.count = index;
+        return index >= 0;
+    }
+    default:
+        return false;
+    }
+}
+
+Command Command::parse ( int argc, char **argv ) throw ( PSUError & )
+{
+    Command command;
+    for ( auto &spec : command_specs ) {
+        if ( strcmp ( argv[0], spec.name ) == 0 ) {
+            command.spec = &spec;
+            break;
+        }
+    }
+    if ( command.spec == nullptr ) {
+        throw PSUError ( std::string ( "Unknown command: " ) + argv[0] );
+    }
+    command.words = 1;
+    for ( size_t i = 0; i < max_args && command.spec->params[i].type != Type::NONE; i++ ) {
+        const Param &param = command.spec->params[i];
+        Arg         &arg   = command.args[i];
+        if ( command.words < argc && command_arg ( param, argv[command.words], arg ) ) {
+            arg.set = true;
+            command.words++;
+        }
+        else if ( !param.optional ) {
+            throw PSUError ( std::string ( "Usage: " ) + command.spec->name + " " + command.spec->usage );
+        }
+        else {
+            arg = Arg ();
+        }
+    }
+    return command;
+}
@@ -0,0 +1,352 @@
+/**
+ *    This file is part of HCS.
+ *    Written by Qball Cow <qball@gmpclient.org> 2013-2015
+ *
+ *    HCS is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 2 of the License.
+ *
+ *    HCS is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with HCS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <iostream>
+#include <exception>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <deque>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <limits.h>
+#include <termios.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <hcs.h>
+#include <hcs-daemon.h>
+
+#include <config.h>
+
+// Largest request accepted.
+#define DAEMON_MAX_REQUEST    65536
+
+// Set from the SIGINT/SIGTERM handler to stop serving.
+static volatile sig_atomic_t daemon_stop = 0;
+
+static void daemon_sigterm ( int sig )
+{
+    daemon_stop = 1;
+}
+
+// The client went away (or sent something), interrupt the running command.
+static void daemon_sigio ( int sig )
+{
+    hcs_stop ();
+}
+
+static bool write_all ( int fd, const void *data, size_t size )
+{
+    const char *p = (const char *) data;
+    while ( size > 0 ) {
+        ssize_t r = write ( fd, p, size );
+        if ( r < 0 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            return false;
+        }
+        p    += r;
+        size -= r;
+    }
+    return true;
+}
+
+static bool read_all ( int fd, void *data, size_t size )
+{
+    char *p = (char *) data;
+    while ( size > 0 ) {
+        ssize_t r = read ( fd, p, size );
+        if ( r < 0 && errno == EINTR ) {
+            continue;
+        }
+        if ( r <= 0 ) {
+            return false;
+        }
+        p    += r;
+        size -= r;
+    }
+    return true;
+}
+
+static bool make_address ( const std::string &path, struct sockaddr_un &addr )
+{
+    memset ( &addr, 0, sizeof ( addr ) );
+    addr.sun_family = AF_UNIX;
+    if ( path.size () >= sizeof ( addr.sun_path ) ) {
+        return false;
+    }
+    strcpy ( addr.sun_path, path.c_str () );
+    return true;
+}
+
+std::string Daemon::socket_path ()
+{
+    const char *path = getenv ( "HCS_SOCKET" );
+    if ( path != nullptr && path[0] != '\0' ) {
+        return path;
+    }
+    path = getenv ( "XDG_RUNTIME_DIR" );
+    if ( path != nullptr && path[0] != '\0' ) {
+        return std::string ( path ) + "/hcs.sock";
+    }
+    return "/tmp/hcs-" + std::to_string ( getuid () ) + ".sock";
+}
+
+bool Daemon::forward ( int argc, char **argv, int &status )
+{
+    if ( getenv ( "HCS_NO_DAEMON" ) != nullptr ) {
+        return false;
+    }
+    struct sockaddr_un addr;
+    if ( !make_address ( socket_path (), addr ) ) {
+        return false;
+    }
+    int sock = socket ( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+    if ( sock < 0 ) {
+        return false;
+    }
+    if ( connect ( sock, (struct sockaddr *) &addr, sizeof ( addr ) ) < 0 ) {
+        close ( sock );
+        return false;
+    }
+    // The socket may live in a world writable directory, only hand our output and command line
+    // to a daemon of our own.
+    struct ucred cred;
+    socklen_t    cred_size = sizeof ( cred );
+    if ( getsockopt ( sock, SOL_SOCKET, SO_PEERCRED, &cred, &cred_size ) < 0 || cred.uid != getuid () ) {
+        fprintf ( stderr, "Not using %s, it is not served by this user\n", addr.sun_path );
+        close ( sock );
+        return false;
+    }
+
+    // Build the request.
+    char        cwd[PATH_MAX];
+    const char  *device = getenv ( "HCS_DEVICE" );
+    std::string payload ( getcwd ( cwd, sizeof ( cwd ) ) != nullptr ? cwd : "/" );
+    payload.push_back ( '\0' );
+    payload.append ( device != nullptr ? device : "" );
+    payload.push_back ( '\0' );
+    for ( int i = 0; i < argc; i++ ) {
+        payload.append ( argv[i] );
+        payload.push_back ( '\0' );
+    }
+    uint32_t size = payload.size ();
+
+    // The header goes with our stdout and stderr.
+    int           fds[2] = { STDOUT_FILENO, STDERR_FILENO };
+    char          control[CMSG_SPACE ( sizeof ( fds ) )];
+    struct iovec  iov    = { &size, sizeof ( size ) };
+    struct msghdr msg;
+    memset ( &msg, 0, sizeof ( msg ) );
+    memset ( control, 0, sizeof ( control ) );
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = control;
+    msg.msg_controllen = sizeof ( control );
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR ( &msg );
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type  = SCM_RIGHTS;
+    cmsg->cmsg_len   = CMSG_LEN ( sizeof ( fds ) );
+    memcpy ( CMSG_DATA ( cmsg ), fds, sizeof ( fds ) );
+
+    fflush ( stdout );
+    fflush ( stderr );
+    int32_t reply = EXIT_FAILURE;
+    if ( sendmsg ( sock, &msg, MSG_NOSIGNAL ) != sizeof ( size ) ||
+         !write_all ( sock, payload.data (), payload.size () ) ) {
+        fprintf ( stderr, "Failed to send command to hcsd: %s\n", strerror ( errno ) );
+    }
+    else if ( !read_all ( sock, &reply, sizeof ( reply ) ) ) {
+        fprintf ( stderr, "hcsd closed the connection\n" );
+        reply = EXIT_FAILURE;
+    }
+    close ( sock );
+    status = reply;
+    return true;
+}
+
+Daemon::Daemon()
+{
+}
+
+Daemon::~Daemon()
+{
+    if ( sock >= 0 ) {
+        close ( sock );
+        unlink ( path.c_str () );
+    }
+}
+
+void Daemon::listen () throw ( PSUError & )
+{
+    path = socket_path ();
+    struct sockaddr_un addr;
+    if ( !make_address ( path, addr ) ) {
+        throw PSUError ( "Socket path too long: " + path );
+    }
+    int fd = socket ( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+    if ( fd < 0 ) {
+        throw PSUError ( std::string ( "Failed to create socket: " ) + strerror ( errno ) );
+    }
+    // A socket nobody answers on is left over from a daemon that died.
+    if ( connect ( fd, (struct sockaddr *) &addr, sizeof ( addr ) ) == 0 ) {
+        close ( fd );
+        throw PSUError ( "Daemon already running on " + path );
+    }
+    unlink ( path.c_str () );
+    // Only the user may talk to the power supplies.
+    mode_t mask = umask ( 077 );
+    int    r    = bind ( fd, (struct sockaddr *) &addr, sizeof ( addr ) );
+    umask ( mask );
+    if ( r < 0 || ::listen ( fd, 8 ) < 0 ) {
+        std::string error = "Failed to listen on " + path + ": " + strerror ( errno );
+        close ( fd );
+        throw PSUError ( error );
+    }
+    sock = fd;
+}
+
+void Daemon::serve ( std::function<int ( int argc, char **argv )> handler )
+{
+    struct sigaction sa;
+    memset ( &sa, 0, sizeof ( sa ) );
+    sigemptyset ( &sa.sa_mask );
+    // No SA_RESTART, accept () has to return on the signal.
+    sa.sa_handler = daemon_sigterm;
+    sigaction ( SIGINT, &sa, NULL );
+    sigaction ( SIGTERM, &sa, NULL );
+    sa.sa_handler = daemon_sigio;
+    sigaction ( SIGIO, &sa, NULL );
+    signal ( SIGPIPE, SIG_IGN );
+
+    fprintf ( stderr, "hcsd: listening on %s\n", path.c_str () );
+    while ( !daemon_stop ) {
+        int client = accept4 ( sock, NULL, NULL, SOCK_CLOEXEC );
+        if ( client < 0 ) {
+            if ( errno != EINTR ) {
+                fprintf ( stderr, "hcsd: accept failed: %s\n", strerror ( errno ) );
+            }
+            continue;
+        }
+        handle ( client, handler );
+        close ( client );
+    }
+}
+
+void Daemon::handle ( int client, std::function<int ( int argc, char **argv )> &handler )
+{
+    // Do not let a stuck client block the daemon.
+    struct timeval tv = { 1, 0 };
+    setsockopt ( client, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof ( tv ) );
+
+    uint32_t      size = 0;
+    int           fds[2] = { -1, -1 };
+    char          control[CMSG_SPACE ( sizeof ( fds ) )];
+    struct iovec  iov    = { &size, sizeof ( size ) };
+    struct msghdr msg;
+    memset ( &msg, 0, sizeof ( msg ) );
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = control;
+    msg.msg_controllen = sizeof ( control );
+    ssize_t r = recvmsg ( client, &msg, MSG_CMSG_CLOEXEC );
+    for ( struct cmsghdr *cmsg = CMSG_FIRSTHDR ( &msg ); cmsg != NULL; cmsg = CMSG_NXTHDR ( &msg, cmsg ) ) {
+        if ( cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+             cmsg->cmsg_len == CMSG_LEN ( sizeof ( fds ) ) ) {
+            memcpy ( fds, CMSG_DATA ( cmsg ), sizeof ( fds ) );
+        }
+    }
+    std::vector<char> payload;
+    if ( r == 0 ) {
+        // Connected and closed again, like listen () does to check for a running daemon.
+        return;
+    }
+    if ( r != sizeof ( size ) || fds[0] < 0 || size == 0 || size > DAEMON_MAX_REQUEST ) {
+        fprintf ( stderr, "hcsd: invalid request\n" );
+    }
+    else {
+        payload.resize ( size );
+        if ( !read_all ( client, payload.data (), size ) || payload.back () != '\0' ) {
+            fprintf ( stderr, "hcsd: invalid request\n" );
+            payload.clear ();
+        }
+    }
+
+    int32_t status = EXIT_FAILURE;
+    if ( !payload.empty () ) {
+        // Split in working directory, device and arguments.
+        std::vector<char *> strings;
+        for ( size_t i = 0; i < payload.size (); i += strlen ( &payload[i] ) + 1 ) {
+            strings.push_back ( &payload[i] );
+        }
+        if ( strings.size () >= 2 ) {
+            if ( chdir ( strings[0] ) < 0 ) {
+                fprintf ( stderr, "hcsd: failed to change to %s: %s\n", strings[0], strerror ( errno ) );
+            }
+            if ( strings[1][0] != '\0' ) {
+                setenv ( "HCS_DEVICE", strings[1], 1 );
+            }
+            else {
+                unsetenv ( "HCS_DEVICE" );
+            }
+            strings.push_back ( nullptr );
+
+            // Run with the output going to the client.
+            std::cout.flush ();
+            std::cerr.flush ();
+            fflush ( stdout );
+            fflush ( stderr );
+            int saved_out = dup ( STDOUT_FILENO );
+            int saved_err = dup ( STDERR_FILENO );
+            dup2 ( fds[0], STDOUT_FILENO );
+            dup2 ( fds[1], STDERR_FILENO );
+            // Get SIGIO when the client hangs up.
+            fcntl ( client, F_SETOWN, getpid () );
+            fcntl ( client, F_SETFL, fcntl ( client, F_GETFL ) | O_ASYNC );
+
+            status = handler ( strings.size () - 3, &strings[2] );
+
+            fcntl ( client, F_SETFL, fcntl ( client, F_GETFL ) & ~O_ASYNC );
+            std::cout.flush ();
+            std::cerr.flush ();
+            fflush ( stdout );
+            fflush ( stderr );
+            dup2 ( saved_out, STDOUT_FILENO );
+            dup2 ( saved_err, STDERR_FILENO );
+            close ( saved_out );
+            close ( saved_err );
+            if ( chdir ( "/" ) < 0 ) {
+                // Not fatal, the next request changes directory again.
+            }
+        }
+    }
+    for ( auto fd : fds ) {
+        if ( fd >= 0 ) {
+            close ( fd );
+        }
+    }
+    write_all ( client, &status, sizeof ( status ) );
+}
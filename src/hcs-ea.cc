@@ -21,16 +21,24 @@
 #include <termios.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <string.h>
 #include <sys/time.h>
+#include <time.h>
+#include <functional>
+#include <vector>
+#include <map>
 #include <hcs.h>
+#include <hcs-channel.h>
+#include <hcs-cache.h>
+#include <hcs-pacing.h>
 #include <hcs-ea.h>
 
 #include <config.h>
 /**
  * Helpers.
  */
-static inline float  to_float ( uint8_t val[4] )
+static inline float  to_float ( const uint8_t val[4] )
 {
     union
     {
@@ -45,7 +53,7 @@ static inline float  to_float ( uint8_t val[4] )
     b.value    = be32toh ( b.value );
     return b.fv;
 }
-static inline uint32_t to_uint16 ( uint8_t val[2] )
+static inline uint32_t to_uint16 ( const uint8_t val[2] )
 {
     union
     {
@@ -57,46 +65,111 @@ static inline uint32_t to_uint16 ( uint8_t val[2] )
     b.value    = be16toh ( b.value );
     return b.value;
 }
+/**
+ * The telegram interface to communication with PSU
+ */
 /**
  * Interface API
  */
 void EAPS2K::print_device_info () throw( PSUError & )
 {
+    Identity identity;
+    get_identity ( identity );
     printf ( "---------------------------------------\n" );
     printf ( "\nDevice information:\n" );
-    // Get device type.
-    telegram_start ( RECEIVE, 16 );
-    telegram_set_object ( DEVICE_TYPE );
-    telegram_send ();
-    printf ( " Device Type:      %20s\n", &_telegram[3] );
-
-    telegram_start ( RECEIVE, 16 );
-    telegram_set_object ( MANUFACTURER );
-    telegram_send ();
-    printf ( " Manufacturer:     %20s\n", &_telegram[3] );
-
-    telegram_start ( RECEIVE, 16 );
-    telegram_set_object ( DEVICE_ARTICLE_NO );
-    telegram_send ();
-    printf ( " Article No. :     %20s\n", &_telegram[3] );
-
-    telegram_start ( RECEIVE, 16 );
-    telegram_set_object ( DEVICE_SERIAL_NO );
-    telegram_send ();
-    printf ( " Serial Num.:      %20s\n", &_telegram[3] );
-
-    telegram_start ( RECEIVE, 16 );
-    telegram_set_object ( SOFTWARE_VERSION );
-    telegram_send ();
-    printf ( " Software Version: %20s\n", &_telegram[3] );
+    printf ( " Device Type:      %20s\n", identity.type.c_str () );
+    printf ( " Manufacturer:     %20s\n", identity.manufacturer.c_str () );
+    printf ( " Article No. :     %20s\n", identity.article.c_str () );
+    printf ( " Serial Num.:      %20s\n", identity.serial.c_str () );
+    printf ( " Software Version: %20s\n", identity.software.c_str () );
 
     printf ( "\nDevice specifications:\n" );
     printf ( " Nominal voltage:  %20.02f\n", nominal_voltage );
     printf ( " Nominal current:  %20.02f\n", nominal_current );
     printf ( " Nominal power:    %20.02f\n", nominal_power );
+    printf ( " Round trip (ms):  %20.02f\n", last_round_trip / 1e6 );
 
     PSU::print_device_info ();
 }
+void EAPS2K::get_identity ( Identity &identity ) throw( PSUError & )
+{
+    if ( !identity_valid ) {
+        probe_identity ();
+    }
+    identity = this->identity;
+}
+void EAPS2K::queue_identity ()
+{
+    // Queue all reads, so the round trips overlap.
+    queue_read_string ( DEVICE_TYPE, identity.type );
+    queue_read_string ( MANUFACTURER, identity.manufacturer );
+    queue_read_string ( DEVICE_ARTICLE_NO, identity.article );
+    queue_read_string ( DEVICE_SERIAL_NO, identity.serial );
+    queue_read_string ( SOFTWARE_VERSION, identity.software );
+}
+void EAPS2K::queue_nominal ()
+{
+    queue_telegram ( channel, RECEIVE, 4, NOMINAL_VOLTAGE, 0, [this] ( const uint8_t *telegram, size_t size ) {
+        this->nominal_voltage = to_float ( &telegram[3] );
+    } );
+    queue_telegram ( channel, RECEIVE, 4, NOMINAL_CURRENT, 0, [this] ( const uint8_t *telegram, size_t size ) {
+        this->nominal_current = to_float ( &telegram[3] );
+    } );
+    queue_telegram ( channel, RECEIVE, 4, NOMINAL_POWER, 0, [this] ( const uint8_t *telegram, size_t size ) {
+        this->nominal_power = to_float ( &telegram[3] );
+    } );
+}
+void EAPS2K::probe_identity ()
+{
+    queue_identity ();
+    telegram_wait ();
+    set_identity_ratings ();
+}
+void EAPS2K::set_identity_ratings ()
+{
+    identity.nominal_voltage = nominal_voltage;
+    identity.nominal_current = nominal_current;
+    identity.nominal_power   = nominal_power;
+    // Values are send as a fraction of nominal, 25600 is 100%.
+    identity.voltage_resolution = nominal_voltage / 256.0e2;
+    identity.current_resolution = nominal_current / 256.0e2;
+    identity_valid              = true;
+}
+bool EAPS2K::load_cache ( const std::string &serial )
+{
+    DeviceCache cache ( "ea-" + serial );
+    if ( !cache.load () || cache.get ( "serial" ) != serial ) {
+        return false;
+    }
+    nominal_voltage = cache.get_double ( "nominal_voltage" );
+    nominal_current = cache.get_double ( "nominal_current" );
+    nominal_power   = cache.get_double ( "nominal_power" );
+    // Without the ratings no value can be converted, do not trust the entry.
+    if ( nominal_voltage <= 0 || nominal_current <= 0 || nominal_power <= 0 ) {
+        return false;
+    }
+    identity.serial       = serial;
+    identity.type         = cache.get ( "type" );
+    identity.manufacturer = cache.get ( "manufacturer" );
+    identity.article      = cache.get ( "article" );
+    identity.software     = cache.get ( "software" );
+    set_identity_ratings ();
+    return true;
+}
+void EAPS2K::store_cache () const
+{
+    DeviceCache cache ( "ea-" + identity.serial );
+    cache.set ( "serial", identity.serial );
+    cache.set ( "type", identity.type );
+    cache.set ( "manufacturer", identity.manufacturer );
+    cache.set ( "article", identity.article );
+    cache.set ( "software", identity.software );
+    cache.set ( "nominal_voltage", nominal_voltage );
+    cache.set ( "nominal_current", nominal_current );
+    cache.set ( "nominal_power", nominal_power );
+    // Failing to store only costs a full probe next time.
+    cache.store ();
+}
 bool EAPS2K::check_supported_type ( const char *vendor_id, const char *product_id )
 {
     if ( strcasecmp ( vendor_id, "232e" ) == 0 ) {
@@ -108,272 +181,342 @@ bool EAPS2K::check_supported_type ( const char *vendor_id, const char *product_i
 }
 void EAPS2K::enable_remote () throw( PSUError & )
 {
-    telegram_start ( SEND, 2 );
-    telegram_set_object ( POWER_SUPPLY_CONTROL );
-    telegram_push ( 0x10 );
-    telegram_push ( 0x10 );
-    telegram_send ();
-    telegram_start ( RECEIVE, 6 );
-    telegram_set_object ( STATUS_ACTUAL );
-    telegram_send ();
-    // Check state
+    queue_telegram ( channel, SEND, 2, POWER_SUPPLY_CONTROL, 0x1010, [this] ( const uint8_t *telegram, size_t size ) {
+        this->remote       = RemoteState::REMOTE;
+        this->remote_taken = true;
+    } );
+    queue_telegram ( channel, RECEIVE, 6, STATUS_ACTUAL, 0, [this] ( const uint8_t *telegram, size_t size ) {
+        update_remote ( telegram );
+    } );
+    telegram_wait ();
+    if ( remote != RemoteState::REMOTE ) {
+        throw PSUError ( "Failed to take remote control" );
+    }
 }
 void EAPS2K::disable_remote () throw( PSUError & )
 {
-    telegram_start ( SEND, 2 );
-    telegram_set_object ( POWER_SUPPLY_CONTROL );
-    telegram_push ( 0x10 );
-    telegram_push ( 0x00 );
-    telegram_send ();
+    queue_telegram ( channel, SEND, 2, POWER_SUPPLY_CONTROL, 0x1000, [this] ( const uint8_t *telegram, size_t size ) {
+        this->remote       = RemoteState::LOCAL;
+        this->remote_taken = false;
+    } );
+    telegram_wait ();
+}
+void EAPS2K::update_remote ( const uint8_t *telegram )
+{
+    // Byte 0, bits 1+0: 01 -> remote control.
+    remote = ( telegram[3] & 0x03 ) == 0x01 ? RemoteState::REMOTE : RemoteState::LOCAL;
+}
+void EAPS2K::queue_remote ( Channel &channel )
+{
+    if ( remote == RemoteState::REMOTE ) {
+        return;
+    }
+    if ( remote == RemoteState::UNKNOWN ) {
+        // Find out if somebody else already holds remote control, then it is
+        // not ours to release. The enable below is harmless in that case.
+        queue_telegram ( channel, RECEIVE, 6, STATUS_ACTUAL, 0, [this] ( const uint8_t *telegram, size_t size ) {
+            update_remote ( telegram );
+            this->remote_taken = this->remote != RemoteState::REMOTE;
+        } );
+    }
+    else {
+        remote_taken = true;
+    }
+    queue_telegram ( channel, SEND, 2, POWER_SUPPLY_CONTROL, 0x1010, [this] ( const uint8_t *telegram, size_t size ) {
+        this->remote = RemoteState::REMOTE;
+    } );
 }
 void EAPS2K::state_enable () throw( PSUError & )
 {
-    telegram_start ( SEND, 2 );
-    telegram_set_object ( POWER_SUPPLY_CONTROL );
-    telegram_push ( 0x01 );
-    telegram_push ( 0x01 );
-    telegram_send ();
+    queue_operation ( channel, Operation::STATE_ENABLE, 0.0f, nullptr );
+    telegram_wait ();
 }
 void EAPS2K::state_disable () throw( PSUError & )
 {
-    telegram_start ( SEND, 2 );
-    telegram_set_object ( POWER_SUPPLY_CONTROL );
-    telegram_push ( 0x01 );
-    telegram_push ( 0x00 );
-    telegram_send ();
+    queue_operation ( channel, Operation::STATE_DISABLE, 0.0f, nullptr );
+    telegram_wait ();
 }
 
 bool EAPS2K::get_state () throw( PSUError & )
 {
-    telegram_start ( RECEIVE, 6 );
-    telegram_set_object ( STATUS_ACTUAL );
-    telegram_send ();
-    return ( _telegram[4] & 1 ) == 1;
+    Snapshot snapshot;
+    read_snapshot ( snapshot, SNAPSHOT_MODE );
+    return snapshot.mode != OperatingMode::OFF;
 }
 
 float EAPS2K::get_current () throw( PSUError & )
 {
-    telegram_start ( RECEIVE, 6 );
-    telegram_set_object ( STATUS_SET );
-    telegram_send ();
-    float current = to_uint16 ( &_telegram[7] );
-    return ( nominal_current * current ) / 256.0e2;
+    Snapshot snapshot;
+    read_snapshot ( snapshot, SNAPSHOT_CURRENT );
+    return snapshot.current;
 }
 float EAPS2K::get_voltage () throw( PSUError & )
 {
-    telegram_start ( RECEIVE, 6 );
-    telegram_set_object ( STATUS_SET );
-    telegram_send ();
-    float voltage = to_uint16 ( &_telegram[5] );
-    return ( nominal_voltage * voltage ) / 256.0e2;
+    Snapshot snapshot;
+    read_snapshot ( snapshot, SNAPSHOT_VOLTAGE );
+    return snapshot.voltage;
 }
 float EAPS2K::get_current_actual () throw( PSUError & )
 {
-    telegram_start ( RECEIVE, 6 );
-    telegram_set_object ( STATUS_ACTUAL );
-    telegram_send ();
-    float current = to_uint16 ( &_telegram[7] );
-    return ( nominal_current * current ) / 256.0e2;
+    Snapshot snapshot;
+    read_snapshot ( snapshot, SNAPSHOT_CURRENT_ACTUAL );
+    return snapshot.current_actual;
 }
 float EAPS2K::get_voltage_actual () throw( PSUError & )
 {
-    telegram_start ( RECEIVE, 2 );
-    telegram_set_object ( STATUS_ACTUAL );
-    telegram_send ();
-    float voltage = to_uint16 ( &_telegram[5] );
-    return ( nominal_voltage * voltage ) / 256.0e2;
+    Snapshot snapshot;
+    read_snapshot ( snapshot, SNAPSHOT_VOLTAGE_ACTUAL );
+    return snapshot.voltage_actual;
 }
 
 float EAPS2K::get_over_voltage () throw ( PSUError & )
 {
-    telegram_start ( RECEIVE, 2 );
-    telegram_set_object ( OVP_THRESHOLD );
-    telegram_send ();
-    float voltage = to_uint16 ( &_telegram[3] );
-    return ( nominal_voltage * voltage ) / 256.0e2;
+    Snapshot snapshot;
+    read_snapshot ( snapshot, SNAPSHOT_OVER_VOLTAGE );
+    return snapshot.over_voltage;
 }
 float EAPS2K::get_over_current () throw ( PSUError & )
 {
-    telegram_start ( RECEIVE, 6 );
-    telegram_set_object ( OCP_THRESHOLD );
-    telegram_send ();
-    float current = to_uint16 ( &_telegram[3] );
-    return ( nominal_current * current ) / 256.0e2;
+    Snapshot snapshot;
+    read_snapshot ( snapshot, SNAPSHOT_OVER_CURRENT );
+    return snapshot.over_current;
 }
 
 PSU::OperatingMode EAPS2K::get_operating_mode () throw( PSUError & )
 {
-    telegram_start ( RECEIVE, 6 );
-    telegram_set_object ( STATUS_ACTUAL );
-    telegram_send ();
-    if ( ( _telegram[4] & 1 ) == 0 ) {
-        return OperatingMode::OFF;
-    }
-    // bits 2+1: 10->CC, 00->CV
-    return ( ( _telegram[4] & 6 ) >> 2 ) ? OperatingMode::CC : OperatingMode::CV;
+    Snapshot snapshot;
+    read_snapshot ( snapshot, SNAPSHOT_MODE );
+    return snapshot.mode;
 }
-void EAPS2K::set_voltage ( float value ) throw( PSUError & )
+void EAPS2K::read_snapshot ( Snapshot &snapshot, unsigned int fields ) throw( PSUError & )
 {
-    uint32_t val = ( value * 25600 ) / nominal_voltage;
-    telegram_start ( SEND, 2 );
-    telegram_set_object ( SET_VOLTAGE );
-    telegram_push ( ( val >> 8 ) & 0xFF );
-    telegram_push ( val & 0xFF );
-    telegram_send ();
+    queue_operation ( channel, Operation::SNAPSHOT, 0.0f, &snapshot, fields );
+    telegram_wait ();
+    remember ( snapshot );
 }
-void EAPS2K::set_current ( float value ) throw( PSUError & )
+void EAPS2K::decode_status_set ( const uint8_t *telegram, Snapshot &snapshot ) const
 {
-    uint32_t val = ( value * 25600 ) / nominal_current;
-    telegram_start ( SEND, 2 );
-    telegram_set_object ( SET_CURRENT );
-    telegram_push ( ( val >> 8 ) & 0xFF );
-    telegram_push ( val & 0xFF );
-    telegram_send ();
+    snapshot.voltage = ( nominal_voltage * to_uint16 ( &telegram[5] ) ) / 256.0e2;
+    snapshot.current = ( nominal_current * to_uint16 ( &telegram[7] ) ) / 256.0e2;
+    snapshot.fields |= SNAPSHOT_VOLTAGE | SNAPSHOT_CURRENT;
 }
-
-void EAPS2K::set_over_current ( float value ) throw( PSUError & )
+void EAPS2K::decode_status_actual ( const uint8_t *telegram, Snapshot &snapshot ) const
 {
-    uint32_t val = ( value * 25600 ) / nominal_current;
-    telegram_start ( SEND, 2 );
-    telegram_set_object ( OCP_THRESHOLD );
-    telegram_push ( ( val >> 8 ) & 0xFF );
-    telegram_push ( val & 0xFF );
-    telegram_send ();
+    snapshot.voltage_actual_raw = to_uint16 ( &telegram[5] );
+    snapshot.current_actual_raw = to_uint16 ( &telegram[7] );
+    snapshot.voltage_actual     = ( nominal_voltage * snapshot.voltage_actual_raw ) / 256.0e2;
+    snapshot.current_actual     = ( nominal_current * snapshot.current_actual_raw ) / 256.0e2;
+    if ( ( telegram[4] & 1 ) == 0 ) {
+        snapshot.mode = OperatingMode::OFF;
+    }
+    else {
+        // bits 2+1: 10->CC, 00->CV
+        snapshot.mode = ( ( telegram[4] & 6 ) >> 2 ) ? OperatingMode::CC : OperatingMode::CV;
+    }
+    snapshot.fields |= SNAPSHOT_VOLTAGE_ACTUAL | SNAPSHOT_CURRENT_ACTUAL | SNAPSHOT_MODE;
 }
-
-
-void EAPS2K::set_over_voltage ( float value ) throw( PSUError & )
+void EAPS2K::decode_threshold ( const uint8_t *telegram, ObjectTypes object, Snapshot &snapshot ) const
 {
-    uint32_t val = ( value * 25600 ) / nominal_voltage;
-    telegram_start ( SEND, 2 );
-    telegram_set_object ( OVP_THRESHOLD );
-    telegram_push ( ( val >> 8 ) & 0xFF );
-    telegram_push ( val & 0xFF );
-    telegram_send ();
+    if ( object == OVP_THRESHOLD ) {
+        snapshot.over_voltage = ( nominal_voltage * to_uint16 ( &telegram[3] ) ) / 256.0e2;
+        snapshot.fields      |= SNAPSHOT_OVER_VOLTAGE;
+    }
+    else {
+        snapshot.over_current = ( nominal_current * to_uint16 ( &telegram[3] ) ) / 256.0e2;
+        snapshot.fields      |= SNAPSHOT_OVER_CURRENT;
+    }
 }
-
 /**
- * The telegram interface to communication with PSU
+ * Asynchronous interface
  */
-static int crc16 ( uint8_t *ba, int size )
+size_t EAPS2K::reply_length ( const uint8_t *buffer, size_t size ) const
 {
-    int work = 0;
-    for ( int i = 0; i < size; i++ ) {
-        work += ba[i];
-    }
-    return work & 0xFFFF;
+    // SD (1) + DN (1) + OBJ (1) + DATA (from SD) + CS (2)
+    size_t length = 3 + ( buffer[0] & 0x0F ) + 1 + 2;
+    return size >= length ? length : 0;
 }
-
-void EAPS2K::telegram_validate ()
+void EAPS2K::exchange_done ( const uint8_t *request, size_t size, int64_t latency, bool ok )
 {
-    if ( _telegram[0] == 0 ) {
-        // Throw error.
+    if ( ok ) {
+        pacing.add_sample ( request[2], latency );
+    }
+    else {
+        pacing.backoff ();
     }
 }
-void EAPS2K::telegram_start ( SendType dir, int size )
+void EAPS2K::print_pacing ( FILE *out ) const
 {
-    // SD
-    _telegram[0] = cast_type + dir + direction + ( ( size - 1 ) & 0x0F );
-    // DN
-    _telegram[1]   = 0x00;
-    _telegram_size = 2;
+    pacing.print ( out );
 }
-void EAPS2K::telegram_set_object ( ObjectTypes object )
+bool EAPS2K::is_reply_start ( uint8_t byte ) const
 {
-    _telegram[_telegram_size] = object;
-    _telegram_size           += 1;
+    // Start delimiter of a telegram from the device, any length: an answer with the cast type
+    // set. The direction bit is only set on telegrams from the host.
+    return ( byte & 0xE0 ) == ( 0x80 | cast_type );
 }
-void EAPS2K::telegram_push ( uint8_t val )
+const char *EAPS2K::check_reply ( const uint8_t *request, size_t request_size,
+                                  const uint8_t *reply, size_t size ) const
 {
-    _telegram[_telegram_size] = val;
-    _telegram_size           += 1;
+    int crc = crc16 ( reply, size - 2 );
+    if ( reply[size - 2] != ( ( crc >> 8 ) & 0xFF ) || reply[size - 1] != ( crc & 0xFF ) ) {
+        return "Message Invalid, CRC failure";
+    }
+    // A valid telegram for another object means a reply got lost.
+    if ( reply[2] != request[2] && reply[2] != 0xFF ) {
+        return "Message Invalid, reply for another object";
+    }
+    return nullptr;
 }
-const char *EAPS2K::telegram_get_error ( ErrorTypes type ) const
+void EAPS2K::check_reply_error ( const uint8_t *reply, size_t size ) throw( PSUError & )
 {
-    for ( int i = 0; i < 10; i++ ) {
-        if ( ErrorTypeStr[i].type == type ) {
-            return ErrorTypeStr[i].name;
-        }
-    }
-    return ErrorTypeStr[0].name;
+    telegram_check_error ( reply );
 }
-void EAPS2K::telegram_send ()
+void EAPS2K::queue_telegram ( Channel &channel, SendType dir, int size, ObjectTypes object, uint16_t value,
+                              std::function<void(const uint8_t *telegram, size_t size)> on_reply )
 {
-    struct timespec start;
-    if ( _telegram[0] == 0 ) {
-        // Throw error.
+    Channel::Request request;
+    request.data[0] = cast_type + dir + direction + ( ( size - 1 ) & 0x0F );
+    request.data[1] = 0x00;
+    request.data[2] = object;
+    request.size    = 3;
+    if ( dir == SEND ) {
+        request.data[request.size++] = ( value >> 8 ) & 0xFF;
+        request.data[request.size++] = value & 0xFF;
     }
-    telegram_crc_set ();
-    ssize_t result = write ( fd, _telegram, _telegram_size );
-    if ( result != _telegram_size ) {
-        std::stringstream ss;
-        ss << "Failed to send sufficient bytes: " << result << " out of " << _telegram_size;
-        throw PSUError ( ss.str () );
+    int crc = crc16 ( request.data, request.size );
+    request.data[request.size++] = ( crc >> 8 ) & 0xFF;
+    request.data[request.size++] = crc & 0xFF;
+    request.timeout              = pacing.get_timeout ( object );
+    // Every object is read, or set to an absolute value: safe to send again.
+    request.idempotent           = true;
+    // Error replies are caught by check_reply_error ().
+    request.on_reply             = std::move ( on_reply );
+    channel.submit ( std::move ( request ) );
+}
+void EAPS2K::queue_operation ( Channel &channel, Operation op, float value,
+                               Snapshot *snapshot, unsigned int fields ) throw( PSUError & )
+{
+    switch ( op )
+    {
+    case Operation::SNAPSHOT:
+        if ( fields & ( SNAPSHOT_VOLTAGE | SNAPSHOT_CURRENT ) ) {
+            queue_telegram ( channel, RECEIVE, 6, STATUS_SET, 0, [this, snapshot] ( const uint8_t *telegram, size_t size ) {
+                decode_status_set ( telegram, *snapshot );
+            } );
+        }
+        if ( fields & ( SNAPSHOT_VOLTAGE_ACTUAL | SNAPSHOT_CURRENT_ACTUAL | SNAPSHOT_MODE ) ) {
+            queue_telegram ( channel, RECEIVE, 6, STATUS_ACTUAL, 0, [this, snapshot] ( const uint8_t *telegram, size_t size ) {
+                decode_status_actual ( telegram, *snapshot );
+                update_remote ( telegram );
+            } );
+        }
+        if ( fields & SNAPSHOT_OVER_VOLTAGE ) {
+            queue_telegram ( channel, RECEIVE, 2, OVP_THRESHOLD, 0, [this, snapshot] ( const uint8_t *telegram, size_t size ) {
+                decode_threshold ( telegram, OVP_THRESHOLD, *snapshot );
+            } );
+        }
+        if ( fields & SNAPSHOT_OVER_CURRENT ) {
+            queue_telegram ( channel, RECEIVE, 2, OCP_THRESHOLD, 0, [this, snapshot] ( const uint8_t *telegram, size_t size ) {
+                decode_threshold ( telegram, OCP_THRESHOLD, *snapshot );
+            } );
+        }
+        break;
+    default:
+        // Everything else changes the device, that needs remote control.
+        queue_remote ( channel );
+        break;
     }
-    clock_gettime ( CLOCK_REALTIME, &start );
-    fsync ( fd );
-    // check send error.
 
-    start.tv_nsec += 50e6;
-    // clear telegram.
-    _telegram[0] = 0;
-
-    // Sleep until 50ms has passed.
-    clock_nanosleep ( CLOCK_REALTIME, TIMER_ABSTIME, &start, NULL );
-    // Receive answer
-    telegram_receive ();
-    // Check error
-    if ( _telegram[2] == 0xFF && _telegram[3] != 0 ) {
-        ErrorTypes  type = (ErrorTypes) _telegram[3];
-        std::string name = std::string ( "PSU reported error: " );
-        name += telegram_get_error ( type );
-        throw PSUError ( name );
+    switch ( op )
+    {
+    case Operation::SNAPSHOT:
+        break;
+    case Operation::SET_VOLTAGE:
+        queue_telegram ( channel, SEND, 2, SET_VOLTAGE, ( value * 25600 ) / nominal_voltage, nullptr );
+        break;
+    case Operation::SET_CURRENT:
+        queue_telegram ( channel, SEND, 2, SET_CURRENT, ( value * 25600 ) / nominal_current, nullptr );
+        break;
+    case Operation::SET_OVER_VOLTAGE:
+        queue_telegram ( channel, SEND, 2, OVP_THRESHOLD, ( value * 25600 ) / nominal_voltage, nullptr );
+        break;
+    case Operation::SET_OVER_CURRENT:
+        queue_telegram ( channel, SEND, 2, OCP_THRESHOLD, ( value * 25600 ) / nominal_current, nullptr );
+        break;
+    case Operation::STATE_ENABLE:
+        queue_telegram ( channel, SEND, 2, POWER_SUPPLY_CONTROL, 0x0101, nullptr );
+        break;
+    case Operation::STATE_DISABLE:
+        queue_telegram ( channel, SEND, 2, POWER_SUPPLY_CONTROL, 0x0100, nullptr );
+        break;
     }
 }
-void EAPS2K::telegram_receive ()
+void EAPS2K::set_voltage ( float value ) throw( PSUError & )
 {
-    if ( _telegram[0] != 0 ) {
-        // Throw error.
-    }
-    // Read header first.
-    size_t ss = 3;
-    do {
-        ss -= read ( fd, &_telegram[3 - ss], ss );
-    } while ( ss > 0 );
-
-    // Calculate remainder of size.
-    _telegram_size = 3 + ( ( _telegram[0] ) & 0x0F ) + 1 + 2;
-    ss             = _telegram_size - 3;
-    do {
-        ss -= read ( fd, &_telegram[_telegram_size - ss], ss );
-    } while ( ss > 0 );
-
-    if ( !telegram_crc_check () ) {
-        throw PSUError ( "Message Invalid, CRC failure" );
-    }
+    queue_operation ( channel, Operation::SET_VOLTAGE, value, nullptr );
+    telegram_wait ();
 }
-/**
- * Set the crc of the telegram.
- */
-void EAPS2K::telegram_crc_set ()
+void EAPS2K::set_current ( float value ) throw( PSUError & )
+{
+    queue_operation ( channel, Operation::SET_CURRENT, value, nullptr );
+    telegram_wait ();
+}
+
+void EAPS2K::set_over_current ( float value ) throw( PSUError & )
 {
-    int16_t crc = crc16 ( _telegram, _telegram_size );
-    _telegram[_telegram_size++] = ( crc >> 8 ) & 0xFF;
-    _telegram[_telegram_size++] = ( crc ) & 0xFF;
+    queue_operation ( channel, Operation::SET_OVER_CURRENT, value, nullptr );
+    telegram_wait ();
 }
 
 
+void EAPS2K::set_over_voltage ( float value ) throw( PSUError & )
+{
+    queue_operation ( channel, Operation::SET_OVER_VOLTAGE, value, nullptr );
+    telegram_wait ();
+}
+
 /**
- * Check the crc of the telegram.
+ * The telegram interface to communication with PSU
  */
-bool EAPS2K::telegram_crc_check ()
+const char *EAPS2K::telegram_get_error ( ErrorTypes type ) const
 {
-    int16_t crc = crc16 ( _telegram, _telegram_size - 2 );
-    if ( ( _telegram[_telegram_size - 2] == ( ( crc >> 8 ) & 0xFF ) ) &&
-         ( _telegram[_telegram_size - 1] == ( ( crc ) & 0xFF ) ) ) {
-        return true;
+    for ( int i = 0; i < 10; i++ ) {
+        if ( ErrorTypeStr[i].type == type ) {
+            return ErrorTypeStr[i].name;
+        }
     }
-    return false;
+    return ErrorTypeStr[0].name;
+}
+const char *EAPS2K::get_device_error_str ( int code ) const
+{
+    return telegram_get_error ( (ErrorTypes) code );
+}
+void EAPS2K::telegram_wait ()
+{
+    channel.wait ();
+    last_round_trip = channel.get_last_round_trip ();
+}
+void EAPS2K::telegram_check_error ( const uint8_t *telegram )
+{
+    if ( telegram[2] == 0xFF && telegram[3] != 0 ) {
+        ErrorTypes  type = (ErrorTypes) telegram[3];
+        get_stats ().device_errors[type]++;
+        // The device got a garbled telegram, slow down.
+        if ( type == CRC_INVALID || type == DELIMITER_INVALID || type == OBJECT_LENGTH_INVALID ) {
+            pacing.backoff ();
+        }
+        std::string name = std::string ( "PSU reported error: " );
+        name += telegram_get_error ( type );
+        throw PSUError ( name );
+    }
+}
+void EAPS2K::queue_read_string ( ObjectTypes object, std::string &value )
+{
+    queue_telegram ( channel, RECEIVE, 16, object, 0, [&value] ( const uint8_t *telegram, size_t size ) {
+        // Strings are zero terminated, unless they fill the whole object.
+        const char *data = (const char *) &telegram[3];
+        value = std::string ( data, strnlen ( data, ( telegram[0] & 0x0F ) + 1 ) );
+    } );
 }
 
 /**
@@ -381,38 +524,76 @@ bool EAPS2K::telegram_crc_check ()
  */
 void EAPS2K::init ()
 {
-    // Retrieve nominal voltage
-    telegram_start ( RECEIVE, 4 );
-    telegram_set_object ( NOMINAL_VOLTAGE );
-    telegram_send ();
-    this->nominal_voltage = to_float ( &_telegram[3] );
-    // Retrieve nominal current
-    telegram_start ( RECEIVE, 4 );
-    telegram_set_object ( NOMINAL_CURRENT );
-    telegram_send ();
-    this->nominal_current = to_float ( &_telegram[3] );
-    // Retrieve nominal power
-    telegram_start ( RECEIVE, 4 );
-    telegram_set_object ( NOMINAL_POWER );
-    telegram_send ();
-    this->nominal_power = to_float ( &_telegram[3] );
+    // The channel does its own waiting.
+    fcntl ( fd, F_SETFL, fcntl ( fd, F_GETFL ) | O_NONBLOCK );
+
+    // The serial number is the one query needed to check the cached ratings.
+    std::string serial;
+    if ( !refresh_cache ) {
+        queue_read_string ( DEVICE_SERIAL_NO, serial );
+        telegram_wait ();
+    }
+    if ( refresh_cache || serial.empty () || !load_cache ( serial ) ) {
+        // Retrieve nominal voltage, current and power and the identity in one go.
+        queue_nominal ();
+        queue_identity ();
+        telegram_wait ();
+        set_identity_ratings ();
+        if ( !identity.serial.empty () ) {
+            store_cache ();
+        }
+    }
+    // Start from what the last session learned about this unit.
+    DeviceCache pacing_cache ( "ea-" + identity.serial + "-pacing" );
+    if ( !refresh_cache && !identity.serial.empty () && pacing_cache.load () ) {
+        pacing.load ( pacing_cache );
+    }
 
-    // Take control over the PSU.
-    // TODO: do it when only needed.
-    this->enable_remote ();
+    // Remote control is taken on the first write, see queue_remote ().
 }
 void EAPS2K::uninitialize ()
 {
-    // Release control over the PSU.
-    this->disable_remote ();
+    // Release control over the PSU, if we took it.
+    if ( remote_taken ) {
+        this->disable_remote ();
+    }
 }
-EAPS2K::EAPS2K() : PSU ( B115200 )
+EAPS2K::EAPS2K() : PSU ( B115200 ), channel ( this ), pacing ( pipeline_depth, reply_timeout )
 {
+    // A telegram is send in one go, 10ms is over a hundred byte times.
+    byte_timeout = 10000000LL;
+    const char *depth = getenv ( "HCS_EA_PIPELINE" );
+    if ( depth != nullptr && strtoul ( depth, nullptr, 10 ) > 0 ) {
+        pipeline_depth = strtoul ( depth, nullptr, 10 );
+    }
+    // In ms.
+    const char *timeout = getenv ( "HCS_EA_TIMEOUT" );
+    if ( timeout != nullptr && strtoul ( timeout, nullptr, 10 ) > 0 ) {
+        reply_timeout = strtoul ( timeout, nullptr, 10 ) * 1000000LL;
+    }
+    const char *retries = getenv ( "HCS_EA_RETRIES" );
+    if ( retries != nullptr ) {
+        max_retries = strtoul ( retries, nullptr, 10 );
+    }
+    pacing.set_max_depth ( pipeline_depth );
+    pacing.set_default_timeout ( reply_timeout );
 }
 
 EAPS2K::~EAPS2K()
 {
-    if ( this->fd >= 0 ) {
-        this->disable_remote ();
+    if ( this->fd >= 0 && !identity.serial.empty () ) {
+        // Only touch the file when something was learned.
+        DeviceCache cache ( "ea-" + identity.serial + "-pacing" );
+        cache.load ();
+        if ( pacing.store ( cache ) ) {
+            cache.store ();
+        }
+    }
+    if ( this->fd >= 0 && remote_taken ) {
+        try {
+            this->disable_remote ();
+        } catch ( PSUError &error ) {
+            fprintf ( stderr, "Failed to release remote control: %s\n", error.what () );
+        }
     }
 }
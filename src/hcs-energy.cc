@@ -0,0 +1,169 @@
+/**
+ *    This file is part of HCS.
+ *    Written by Qball Cow <qball@gmpclient.org> 2013-2015
+ *
+ *    HCS is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 2 of the License.
+ *
+ *    HCS is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with HCS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <iostream>
+#include <exception>
+#include <functional>
+#include <map>
+#include <string>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <termios.h>
+#include <hcs.h>
+#include <hcs-cache.h>
+#include <hcs-energy.h>
+
+#include <config.h>
+
+// Time between checkpoints (in ns).
+#define ENERGY_CHECKPOINT_INTERVAL    1000000000LL
+
+/**
+ * @returns the checkpoint of the power supply: $HCS_ENERGY_FILE or a cache entry named after its
+ *          type and serial number, or device node when it has no serial number.
+ */
+static DeviceCache energy_checkpoint ( PSU *psu ) throw ( PSUError & )
+{
+    const char *file = getenv ( "HCS_ENERGY_FILE" );
+    if ( file != nullptr && file[0] != '\0' ) {
+        return DeviceCache::from_file ( file );
+    }
+    PSU::Identity identity;
+    psu->get_identity ( identity );
+    return DeviceCache ( "energy-" + identity.type + "-" +
+                         ( identity.serial.empty () ? psu->get_device_node () : identity.serial ) );
+}
+
+Energy::Energy( PSU *psu ) throw ( PSUError & ) : psu ( psu ), checkpoint ( energy_checkpoint ( psu ) )
+{
+    if ( checkpoint.load () ) {
+        base.energy  = checkpoint.get_double ( "energy_wh" ) * 3600.0;
+        base.charge  = checkpoint.get_double ( "charge_ah" ) * 3600.0;
+        base.time    = checkpoint.get_double ( "seconds" );
+        base.samples = checkpoint.get_double ( "samples" );
+    }
+}
+
+void Energy::store () throw ( PSUError & )
+{
+    checkpoint.set ( "energy_wh", ( base.energy + added.energy ) / 3600.0 );
+    checkpoint.set ( "charge_ah", ( base.charge + added.charge ) / 3600.0 );
+    checkpoint.set ( "seconds", base.time + added.time );
+    checkpoint.set ( "samples", base.samples + added.samples );
+    if ( !checkpoint.store () ) {
+        throw PSUError ( "Failed to write the checkpoint \"" + checkpoint.get_path () + "\": '" + strerror ( errno ) + "'" );
+    }
+}
+
+void Energy::reset () throw ( PSUError & )
+{
+    base         = Totals ();
+    added        = Totals ();
+    max_interval = 0;
+    store ();
+}
+
+void Energy::run ( int64_t duration, FILE *out ) throw ( PSUError & )
+{
+    StopGuard guard;
+
+    if ( out != nullptr ) {
+        fprintf ( out, "time,voltage,current,power,energy_wh,charge_ah\n" );
+    }
+    // Fold in a previous run.
+    base.energy  += added.energy;
+    base.charge  += added.charge;
+    base.time    += added.time;
+    base.samples += added.samples;
+    added         = Totals ();
+    max_interval  = 0;
+    PSU::Snapshot snapshot;
+    double        power_prev   = 0.0;
+    double        current_prev = 0.0;
+    int64_t       time_prev    = 0;
+    int64_t       start        = hcs_monotonic_ns ();
+    int64_t       next         = start + ENERGY_CHECKPOINT_INTERVAL;
+    try {
+        while ( !hcs_stopped () ) {
+            int64_t before = hcs_monotonic_ns ();
+            psu->read_snapshot ( snapshot, PSU::SNAPSHOT_VOLTAGE_ACTUAL | PSU::SNAPSHOT_CURRENT_ACTUAL );
+            int64_t after   = hcs_monotonic_ns ();
+            int64_t time    = before + ( after - before ) / 2;
+            double  current = snapshot.current_actual;
+            double  power   = snapshot.voltage_actual * current;
+            if ( added.samples > 0 ) {
+                double interval = ( time - time_prev ) / 1e9;
+                added.energy += 0.5 * ( power + power_prev ) * interval;
+                added.charge += 0.5 * ( current + current_prev ) * interval;
+                added.time   += interval;
+                if ( time - time_prev > max_interval ) {
+                    max_interval = time - time_prev;
+                }
+            }
+            added.samples++;
+            power_prev   = power;
+            current_prev = current;
+            time_prev    = time;
+
+            bool last = duration > 0 && after - start >= duration;
+            if ( after >= next || last ) {
+                store ();
+                next += ENERGY_CHECKPOINT_INTERVAL;
+                if ( out != nullptr ) {
+                    fprintf ( out, "%.3f,%.3f,%.3f,%.3f,%.6f,%.6f\n", ( after - start ) / 1e9, snapshot.voltage_actual,
+                              current, power, ( base.energy + added.energy ) / 3600.0, ( base.charge + added.charge ) / 3600.0 );
+                    fflush ( out );
+                }
+            }
+            if ( last ) {
+                break;
+            }
+        }
+    } catch ( PSUError &error ) {
+        store ();
+        throw;
+    }
+    store ();
+}
+
+void Energy::print_totals ( FILE *out ) const
+{
+    double energy = base.energy + added.energy;
+    double time   = base.time + added.time;
+    fprintf ( out, "Energy (Wh):      %20.06f\n", energy / 3600.0 );
+    fprintf ( out, "Charge (Ah):      %20.06f\n", ( base.charge + added.charge ) / 3600.0 );
+    fprintf ( out, "Time (s):         %20.03f\n", time );
+    if ( time > 0.0 ) {
+        fprintf ( out, "Mean power (W):   %20.03f\n", energy / time );
+    }
+    fprintf ( out, "Samples:          %20llu\n", (unsigned long long) ( base.samples + added.samples ) );
+    fprintf ( out, "Checkpoint:       %s\n", checkpoint.get_path ().c_str () );
+}
+
+void Energy::print_report ( FILE *out ) const
+{
+    fprintf ( out, "Samples:          %20llu\n", (unsigned long long) added.samples );
+    if ( added.samples > 1 && added.time > 0.0 ) {
+        fprintf ( out, "Sample rate (Hz): %20.02f\n", ( added.samples - 1 ) / added.time );
+        fprintf ( out, "Max interval (ms):%20.03f\n", max_interval / 1e6 );
+    }
+    fprintf ( out, "Energy run (Wh):  %20.06f\n", added.energy / 3600.0 );
+    fprintf ( out, "Charge run (Ah):  %20.06f\n", added.charge / 3600.0 );
+    print_totals ( out );
+}
@@ -0,0 +1,354 @@
+/**
+ *    This file is part of HCS.
+ *    Written by Qball Cow <qball@gmpclient.org> 2013-2015
+ *
+ *    HCS is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 2 of the License.
+ *
+ *    HCS is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with HCS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <iostream>
+#include <exception>
+#include <functional>
+#include <map>
+#include <vector>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <hcs.h>
+#include <hcs-metrics.h>
+
+#include <config.h>
+
+// Time a client gets to send its request (in ms).
+#define METRICS_REQUEST_TIMEOUT    1000
+
+/**
+ * @returns value escaped for use as a label value.
+ */
+static std::string metrics_escape ( const std::string &value )
+{
+    std::string escaped;
+    for ( char c : value ) {
+        if ( c == '\\' || c == '"' ) {
+            escaped.push_back ( '\\' );
+            escaped.push_back ( c );
+        }
+        else if ( c == '\n' ) {
+            escaped += "\\n";
+        }
+        else {
+            escaped.push_back ( c );
+        }
+    }
+    return escaped;
+}
+
+static void metrics_family ( std::string &out, const char *name, const char *type, const char *help )
+{
+    out += std::string ( "# HELP " ) + name + " " + help + "\n";
+    out += std::string ( "# TYPE " ) + name + " " + type + "\n";
+}
+
+static void metrics_sample ( std::string &out, const char *name, const std::string &labels, double value,
+                             const char *format = "%.17g" )
+{
+    char buffer[32];
+    snprintf ( buffer, sizeof ( buffer ), format, value );
+    out += std::string ( name ) + "{" + labels + "} " + buffer + "\n";
+}
+
+// Counters are written as integers, so they keep every digit however large they get.
+static void metrics_count ( std::string &out, const char *name, const std::string &labels, unsigned long value )
+{
+    out += std::string ( name ) + "{" + labels + "} " + std::to_string ( value ) + "\n";
+}
+
+Metrics::Metrics( const std::string &target ) throw ( PSUError & ) : target ( target )
+{
+    char          *p;
+    unsigned long port = strtoul ( target.c_str (), &p, 10 );
+    if ( p == target.c_str () || *p != '\0' ) {
+        // A file, written on update ().
+        return;
+    }
+    if ( port == 0 || port > 65535 ) {
+        throw PSUError ( "Invalid port: " + target );
+    }
+    sock = socket ( AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+    if ( sock < 0 ) {
+        throw PSUError ( std::string ( "Failed to create socket: " ) + strerror ( errno ) );
+    }
+    int on = 1;
+    setsockopt ( sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof ( on ) );
+    struct sockaddr_in addr;
+    memset ( &addr, 0, sizeof ( addr ) );
+    addr.sin_family      = AF_INET;
+    addr.sin_port        = htons ( port );
+    addr.sin_addr.s_addr = htonl ( INADDR_LOOPBACK );
+    if ( bind ( sock, (struct sockaddr *) &addr, sizeof ( addr ) ) < 0 || ::listen ( sock, 8 ) < 0 ||
+         pipe2 ( wake, O_CLOEXEC ) < 0 ) {
+        std::string error = strerror ( errno );
+        close ( sock );
+        throw PSUError ( "Failed to serve metrics on 127.0.0.1:" + target + ": " + error );
+    }
+    // Signals are for the main thread, keep them away from the server.
+    sigset_t all, old;
+    sigfillset ( &all );
+    pthread_sigmask ( SIG_SETMASK, &all, &old );
+    server = std::thread ( &Metrics::serve, this );
+    pthread_sigmask ( SIG_SETMASK, &old, NULL );
+}
+
+Metrics::~Metrics()
+{
+    if ( sock < 0 ) {
+        return;
+    }
+    char c = 0;
+    if ( write ( wake[1], &c, 1 ) == 1 ) {
+        server.join ();
+    }
+    else {
+        server.detach ();
+    }
+    close ( wake[0] );
+    close ( wake[1] );
+    close ( sock );
+}
+
+void Metrics::set_devices ( const std::vector<PSU *> &psus )
+{
+    this->psus = psus;
+}
+
+void Metrics::update ( bool force )
+{
+    int64_t now = hcs_monotonic_ns ();
+    if ( !force && now - last_update < refresh_interval ) {
+        return;
+    }
+    last_update = now;
+    std::string text = render ();
+    if ( sock >= 0 ) {
+        std::lock_guard<std::mutex> guard ( lock );
+        page.swap ( text );
+        return;
+    }
+    // Replace the file in one go, a collector never reads half a page.
+    std::string tmp = target + "." + std::to_string ( getpid () );
+    FILE        *fp = fopen ( tmp.c_str (), "w" );
+    if ( fp == nullptr ) {
+        return;
+    }
+    fwrite ( text.data (), 1, text.size (), fp );
+    if ( fclose ( fp ) != 0 || rename ( tmp.c_str (), target.c_str () ) < 0 ) {
+        unlink ( tmp.c_str () );
+    }
+}
+
+std::string Metrics::render () const
+{
+    static const struct
+    {
+        const char   *name;
+        const char   *help;
+        unsigned int field;
+        float PSU::Snapshot::*value;
+    } gauges[] = {
+        { "hcs_voltage_volts",                    "Actual output voltage.",          PSU::SNAPSHOT_VOLTAGE_ACTUAL, &PSU::Snapshot::voltage_actual },
+        { "hcs_current_amperes",                  "Actual output current.",          PSU::SNAPSHOT_CURRENT_ACTUAL, &PSU::Snapshot::current_actual },
+        { "hcs_voltage_setpoint_volts",           "Set output voltage.",             PSU::SNAPSHOT_VOLTAGE,        &PSU::Snapshot::voltage        },
+        { "hcs_current_limit_amperes",            "Set output current limit.",       PSU::SNAPSHOT_CURRENT,        &PSU::Snapshot::current        },
+        { "hcs_over_voltage_protection_volts",    "Over voltage protection level.",  PSU::SNAPSHOT_OVER_VOLTAGE,   &PSU::Snapshot::over_voltage   },
+        { "hcs_over_current_protection_amperes",  "Over current protection level.",  PSU::SNAPSHOT_OVER_CURRENT,   &PSU::Snapshot::over_current   },
+    };
+    static const struct
+    {
+        const char    *name;
+        const char    *help;
+        unsigned long PSU::Stats::*value;
+    } counters[] = {
+        { "hcs_transactions_total",  "Completed request/reply exchanges.",       &PSU::Stats::transactions  },
+        { "hcs_failed_total",        "Requests that failed.",                    &PSU::Stats::failed        },
+        { "hcs_timeouts_total",      "Replies not received in time.",            &PSU::Stats::timeouts      },
+        { "hcs_crc_errors_total",    "Replies that failed their checksum.",      &PSU::Stats::crc_errors    },
+        { "hcs_retries_total",       "Requests written again.",                  &PSU::Stats::retries       },
+        { "hcs_resyncs_total",       "Times the input was dropped to resync.",   &PSU::Stats::resyncs       },
+        { "hcs_bytes_written_total", "Bytes written to the device.",             &PSU::Stats::bytes_written },
+        { "hcs_bytes_read_total",    "Bytes read from the device.",              &PSU::Stats::bytes_read    },
+    };
+    static const char *modes[] = { "off", "cv", "cc" };
+
+    std::vector<std::string>   labels;
+    std::vector<PSU::Identity> identities;
+    for ( auto psu : psus ) {
+        PSU::Identity identity;
+        try {
+            psu->get_identity ( identity );
+        } catch ( PSUError &error ) {
+        }
+        labels.push_back ( "device=\"" + metrics_escape ( psu->get_device_node () ) + "\",type=\"" +
+                           metrics_escape ( identity.type ) + "\",serial=\"" + metrics_escape ( identity.serial ) + "\"" );
+        identities.push_back ( identity );
+    }
+
+    std::string out;
+    int64_t     now = hcs_monotonic_ns ();
+    metrics_family ( out, "hcs_device_info", "gauge", "Identity of the power supply." );
+    for ( size_t i = 0; i < psus.size (); i++ ) {
+        metrics_count ( out, "hcs_device_info", labels[i] + ",manufacturer=\"" + metrics_escape ( identities[i].manufacturer ) +
+                        "\",article=\"" + metrics_escape ( identities[i].article ) + "\",software=\"" +
+                        metrics_escape ( identities[i].software ) + "\"", 1 );
+    }
+    for ( auto &gauge : gauges ) {
+        metrics_family ( out, gauge.name, "gauge", gauge.help );
+        for ( size_t i = 0; i < psus.size (); i++ ) {
+            const PSU::Snapshot &snapshot = psus[i]->get_last_snapshot ();
+            if ( snapshot.fields & gauge.field ) {
+                metrics_sample ( out, gauge.name, labels[i], snapshot.*gauge.value );
+            }
+        }
+    }
+    metrics_family ( out, "hcs_power_watts", "gauge", "Actual output power." );
+    for ( size_t i = 0; i < psus.size (); i++ ) {
+        const PSU::Snapshot &snapshot = psus[i]->get_last_snapshot ();
+        unsigned int        needed    = PSU::SNAPSHOT_VOLTAGE_ACTUAL | PSU::SNAPSHOT_CURRENT_ACTUAL;
+        if ( ( snapshot.fields & needed ) == needed ) {
+            metrics_sample ( out, "hcs_power_watts", labels[i], snapshot.voltage_actual * snapshot.current_actual );
+        }
+    }
+    metrics_family ( out, "hcs_mode", "gauge", "Operating mode, 1 for the current one." );
+    for ( size_t i = 0; i < psus.size (); i++ ) {
+        const PSU::Snapshot &snapshot = psus[i]->get_last_snapshot ();
+        if ( snapshot.fields & PSU::SNAPSHOT_MODE ) {
+            for ( unsigned int mode = 0; mode < 3; mode++ ) {
+                metrics_count ( out, "hcs_mode", labels[i] + ",mode=\"" + modes[mode] + "\"",
+                                static_cast<unsigned int>( snapshot.mode ) == mode );
+            }
+        }
+    }
+    // As a wall clock time, so it stays right however long the page is served.
+    struct timespec wall;
+    clock_gettime ( CLOCK_REALTIME, &wall );
+    double wall_now = wall.tv_sec + wall.tv_nsec / 1e9;
+    metrics_family ( out, "hcs_snapshot_timestamp_seconds", "gauge", "Unix time the values above were last read." );
+    for ( size_t i = 0; i < psus.size (); i++ ) {
+        if ( psus[i]->get_last_snapshot_time () > 0 ) {
+            metrics_sample ( out, "hcs_snapshot_timestamp_seconds", labels[i],
+                             wall_now - ( now - psus[i]->get_last_snapshot_time () ) / 1e9, "%.3f" );
+        }
+    }
+    for ( auto &counter : counters ) {
+        metrics_family ( out, counter.name, "counter", counter.help );
+        for ( size_t i = 0; i < psus.size (); i++ ) {
+            metrics_count ( out, counter.name, labels[i], psus[i]->get_stats ().*counter.value );
+        }
+    }
+    metrics_family ( out, "hcs_device_errors_total", "counter", "Errors reported by the device, by code." );
+    for ( size_t i = 0; i < psus.size (); i++ ) {
+        for ( auto &error : psus[i]->get_stats ().device_errors ) {
+            metrics_count ( out, "hcs_device_errors_total", labels[i] + ",code=\"" + std::to_string ( error.first ) + "\"",
+                            error.second );
+        }
+    }
+    metrics_family ( out, "hcs_io_wait_seconds_total", "counter", "Time spent waiting on the device." );
+    for ( size_t i = 0; i < psus.size (); i++ ) {
+        metrics_sample ( out, "hcs_io_wait_seconds_total", labels[i], psus[i]->get_stats ().io_wait / 1e9 );
+    }
+    return out;
+}
+
+void Metrics::serve ()
+{
+    while ( true ) {
+        struct pollfd fds[2] = {
+            { sock,    POLLIN, 0 },
+            { wake[0], POLLIN, 0 }
+        };
+        if ( poll ( fds, 2, -1 ) < 0 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            return;
+        }
+        if ( fds[1].revents ) {
+            return;
+        }
+        if ( fds[0].revents & POLLIN ) {
+            int client = accept4 ( sock, NULL, NULL, SOCK_CLOEXEC );
+            if ( client >= 0 ) {
+                handle ( client );
+                close ( client );
+            }
+        }
+    }
+}
+
+void Metrics::handle ( int client )
+{
+    // Only the request line matters, read up to the end of the headers.
+    char   request[2048];
+    size_t size = 0;
+    while ( size < sizeof ( request ) - 1 ) {
+        struct pollfd fd = { client, POLLIN, 0 };
+        if ( poll ( &fd, 1, METRICS_REQUEST_TIMEOUT ) <= 0 ) {
+            return;
+        }
+        ssize_t r = read ( client, &request[size], sizeof ( request ) - 1 - size );
+        if ( r <= 0 ) {
+            return;
+        }
+        size         += r;
+        request[size] = '\0';
+        if ( strstr ( request, "\r\n\r\n" ) != nullptr || strstr ( request, "\n\n" ) != nullptr ) {
+            break;
+        }
+    }
+    std::string reply;
+    if ( strncmp ( request, "GET /metrics ", 13 ) == 0 || strncmp ( request, "GET / ", 6 ) == 0 ) {
+        std::string body;
+        {
+            std::lock_guard<std::mutex> guard ( lock );
+            body = page;
+        }
+        reply = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+                std::to_string ( body.size () ) + "\r\nConnection: close\r\n\r\n" + body;
+    }
+    else {
+        reply = "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+    }
+    const char *p = reply.data ();
+    size_t     left = reply.size ();
+    while ( left > 0 ) {
+        ssize_t r = send ( client, p, left, MSG_NOSIGNAL );
+        if ( r < 0 && errno == EINTR ) {
+            continue;
+        }
+        if ( r <= 0 ) {
+            return;
+        }
+        p    += r;
+        left -= r;
+    }
+}
@@ -0,0 +1,185 @@
+/**
+ *    This file is part of HCS.
+ *    Written by Qball Cow <qball@gmpclient.org> 2013-2015
+ *
+ *    HCS is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 2 of the License.
+ *
+ *    HCS is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with HCS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <iostream>
+#include <exception>
+#include <functional>
+#include <map>
+#include <vector>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <termios.h>
+#include <hcs.h>
+#include <hcs-monitor.h>
+#include <hcs-capture.h>
+#include <hcs-metrics.h>
+
+#include <config.h>
+
+Monitor::Monitor( PSU *psu, FILE *out, Format format ) : psu ( psu ), out ( out ), format ( format )
+{
+}
+Monitor::Monitor( PSU *psu, CaptureWriter *capture ) : psu ( psu ), out ( nullptr ), format ( Format::CAPTURE ),
+    capture ( capture )
+{
+}
+
+bool Monitor::parse_format ( const char *name, Format &format )
+{
+    if ( strcasecmp ( name, "csv" ) == 0 ) {
+        format = Format::CSV;
+        return true;
+    }
+    if ( strcasecmp ( name, "ndjson" ) == 0 || strcasecmp ( name, "json" ) == 0 ) {
+        format = Format::NDJSON;
+        return true;
+    }
+    if ( strcasecmp ( name, "capture" ) == 0 ) {
+        format = Format::CAPTURE;
+        return true;
+    }
+    return false;
+}
+
+void Monitor::write_header ()
+{
+    if ( format == Format::CSV ) {
+        fprintf ( out, "time,voltage,current,power,mode\n" );
+    }
+}
+
+void Monitor::write_sample ( int64_t timestamp, const PSU::Snapshot &snapshot )
+{
+    const char *mode = psu->get_mode_str ( snapshot.mode );
+    float      power = snapshot.voltage_actual * snapshot.current_actual;
+    switch ( format )
+    {
+    case Format::CSV:
+        fprintf ( out, "%lld.%09lld,%.3f,%.3f,%.3f,%s\n",
+                  (long long) ( timestamp / 1000000000LL ), (long long) ( timestamp % 1000000000LL ),
+                  snapshot.voltage_actual, snapshot.current_actual, power, mode );
+        break;
+    case Format::NDJSON:
+        fprintf ( out, "{\"time\":%lld.%09lld,\"voltage\":%.3f,\"current\":%.3f,\"power\":%.3f,\"mode\":\"%s\"}\n",
+                  (long long) ( timestamp / 1000000000LL ), (long long) ( timestamp % 1000000000LL ),
+                  snapshot.voltage_actual, snapshot.current_actual, power, mode );
+        break;
+    case Format::CAPTURE:
+        capture->append ( timestamp, snapshot );
+        break;
+    }
+}
+
+void Monitor::add_statistics ( int64_t timestamp, int64_t lateness )
+{
+    if ( samples == 0 ) {
+        first = timestamp;
+    }
+    else {
+        int64_t dt    = timestamp - last;
+        double  delta = dt - dt_mean;
+        dt_mean += delta / samples;
+        dt_m2   += delta * ( dt - dt_mean );
+        if ( samples == 1 || dt < dt_min ) {
+            dt_min = dt;
+        }
+        if ( dt > dt_max ) {
+            dt_max = dt;
+        }
+    }
+    late_sum += lateness;
+    if ( lateness > late_max ) {
+        late_max = lateness;
+    }
+    last = timestamp;
+    samples++;
+}
+
+void Monitor::run ( int64_t interval, unsigned long count ) throw ( PSUError & )
+{
+    this->interval = interval;
+    samples        = missed = 0;
+    dt_mean        = dt_m2 = late_sum = 0.0;
+    dt_min         = dt_max = late_max = 0;
+
+    if ( metrics != nullptr ) {
+        PSU::Snapshot snapshot;
+        psu->read_snapshot ( snapshot );
+        metrics->update ( true );
+    }
+
+    StopGuard guard;
+
+    write_header ();
+    Ticker ticker ( interval );
+    try {
+        while ( ( count == 0 || samples < count ) && ticker.wait ( psu ) ) {
+            PSU::Snapshot snapshot;
+            int64_t       request = hcs_monotonic_ns ();
+            psu->read_snapshot ( snapshot, PSU::SNAPSHOT_VOLTAGE_ACTUAL | PSU::SNAPSHOT_CURRENT_ACTUAL | PSU::SNAPSHOT_MODE );
+            int64_t       reply = hcs_monotonic_ns ();
+            // The device sampled somewhere between request and reply, take the middle.
+            int64_t       timestamp = request + ( reply - request ) / 2;
+            write_sample ( timestamp, snapshot );
+            add_statistics ( timestamp, ticker.get_lateness () );
+            missed = ticker.get_missed ();
+            if ( metrics != nullptr ) {
+                metrics->update ();
+            }
+        }
+    } catch ( PSUError &error ) {
+        flush ();
+        throw;
+    }
+    flush ();
+}
+
+void Monitor::flush ()
+{
+    if ( capture != nullptr ) {
+        capture->flush ();
+    }
+    else {
+        fflush ( out );
+    }
+}
+
+void Monitor::print_report ( FILE *out ) const
+{
+    double duration = ( last - first ) / 1e9;
+    fprintf ( out, "Samples:          %20lu\n", samples );
+    if ( samples < 2 ) {
+        return;
+    }
+    double stddev = sqrt ( dt_m2 / ( samples - 1 ) );
+    fprintf ( out, "Duration (s):     %20.03f\n", duration );
+    fprintf ( out, "Rate (Hz):        %20.02f\n", ( samples - 1 ) / duration );
+    fprintf ( out, "Interval (ms):    %20.03f\n", dt_mean / 1e6 );
+    fprintf ( out, "Interval min (ms):%20.03f\n", dt_min / 1e6 );
+    fprintf ( out, "Interval max (ms):%20.03f\n", dt_max / 1e6 );
+    fprintf ( out, "Jitter rms (ms):  %20.03f\n", stddev / 1e6 );
+    if ( interval > 0 ) {
+        fprintf ( out, "Late mean (ms):   %20.03f\n", late_sum / samples / 1e6 );
+        fprintf ( out, "Late max (ms):    %20.03f\n", late_max / 1e6 );
+        fprintf ( out, "Missed ticks:     %20lu\n", missed );
+    }
+}
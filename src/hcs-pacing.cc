@@ -0,0 +1,190 @@
+/**
+ *    This file is part of HCS.
+ *    Written by Qball Cow <qball@gmpclient.org> 2013-2015
+ *
+ *    HCS is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 2 of the License.
+ *
+ *    HCS is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with HCS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <string>
+#include <map>
+#include <sstream>
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+#include <hcs-cache.h>
+#include <hcs-pacing.h>
+
+#include <config.h>
+
+// Samples needed for a percentile of the window.
+#define PACING_MIN_SAMPLES    8
+// Samples needed before the window is trusted over the learned or default timeout.
+#define PACING_TRUST_SAMPLES  32
+// Timeout: twice the 99th percentile plus this margin (in ns), at least the default timeout
+// divided by PACING_TIMEOUT_FLOOR so a single slow reply does not resync the pipeline.
+#define PACING_MARGIN         10000000LL
+#define PACING_TIMEOUT_FLOOR  10
+// First gap on an error, and the most it grows to (in ns).
+#define PACING_GAP_MIN        1000000LL
+#define PACING_GAP_MAX        50000000LL
+// Relative change of a learned percentile before the profile is rewritten.
+#define PACING_STORE_BAND     0.05
+
+Pacing::Pacing( size_t max_depth, int64_t default_timeout ) :
+    max_depth ( max_depth ), depth ( max_depth ), default_timeout ( default_timeout )
+{
+}
+
+void Pacing::set_max_depth ( size_t depth )
+{
+    max_depth   = std::max ( depth, (size_t) 1 );
+    this->depth = std::min ( this->depth, max_depth );
+}
+
+void Pacing::set_default_timeout ( int64_t timeout )
+{
+    default_timeout = timeout;
+}
+
+void Pacing::add_sample ( int type, int64_t latency )
+{
+    Window &window = windows[type];
+    window.samples[window.next] = latency;
+    window.next                 = ( window.next + 1 ) % window_size;
+    window.count                = std::min ( window.count + 1, window_size );
+    // Undo the back off: the gap shrinks with every good reply, so a rare error costs little.
+    // Once it is gone the pipeline opens one step per recover_after good replies.
+    gap -= gap / 8;
+    if ( gap < PACING_GAP_MIN / 2 ) {
+        gap = 0;
+    }
+    if ( gap > 0 || ++successes < recover_after ) {
+        return;
+    }
+    successes = 0;
+    if ( depth < max_depth ) {
+        depth++;
+    }
+}
+
+void Pacing::backoff ()
+{
+    successes = 0;
+    depth     = std::max ( depth / 2, (size_t) 1 );
+    gap       = gap == 0 ? PACING_GAP_MIN : std::min<int64_t> ( gap * 2, PACING_GAP_MAX );
+}
+
+int64_t Pacing::percentile ( const Window &window, double percentile )
+{
+    if ( window.count < PACING_MIN_SAMPLES ) {
+        return 0;
+    }
+    int64_t sorted[window_size];
+    std::copy ( window.samples, window.samples + window.count, sorted );
+    size_t  index = std::min ( (size_t) ( window.count * percentile / 100.0 ), window.count - 1 );
+    std::nth_element ( sorted, sorted + index, sorted + window.count );
+    return sorted[index];
+}
+
+int64_t Pacing::estimate ( const Window &window )
+{
+    if ( window.count == 0 ) {
+        return window.learned;
+    }
+    // Too few samples for a percentile, the slowest one is the best guess.
+    int64_t current = percentile ( window, 99 );
+    if ( current == 0 ) {
+        current = *std::max_element ( window.samples, window.samples + window.count );
+    }
+    if ( window.learned == 0 ) {
+        return current;
+    }
+    // Moving average: a short session moves the profile a little, a full window mostly replaces it.
+    return window.learned + ( current - window.learned ) * (int64_t) window.count /
+           (int64_t) ( window.count + PACING_MIN_SAMPLES );
+}
+
+int64_t Pacing::get_timeout ( int type ) const
+{
+    auto window = windows.find ( type );
+    if ( window == windows.end () ) {
+        return default_timeout;
+    }
+    int64_t p99 = window->second.count >= PACING_TRUST_SAMPLES ? percentile ( window->second, 99 ) : 0;
+    if ( p99 == 0 ) {
+        p99 = window->second.learned;
+    }
+    if ( p99 == 0 ) {
+        return default_timeout;
+    }
+    int64_t timeout = std::max<int64_t> ( 2 * p99 + PACING_MARGIN, default_timeout / PACING_TIMEOUT_FLOOR );
+    return std::min<int64_t> ( timeout, default_timeout );
+}
+
+void Pacing::load ( const DeviceCache &cache )
+{
+    depth = std::min ( std::max ( (size_t) cache.get_double ( "depth", max_depth ), (size_t) 1 ), max_depth );
+    gap   = std::min<int64_t> ( cache.get_double ( "gap" ) * 1e6, PACING_GAP_MAX );
+    std::stringstream types ( cache.get ( "types" ) );
+    std::string       type;
+    while ( std::getline ( types, type, ',' ) ) {
+        double p99 = cache.get_double ( "p99_" + type );
+        if ( p99 > 0 ) {
+            windows[atoi ( type.c_str () )].learned = p99 * 1e6;
+        }
+    }
+}
+
+bool Pacing::store ( DeviceCache &cache ) const
+{
+    bool changed = false;
+    auto set     = [&cache, &changed] ( const std::string &key, const std::string &value ) {
+                       if ( cache.get ( key ) != value ) {
+                           cache.set ( key, value );
+                           changed = true;
+                       }
+                   };
+    char        buffer[64];
+    std::string types;
+    for ( auto &window : windows ) {
+        int64_t p99 = estimate ( window.second );
+        if ( p99 == 0 ) {
+            continue;
+        }
+        std::string type = std::to_string ( window.first );
+        types += ( types.empty () ? "" : "," ) + type;
+        // In ms, like the other times hcs shows. Drift within a few percent is noise, not worth a write.
+        double stored = cache.get_double ( "p99_" + type ) * 1e6;
+        if ( stored <= 0 || fabs ( p99 - stored ) > stored * PACING_STORE_BAND ) {
+            snprintf ( buffer, sizeof ( buffer ), "%.3f", p99 / 1e6 );
+            set ( "p99_" + type, buffer );
+        }
+    }
+    set ( "types", types );
+    set ( "depth", std::to_string ( depth ) );
+    snprintf ( buffer, sizeof ( buffer ), "%.3f", gap / 1e6 );
+    set ( "gap", buffer );
+    return changed;
+}
+
+void Pacing::print ( FILE *out ) const
+{
+    fprintf ( out, " Pipeline depth:   %20zu\n", depth );
+    fprintf ( out, " Write gap (ms):   %20.03f\n", gap / 1e6 );
+    for ( auto &window : windows ) {
+        fprintf ( out, " Type %-4d p50/p99/timeout (ms): %8.03f %8.03f %8.03f\n", window.first,
+                  percentile ( window.second, 50 ) / 1e6, percentile ( window.second, 99 ) / 1e6,
+                  get_timeout ( window.first ) / 1e6 );
+    }
+}
@@ -0,0 +1,175 @@
+/**
+ *    This file is part of HCS.
+ *    Written by Qball Cow <qball@gmpclient.org> 2013-2015
+ *
+ *    HCS is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 2 of the License.
+ *
+ *    HCS is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with HCS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <iostream>
+#include <exception>
+#include <functional>
+#include <map>
+#include <vector>
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <termios.h>
+#include <hcs.h>
+#include <hcs-power.h>
+
+#include <config.h>
+
+// Reads timed to measure the round trip before the loop starts.
+#define POWER_PROBE_READS    5
+// The power counts as settled within this fraction of the target.
+#define POWER_BAND           0.02
+
+ConstantPower::ConstantPower( PSU *psu ) : psu ( psu )
+{
+}
+
+void ConstantPower::run ( float watts, int64_t duration, float limit, FILE *out ) throw ( PSUError & )
+{
+    if ( !( watts > 0.0f ) ) {
+        throw PSUError ( "The power has to be above 0" );
+    }
+    PSU::Identity identity;
+    psu->get_identity ( identity );
+    if ( identity.nominal_power > 0.0f && watts > identity.nominal_power ) {
+        throw PSUError ( "The power is above the nominal power of the power supply" );
+    }
+    PSU::Snapshot snapshot;
+    psu->read_snapshot ( snapshot, PSU::SNAPSHOT_VOLTAGE | PSU::SNAPSHOT_OVER_VOLTAGE | PSU::SNAPSHOT_MODE );
+    if ( snapshot.mode == PSU::OperatingMode::OFF ) {
+        throw PSUError ( "The output is off" );
+    }
+    // Stay below the protection level and the rating, when known.
+    float known[2] = { snapshot.over_voltage, identity.nominal_voltage };
+    for ( float value : known ) {
+        if ( value > 0.0f && ( !( limit > 0.0f ) || value < limit ) ) {
+            limit = value;
+        }
+    }
+    if ( !( limit > 0.0f ) ) {
+        throw PSUError ( "The highest voltage of the power supply is not known, give a limit" );
+    }
+
+    const unsigned int fields = PSU::SNAPSHOT_VOLTAGE_ACTUAL | PSU::SNAPSHOT_CURRENT_ACTUAL | PSU::SNAPSHOT_MODE;
+    std::vector<int64_t> probe;
+    for ( int i = 0; i < POWER_PROBE_READS; i++ ) {
+        int64_t before = hcs_monotonic_ns ();
+        psu->read_snapshot ( snapshot, fields );
+        probe.push_back ( hcs_monotonic_ns () - before );
+    }
+    std::sort ( probe.begin (), probe.end () );
+    round_trip = probe[probe.size () / 2];
+    // SIMC tuning for a static plant behind a dead time: a write shows up in the read after it,
+    // a read and a write per iteration. The gains are per unit of slope, see below.
+    double dead_time = 2.0 * round_trip / 1e9;
+    kp = 0.5;
+    ki = kp / dead_time;
+
+    StopGuard guard;
+
+    target     = watts;
+    iterations = writes = settled = 0;
+    first      = last = settle = 0;
+    error_sum  = error_sq = 0.0;
+    if ( out != nullptr ) {
+        fprintf ( out, "iteration,time,voltage_set,voltage,current,power,error\n" );
+    }
+    float   voltage_set = snapshot.voltage;
+    double  error_prev  = NAN;
+    int64_t start       = hcs_monotonic_ns ();
+    int64_t prev        = start;
+    while ( !hcs_stopped () ) {
+        psu->read_snapshot ( snapshot, fields );
+        int64_t now = hcs_monotonic_ns ();
+        if ( duration > 0 && now - start >= duration ) {
+            break;
+        }
+        add ( now - start, voltage_set, snapshot.voltage_actual, snapshot.current_actual, out );
+
+        double error = target - snapshot.voltage_actual * snapshot.current_actual;
+        // Velocity form: the setpoint is the integrator, nothing to wind up.
+        double step  = kp * ( isnan ( error_prev ) ? 0.0 : error - error_prev ) + ki * ( ( now - prev ) / 1e9 ) * error;
+        error_prev = error;
+        prev       = now;
+        // In current limit a higher voltage does not give more power.
+        if ( snapshot.mode == PSU::OperatingMode::CC && step > 0.0 ) {
+            continue;
+        }
+        // Slope of power against voltage, 2I for a resistive load. Without current flowing
+        // assume the load takes the target power at the highest voltage.
+        double slope   = std::max ( 2.0 * snapshot.current_actual, (double) target / limit );
+        float  voltage = std::min ( std::max ( voltage_set + (float) ( step / slope ), 0.0f ), limit );
+        if ( fabs ( voltage - voltage_set ) >= identity.voltage_resolution ) {
+            psu->set_voltage ( voltage );
+            voltage_set = voltage;
+            writes++;
+        }
+    }
+}
+
+void ConstantPower::add ( int64_t time, float voltage_set, float voltage, float current, FILE *out )
+{
+    double power = voltage * current;
+    double error = target - power;
+    if ( out != nullptr ) {
+        // Flushed every line, so a killed loop leaves everything up to its last iteration.
+        fprintf ( out, "%lu,%.6f,%.3f,%.3f,%.3f,%.3f,%.3f\n", iterations, time / 1e9, voltage_set,
+                  voltage, current, power, error );
+        fflush ( out );
+    }
+    if ( iterations == 0 ) {
+        first = time;
+    }
+    last = time;
+    iterations++;
+    if ( fabs ( error ) > POWER_BAND * target ) {
+        settled   = 0;
+        error_sum = error_sq = 0.0;
+        return;
+    }
+    if ( settled == 0 ) {
+        settle = time;
+    }
+    settled++;
+    error_sum += error;
+    error_sq  += error * error;
+}
+
+void ConstantPower::print_report ( FILE *out ) const
+{
+    fprintf ( out, "Iterations:       %20lu\n", iterations );
+    fprintf ( out, "Writes:           %20lu\n", writes );
+    fprintf ( out, "Round trip (ms):  %20.03f\n", round_trip / 1e6 );
+    fprintf ( out, "Kp (per slope):   %20.03f\n", kp );
+    fprintf ( out, "Ki (per slope/s): %20.03f\n", ki );
+    if ( iterations < 2 ) {
+        return;
+    }
+    double duration = ( last - first ) / 1e9;
+    fprintf ( out, "Duration (s):     %20.03f\n", duration );
+    fprintf ( out, "Loop rate (Hz):   %20.02f\n", ( iterations - 1 ) / duration );
+    if ( settled == 0 ) {
+        fprintf ( out, "Settling time:    %20s\n", "not settled" );
+        return;
+    }
+    fprintf ( out, "Settling (ms):    %20.03f\n", settle / 1e6 );
+    fprintf ( out, "Error mean (W):   %20.04f\n", error_sum / settled );
+    fprintf ( out, "Error rms (W):    %20.04f\n", sqrt ( error_sq / settled ) );
+    fprintf ( out, "Error rms (%%):    %20.03f\n", 100.0 * sqrt ( error_sq / settled ) / target );
+}
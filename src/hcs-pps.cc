@@ -22,7 +22,15 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <poll.h>
+#include <functional>
+#include <map>
+#include <vector>
+#include <algorithm>
 #include <hcs.h>
+#include <hcs-channel.h>
 #include <hcs-pps.h>
 
 #include <config.h>
@@ -39,42 +47,110 @@ bool PPS11360::check_supported_type ( const char *vendor_id, const char *product
 
 PPS11360::PPS11360() : PSU ( B9600 )
 {
+    const char *age = getenv ( "HCS_PPS_MAX_AGE" );
+    if ( age != nullptr ) {
+        // In milliseconds.
+        max_age = strtoll ( age, nullptr, 10 ) * 1000000LL;
+    }
 }
 /**
- * Private functions
+ * Reply framing
  */
-size_t PPS11360::read_cmd ( char *buffer, size_t max_length )
+size_t ReplyReader::find_frame ()
 {
-    size_t size = 0;
-
-    while ( size < 3 ||
-            !(
-                buffer[size - 3] == 'O' &&
-                buffer[size - 2] == 'K' &&
-                buffer[size - 1] == '\n'
-                )
-            ) {
-        ssize_t v = read ( fd, &buffer[size], max_length - size );
-        buffer[size + 1] = '\0';
-
-        if ( buffer[size] == '\r' ) {
-            buffer[size] = '\n';
+    // Only look at what came in since the last call.
+    for ( ; scan < tail; scan++ ) {
+        if ( scan - head >= 2 && at ( scan - 2 ) == 'O' && at ( scan - 1 ) == 'K' &&
+             ( at ( scan ) == '\r' || at ( scan ) == '\n' ) ) {
+            scan++;
+            return scan - head;
         }
+    }
+    return 0;
+}
 
-        if ( v > 0 ) {
-            size += v;
-
-            if ( size + 1 >= max_length ) {
-                return -1;
+ReplyReader::View ReplyReader::read ( int fd, int64_t deadline, PSU::Stats &stats ) throw ( PSUError & )
+{
+    first_byte = head < tail ? hcs_monotonic_ns () : 0;
+    size_t length;
+    while ( ( length = find_frame () ) == 0 ) {
+        if ( tail - head == ring_size ) {
+            reset ();
+            throw PSUError ( "Failed to read reply: no valid frame received" );
+        }
+        int64_t remaining = deadline - hcs_monotonic_ns ();
+        if ( remaining <= 0 ) {
+            stats.timeouts++;
+            // The rest of this reply could still come in, do not take it for the next one.
+            tcflush ( fd, TCIFLUSH );
+            reset ();
+            throw PSUError ( "Timeout waiting for reply" );
+        }
+        struct pollfd pfd    = { fd, POLLIN, 0 };
+        int64_t       before = hcs_monotonic_ns ();
+        // Round up, so we do not spin on the last partial millisecond.
+        int           rv     = poll ( &pfd, 1, ( remaining + 999999 ) / 1000000 );
+        stats.io_wait += hcs_monotonic_ns () - before;
+        if ( rv < 0 && errno != EINTR ) {
+            throw PSUError ( std::string ( "Failed to wait for reply: " ) + strerror ( errno ) );
+        }
+        if ( rv <= 0 ) {
+            continue;
+        }
+        // Read into the free space up to the end of the ring, the next read wraps.
+        size_t  offset = tail & ( ring_size - 1 );
+        size_t  space  = std::min ( ring_size - ( tail - head ), ring_size - offset );
+        ssize_t r      = ::read ( fd, &ring[offset], space );
+        if ( r < 0 ) {
+            if ( errno == EINTR || errno == EAGAIN ) {
+                continue;
             }
+            throw PSUError ( std::string ( "Failed to read reply: " ) + strerror ( errno ) );
+        }
+        if ( r == 0 ) {
+            throw PSUError ( "Failed to read reply: device closed" );
         }
-        else{
-            printf ( "%i\n", errno );
-            printf ( "%s\n", strerror ( errno ) );
-            return -1;
+        if ( first_byte == 0 ) {
+            first_byte = hcs_monotonic_ns ();
         }
+        tail += r;
+        stats.reads++;
+        stats.bytes_read += r;
+    }
+
+    View   view;
+    size_t offset = head & ( ring_size - 1 );
+    if ( offset + length <= ring_size ) {
+        view.data = &ring[offset];
     }
-    return size;
+    else {
+        size_t first = ring_size - offset;
+        memcpy ( frame, &ring[offset], first );
+        memcpy ( &frame[first], ring, length - first );
+        view.data = frame;
+    }
+    // Leave off the closing OK and line end.
+    view.size = length - 3;
+    head     += length;
+    return view;
+}
+
+/**
+ * Private functions
+ */
+ReplyReader::View PPS11360::read_cmd () throw ( PSUError & )
+{
+    ReplyReader::View reply;
+    try {
+        reply = reader.read ( fd, cmd_sent + reply_timeout, get_stats () );
+    } catch ( PSUError &error ) {
+        get_stats ().failed++;
+        throw;
+    }
+    int64_t now   = hcs_monotonic_ns ();
+    int64_t first = reader.get_first_byte ();
+    add_timing ( cmd_sent - cmd_start, first - cmd_sent, now - first );
+    return reply;
 }
 
 bool PPS11360::get_state () throw ( PSUError & )
@@ -84,39 +160,23 @@ bool PPS11360::get_state () throw ( PSUError & )
 
 void PPS11360::state_enable ( void ) throw ( PSUError & )
 {
-    char buffer[128];
+    invalidate ();
     this->send_cmd ( "SOUT", "0" );
-    this->read_cmd ( buffer, 128 );
+    this->read_cmd ();
 }
 void PPS11360::state_disable ( void ) throw ( PSUError & )
 {
-    char buffer[128];
+    invalidate ();
     this->send_cmd ( "SOUT", "1" );
-    this->read_cmd ( buffer, 128 );
+    this->read_cmd ();
 }
 float PPS11360::get_voltage_actual () throw( PSUError & )
 {
-    char buffer[1024];
-    // Send getd mesg.
-    this->send_cmd ( "GETD", NULL );
-    if ( this->read_cmd ( buffer, 1024 ) > 0 ) {
-        std::string b       = buffer;
-        float       voltage = strtol ( b.substr ( 0, 3 ).c_str (), 0, 10 ) / 10.0f;
-        return voltage;
-    }
-    throw PSUError ( "Invalid reply" );
+    return read_telemetry ( max_age ).voltage;
 }
 float PPS11360::get_current_actual () throw( PSUError & )
 {
-    char buffer[1024];
-    // Send getd mesg.
-    this->send_cmd ( "GETD", NULL );
-    if ( this->read_cmd ( buffer, 1024 ) > 0 ) {
-        std::string b       = buffer;
-        float       current = strtol ( b.substr ( 4, 7 ).c_str (), 0, 10 ) / 1000.0f;
-        return current;
-    }
-    throw PSUError ( "Invalid reply" );
+    return read_telemetry ( max_age ).current;
 }
 
 float PPS11360::get_over_voltage() throw ( PSUError & )
@@ -128,36 +188,67 @@ float PPS11360::get_over_current() throw ( PSUError & )
     return -1.0;
 }
 
+void PPS11360::get_identity ( Identity &identity ) throw ( PSUError & )
+{
+    // The device has no way to query these.
+    identity.manufacturer       = "Voltcraft";
+    identity.type               = "PPS-11360";
+    identity.voltage_resolution = 0.01f;
+    identity.current_resolution = 0.01f;
+}
 void PPS11360::print_device_info ( void ) throw ( PSUError & )
 {
     printf ( "\nDevice specifications:\n" );
     PSU::print_device_info ();
 }
 PSU::OperatingMode PPS11360::get_operating_mode () throw ( PSUError & )
-{    char buffer[1024];
-    // Send getd mesg.
-    this->send_cmd ( "GETD", NULL );
-    if ( this->read_cmd ( buffer, 1024 ) > 0 ) {
-        std::string b       = buffer;
-        int         limited = strtol ( b.substr ( 8, 8 ).c_str (), 0, 10 );
-        return (limited == 0) ? PSU::OperatingMode::CV: PSU::OperatingMode::CC;
+{
+    return read_telemetry ( max_age ).mode;
+}
+void PPS11360::read_snapshot ( Snapshot &snapshot, unsigned int fields ) throw ( PSUError & )
+{
+    // A snapshot is an explicit read, always ask the device.
+    if ( fields & ( SNAPSHOT_VOLTAGE | SNAPSHOT_CURRENT ) ) {
+        const Setpoints &set = read_setpoints ( 0 );
+        snapshot.voltage = set.voltage;
+        snapshot.current = set.current;
+        snapshot.fields |= SNAPSHOT_VOLTAGE | SNAPSHOT_CURRENT;
     }
-    return OperatingMode::CV;
+    if ( fields & ( SNAPSHOT_VOLTAGE_ACTUAL | SNAPSHOT_CURRENT_ACTUAL | SNAPSHOT_MODE ) ) {
+        const Telemetry &actual = read_telemetry ( 0 );
+        snapshot.voltage_actual = actual.voltage;
+        snapshot.current_actual = actual.current;
+        snapshot.mode           = actual.mode;
+        snapshot.voltage_actual_raw = actual.voltage_raw;
+        snapshot.current_actual_raw = actual.current_raw;
+        snapshot.fields        |= SNAPSHOT_VOLTAGE_ACTUAL | SNAPSHOT_CURRENT_ACTUAL | SNAPSHOT_MODE;
+    }
+    if ( fields & SNAPSHOT_OVER_VOLTAGE ) {
+        snapshot.over_voltage = get_over_voltage ();
+        snapshot.fields      |= SNAPSHOT_OVER_VOLTAGE;
+    }
+    if ( fields & SNAPSHOT_OVER_CURRENT ) {
+        snapshot.over_current = get_over_current ();
+        snapshot.fields      |= SNAPSHOT_OVER_CURRENT;
+    }
+    remember ( snapshot );
 }
 
 void PPS11360::set_voltage ( float value )  throw ( PSUError & )
 {
-    char buffer[1024];
-    snprintf ( buffer, 1024, "%03d", ( int ) ( value * 10 ) );
+    char buffer[16];
+    snprintf ( buffer, sizeof ( buffer ), "%03d", ( int ) ( value * 10 ) );
+    invalidate ();
     this->send_cmd ( "VOLT", buffer );
-    this->read_cmd ( buffer, 1024 );
+    this->read_cmd ();
 }
 void PPS11360::set_current ( float value )  throw ( PSUError & )
 {
-    char buffer[1024];
-    snprintf ( buffer, 1024, "%03d", ( int ) ( value * 100 ) );
+    char buffer[16];
+    snprintf ( buffer, sizeof ( buffer ), "%03d", ( int ) ( value * 100 ) );
+    invalidate ();
     this->send_cmd ( "CURR", buffer );
-    this->read_cmd ( buffer, 1024 );
+    this->read_cmd ();
 }
 float PPS11360::get_voltage () throw ( PSUError & )
 {
@@ -180,14 +271,172 @@ void PPS11360::uninitialize ()
 }
 void PPS11360::get_voltage_current ( float &voltage, float &current )
 {
-    char buffer[1024];
+    const Setpoints &set = read_setpoints ( max_age );
+    voltage = set.voltage;
+    current = set.current;
+}
+const PPS11360::Telemetry &PPS11360::read_telemetry ( int64_t max_age )
+{
+    int64_t now = hcs_monotonic_ns ();
+    if ( telemetry.timestamp != 0 && ( now - telemetry.timestamp ) < max_age ) {
+        return telemetry;
+    }
+    // One GETD reply holds actual voltage, current and the limiter state.
+    telemetry.timestamp = 0;
+    this->send_cmd ( "GETD", NULL );
+    ReplyReader::View reply = read_cmd ();
+    try {
+        decode_telemetry ( reply, telemetry );
+    } catch ( PSUError &error ) {
+        get_stats ().failed++;
+        throw;
+    }
+    return telemetry;
+}
+/**
+ * @returns true when reply has length digits at offset, their value is stored in value.
+ */
+static bool decode_digits ( const ReplyReader::View &reply, size_t offset, size_t length, int32_t &value )
+{
+    if ( offset + length > reply.size ) {
+        return false;
+    }
+    value = 0;
+    for ( size_t i = offset; i < offset + length; i++ ) {
+        if ( reply.data[i] < '0' || reply.data[i] > '9' ) {
+            return false;
+        }
+        value = value * 10 + ( reply.data[i] - '0' );
+    }
+    return true;
+}
+void PPS11360::decode_telemetry ( const ReplyReader::View &reply, Telemetry &telemetry ) const throw ( PSUError & )
+{
+    int32_t limited;
+    if ( !decode_digits ( reply, 0, 4, telemetry.voltage_raw ) ||
+         !decode_digits ( reply, 4, 4, telemetry.current_raw ) ||
+         !decode_digits ( reply, 8, 1, limited ) ) {
+        throw PSUError ( "Invalid GETD reply" );
+    }
+    telemetry.voltage   = telemetry.voltage_raw / 100.0f;
+    telemetry.current   = telemetry.current_raw / 100.0f;
+    telemetry.mode      = ( limited == 0 ) ? PSU::OperatingMode::CV : PSU::OperatingMode::CC;
+    telemetry.timestamp = hcs_monotonic_ns ();
+}
+const PPS11360::Setpoints &PPS11360::read_setpoints ( int64_t max_age )
+{
+    int64_t now = hcs_monotonic_ns ();
+    if ( setpoints.timestamp != 0 && ( now - setpoints.timestamp ) < max_age ) {
+        return setpoints;
+    }
+    setpoints.timestamp = 0;
     this->send_cmd ( "GETS", NULL );
-    voltage = current = -1.0;
+    ReplyReader::View reply = read_cmd ();
+    try {
+        decode_setpoints ( reply, setpoints );
+    } catch ( PSUError &error ) {
+        get_stats ().failed++;
+        throw;
+    }
+    return setpoints;
+}
+void PPS11360::decode_setpoints ( const ReplyReader::View &reply, Setpoints &setpoints ) const throw ( PSUError & )
+{
+    int32_t voltage, current;
+    if ( !decode_digits ( reply, 0, 3, voltage ) || !decode_digits ( reply, 3, 3, current ) ) {
+        throw PSUError ( "Invalid GETS reply" );
+    }
+    setpoints.voltage   = voltage / 10.0f;
+    setpoints.current   = current / 100.0f;
+    setpoints.timestamp = hcs_monotonic_ns ();
+}
 
-    if ( this->read_cmd ( buffer, 1024 ) > 5 ) {
-        std::string b = buffer;
-        voltage = strtol ( b.substr ( 0, 3 ).c_str (), 0, 10 ) / 10.0;
-        current = strtol ( b.substr ( 3, 6 ).c_str (), 0, 10 ) / 100.0;
+/**
+ * Asynchronous interface
+ */
+size_t PPS11360::reply_length ( const uint8_t *buffer, size_t size ) const
+{
+    // Every reply ends with OK and a line end.
+    for ( size_t i = 2; i < size; i++ ) {
+        if ( buffer[i - 2] == 'O' && buffer[i - 1] == 'K' && ( buffer[i] == '\r' || buffer[i] == '\n' ) ) {
+            return i + 1;
+        }
+    }
+    return 0;
+}
+void PPS11360::queue_cmd ( Channel &channel, const char *command, const char *arg,
+                           std::function<void(const ReplyReader::View &reply)> on_reply )
+{
+    Channel::Request request;
+    request.size = snprintf ( (char *) request.data, sizeof ( request.data ), "%s%s\r",
+                              command, ( arg != nullptr ) ? arg : "" );
+    // Queries, and the commands setting an absolute value: safe to send again.
+    request.idempotent = true;
+    request.on_reply   = [on_reply] ( const uint8_t *reply, size_t size ) {
+        if ( on_reply ) {
+            // reply_length () only hands out frames ending in OK and a line end.
+            ReplyReader::View view;
+            view.data = (const char *) reply;
+            view.size = size - 3;
+            on_reply ( view );
+        }
+    };
+    channel.submit ( std::move ( request ) );
+}
+void PPS11360::queue_operation ( Channel &channel, Operation op, float value,
+                                 Snapshot *snapshot, unsigned int fields ) throw ( PSUError & )
+{
+    char arg[16];
+    invalidate ();
+    switch ( op )
+    {
+    case Operation::SNAPSHOT:
+        if ( fields & ( SNAPSHOT_VOLTAGE | SNAPSHOT_CURRENT ) ) {
+            queue_cmd ( channel, "GETS", NULL, [this, snapshot] ( const ReplyReader::View &reply ) {
+                Setpoints set;
+                decode_setpoints ( reply, set );
+                snapshot->voltage = set.voltage;
+                snapshot->current = set.current;
+                snapshot->fields |= SNAPSHOT_VOLTAGE | SNAPSHOT_CURRENT;
+            } );
+        }
+        if ( fields & ( SNAPSHOT_VOLTAGE_ACTUAL | SNAPSHOT_CURRENT_ACTUAL | SNAPSHOT_MODE ) ) {
+            queue_cmd ( channel, "GETD", NULL, [this, snapshot] ( const ReplyReader::View &reply ) {
+                Telemetry actual;
+                decode_telemetry ( reply, actual );
+                snapshot->voltage_actual     = actual.voltage;
+                snapshot->current_actual     = actual.current;
+                snapshot->voltage_actual_raw = actual.voltage_raw;
+                snapshot->current_actual_raw = actual.current_raw;
+                snapshot->mode               = actual.mode;
+                snapshot->fields            |= SNAPSHOT_VOLTAGE_ACTUAL | SNAPSHOT_CURRENT_ACTUAL | SNAPSHOT_MODE;
+            } );
+        }
+        if ( fields & SNAPSHOT_OVER_VOLTAGE ) {
+            snapshot->over_voltage = get_over_voltage ();
+            snapshot->fields      |= SNAPSHOT_OVER_VOLTAGE;
+        }
+        if ( fields & SNAPSHOT_OVER_CURRENT ) {
+            snapshot->over_current = get_over_current ();
+            snapshot->fields      |= SNAPSHOT_OVER_CURRENT;
+        }
+        break;
+    case Operation::SET_VOLTAGE:
+        snprintf ( arg, sizeof ( arg ), "%03d", ( int ) ( value * 10 ) );
+        queue_cmd ( channel, "VOLT", arg, nullptr );
+        break;
+    case Operation::SET_CURRENT:
+        snprintf ( arg, sizeof ( arg ), "%03d", ( int ) ( value * 100 ) );
+        queue_cmd ( channel, "CURR", arg, nullptr );
+        break;
+    case Operation::STATE_ENABLE:
+        queue_cmd ( channel, "SOUT", "0", nullptr );
+        break;
+    case Operation::STATE_DISABLE:
+        queue_cmd ( channel, "SOUT", "1", nullptr );
+        break;
+    default:
+        throw PSUError ( "Current feature is not supported for this power supply" );
     }
 }
 
@@ -198,6 +447,9 @@ void PPS11360::send_cmd ( const char *command, const char *arg )
     if ( command == nullptr ) {
         return;
     }
+    cmd_start = hcs_monotonic_ns ();
+    // Whatever is left over is not the reply to this command.
+    reader.reset ();
 
     // Write command to str.
     ssize_t result = write ( fd, command, strlen ( command ) );
@@ -224,4 +476,6 @@ void PPS11360::send_cmd ( const char *command, const char *arg )
         ss << "Failed to send sufficient bytes: " << result << " out of 1";
         throw PSUError ( ss.str () );
     }
+    cmd_sent                    = hcs_monotonic_ns ();
+    get_stats ().bytes_written += strlen ( command ) + ( arg != nullptr ? strlen ( arg ) : 0 ) + 1;
 }
@@ -0,0 +1,148 @@
+/**
+ *    This file is part of HCS.
+ *    Written by Qball Cow <qball@gmpclient.org> 2013-2015
+ *
+ *    HCS is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 2 of the License.
+ *
+ *    HCS is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with HCS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <iostream>
+#include <exception>
+#include <functional>
+#include <map>
+#include <string>
+#include <atomic>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <termios.h>
+#include <hcs.h>
+#include <hcs-shm.h>
+#include <hcs-publish.h>
+
+#include <config.h>
+
+Publisher::Publisher( PSU *psu, const char *name ) throw ( PSUError & ) : psu ( psu )
+{
+    PSU::Identity identity;
+    psu->get_identity ( identity );
+    if ( name != nullptr ) {
+        this->name = name[0] == '/' ? name : std::string ( "/" ) + name;
+    }
+    else {
+        std::string id = identity.serial;
+        if ( id.empty () ) {
+            id = psu->get_device_node ();
+            id = id.substr ( id.rfind ( '/' ) + 1 );
+        }
+        for ( auto &c : id ) {
+            if ( !isalnum ( (unsigned char) c ) && c != '-' && c != '_' && c != '.' ) {
+                c = '_';
+            }
+        }
+        this->name = "/hcs-" + id;
+    }
+
+    int fd = shm_open ( this->name.c_str (), O_CREAT | O_EXCL | O_RDWR, 0644 );
+    if ( fd < 0 && errno == EEXIST ) {
+        ShmReader reader;
+        if ( reader.open ( this->name.c_str () ) && reader.is_alive () ) {
+            throw PSUError ( "\"" + this->name + "\" is published by process " + std::to_string ( reader.get_segment ()->pid ) );
+        }
+        // Left behind by a publisher that died.
+        shm_unlink ( this->name.c_str () );
+        fd = shm_open ( this->name.c_str (), O_CREAT | O_EXCL | O_RDWR, 0644 );
+    }
+    if ( fd < 0 ) {
+        throw PSUError ( "Failed to create \"" + this->name + "\": '" + strerror ( errno ) + "'" );
+    }
+    void *map = MAP_FAILED;
+    if ( ftruncate ( fd, sizeof ( ShmSegment ) ) == 0 ) {
+        map = mmap ( NULL, sizeof ( ShmSegment ), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+    }
+    if ( map == MAP_FAILED ) {
+        std::string error = strerror ( errno );
+        close ( fd );
+        shm_unlink ( this->name.c_str () );
+        throw PSUError ( "Failed to map \"" + this->name + "\": '" + error + "'" );
+    }
+    close ( fd );
+
+    // The new segment is all zeros, fill in the identity and then mark it valid.
+    segment                  = (ShmSegment *) map;
+    segment->version         = SHM_VERSION;
+    segment->size            = sizeof ( ShmSegment );
+    segment->history_size    = SHM_HISTORY;
+    segment->pid             = getpid ();
+    segment->nominal_voltage = identity.nominal_voltage;
+    segment->nominal_current = identity.nominal_current;
+    segment->nominal_power   = identity.nominal_power;
+    strncpy ( segment->manufacturer, identity.manufacturer.c_str (), sizeof ( segment->manufacturer ) - 1 );
+    strncpy ( segment->type, identity.type.c_str (), sizeof ( segment->type ) - 1 );
+    strncpy ( segment->serial, identity.serial.c_str (), sizeof ( segment->serial ) - 1 );
+    strncpy ( segment->device, psu->get_device_node ().c_str (), sizeof ( segment->device ) - 1 );
+    segment->magic.store ( SHM_MAGIC, std::memory_order_release );
+}
+
+Publisher::~Publisher()
+{
+    munmap ( segment, sizeof ( ShmSegment ) );
+    shm_unlink ( name.c_str () );
+}
+
+void Publisher::publish ( const ShmSample &sample )
+{
+    uint64_t sequence = segment->sequence.load ( std::memory_order_relaxed );
+    segment->sequence.store ( sequence + 1, std::memory_order_relaxed );
+    // Readers that see the sample being written, see the odd sequence too.
+    std::atomic_thread_fence ( std::memory_order_release );
+    segment->history[segment->count & ( SHM_HISTORY - 1 )] = sample;
+    segment->count++;
+    segment->sequence.store ( sequence + 2, std::memory_order_release );
+}
+
+void Publisher::run ( int64_t interval, unsigned long count ) throw ( PSUError & )
+{
+    StopGuard guard;
+
+    segment->interval = interval;
+    samples           = 0;
+    Ticker ticker ( interval );
+    while ( ( count == 0 || samples < count ) && ticker.wait ( psu ) ) {
+        PSU::Snapshot snapshot;
+        int64_t       request = hcs_monotonic_ns ();
+        psu->read_snapshot ( snapshot, PSU::SNAPSHOT_VOLTAGE_ACTUAL | PSU::SNAPSHOT_CURRENT_ACTUAL | PSU::SNAPSHOT_MODE );
+        int64_t       reply = hcs_monotonic_ns ();
+        ShmSample     sample;
+        sample.time     = request + ( reply - request ) / 2;
+        sample.voltage  = snapshot.voltage_actual;
+        sample.current  = snapshot.current_actual;
+        sample.mode     = static_cast<uint32_t>( snapshot.mode );
+        sample.reserved = 0;
+        publish ( sample );
+        if ( samples++ == 0 ) {
+            first = sample.time;
+        }
+        last = sample.time;
+    }
+}
+
+void Publisher::print_report ( FILE *out ) const
+{
+    fprintf ( out, "Segment:          %20s\n", name.c_str () );
+    fprintf ( out, "Samples:          %20lu\n", samples );
+    if ( samples > 1 && last > first ) {
+        fprintf ( out, "Sample rate (Hz): %20.02f\n", ( samples - 1 ) / ( ( last - first ) / 1e9 ) );
+    }
+}
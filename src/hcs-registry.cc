@@ -0,0 +1,177 @@
+/**
+ *    This file is part of HCS.
+ *    Written by Qball Cow <qball@gmpclient.org> 2013-2015
+ *
+ *    HCS is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 2 of the License.
+ *
+ *    HCS is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with HCS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <iostream>
+#include <exception>
+#include <functional>
+#include <map>
+#include <vector>
+#include <string>
+#include <stdio.h>
+#include <string.h>
+#include <termios.h>
+#include <hcs.h>
+#include <hcs-channel.h>
+#include <hcs-cache.h>
+#include <hcs-pacing.h>
+#include <hcs-ea.h>
+#include <hcs-pps.h>
+#include <hcs-registry.h>
+
+#include <config.h>
+
+#ifdef HAVE_LIBUDEV_H
+#include <libudev.h>
+#endif
+
+DeviceRegistry::DeviceRegistry()
+{
+}
+
+DeviceRegistry::~DeviceRegistry()
+{
+#ifdef HAVE_LIBUDEV_H
+    if ( monitor != nullptr ) {
+        udev_monitor_unref ( monitor );
+    }
+    if ( ud != nullptr ) {
+        udev_unref ( ud );
+    }
+#endif
+}
+
+int DeviceRegistry::get_fd () const
+{
+#ifdef HAVE_LIBUDEV_H
+    if ( monitor != nullptr ) {
+        return udev_monitor_get_fd ( monitor );
+    }
+#endif
+    return -1;
+}
+
+#ifdef HAVE_LIBUDEV_H
+void DeviceRegistry::add ( struct udev_device *dev, bool notify )
+{
+    const char *vendor_id  = udev_device_get_property_value ( dev, "ID_VENDOR_ID" );
+    const char *product_id = udev_device_get_property_value ( dev, "ID_MODEL_ID" );
+    const char *dev_name   = udev_device_get_property_value ( dev, "DEVNAME" );
+    if ( vendor_id == nullptr || product_id == nullptr || dev_name == nullptr ) {
+        return;
+    }
+    Entry entry;
+    // Types
+    if ( EAPS2K::check_supported_type ( vendor_id, product_id ) ) {
+        entry.type = PSU::PSUTypes::EAPS2K;
+    }
+    else if ( PPS11360::check_supported_type ( vendor_id, product_id ) ) {
+        entry.type = PSU::PSUTypes::PPS11360;
+    }
+    else {
+        return;
+    }
+    entry.device_name = dev_name;
+    const char *serial = udev_device_get_property_value ( dev, "ID_SERIAL" );
+    entry.serial = serial != nullptr ? serial : "";
+    for ( auto &existing : devices ) {
+        if ( existing.device_name == entry.device_name ) {
+            // Change event or the scan raced the monitor.
+            existing = entry;
+            return;
+        }
+    }
+    devices.push_back ( entry );
+    if ( notify && on_add ) {
+        on_add ( entry );
+    }
+}
+
+void DeviceRegistry::remove ( struct udev_device *dev )
+{
+    const char *dev_name = udev_device_get_property_value ( dev, "DEVNAME" );
+    if ( dev_name == nullptr ) {
+        return;
+    }
+    for ( auto it = devices.begin (); it != devices.end (); ++it ) {
+        if ( it->device_name == dev_name ) {
+            Entry entry = *it;
+            devices.erase ( it );
+            if ( on_remove ) {
+                on_remove ( entry );
+            }
+            return;
+        }
+    }
+}
+#endif
+
+bool DeviceRegistry::update ()
+{
+#ifdef HAVE_LIBUDEV_H
+    if ( !scanned ) {
+        scanned = true;
+        ud      = udev_new ();
+        if ( ud == nullptr ) {
+            return false;
+        }
+        // Start listening before the scan, so nothing is missed in between.
+        monitor = udev_monitor_new_from_netlink ( ud, "udev" );
+        if ( monitor != nullptr ) {
+            udev_monitor_filter_add_match_subsystem_devtype ( monitor, "tty", NULL );
+            if ( udev_monitor_enable_receiving ( monitor ) < 0 ) {
+                udev_monitor_unref ( monitor );
+                monitor = nullptr;
+            }
+        }
+
+        struct udev_enumerate *enumerate = udev_enumerate_new ( ud );
+        udev_enumerate_add_match_subsystem ( enumerate, "tty" );
+        udev_enumerate_scan_devices ( enumerate );
+        struct udev_list_entry *entry;
+        udev_list_entry_foreach ( entry, udev_enumerate_get_list_entry ( enumerate ) )
+        {
+            struct udev_device *dev = udev_device_new_from_syspath ( ud, udev_list_entry_get_name ( entry ) );
+            if ( dev != nullptr ) {
+                add ( dev, false );
+                udev_device_unref ( dev );
+            }
+        }
+        udev_enumerate_unref ( enumerate );
+        return !devices.empty ();
+    }
+    if ( monitor == nullptr ) {
+        return false;
+    }
+    // The monitor socket is non-blocking, drain what is queued.
+    bool               changed = false;
+    struct udev_device *dev;
+    while ( ( dev = udev_monitor_receive_device ( monitor ) ) != nullptr ) {
+        const char *action = udev_device_get_action ( dev );
+        size_t     before  = devices.size ();
+        if ( action != nullptr && strcmp ( action, "remove" ) == 0 ) {
+            remove ( dev );
+        }
+        else {
+            add ( dev, true );
+        }
+        changed |= devices.size () != before;
+        udev_device_unref ( dev );
+    }
+    return changed;
+#else
+    return false;
+#endif
+}
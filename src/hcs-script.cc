@@ -0,0 +1,198 @@
+/**
+ *    This file is part of HCS.
+ *    Written by Qball Cow <qball@gmpclient.org> 2013-2015
+ *
+ *    HCS is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 2 of the License.
+ *
+ *    HCS is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with HCS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <iostream>
+#include <exception>
+#include <functional>
+#include <map>
+#include <vector>
+#include <deque>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <termios.h>
+#include <hcs.h>
+#include <hcs-command.h>
+#include <hcs-script.h>
+
+#include <config.h>
+
+/**
+ * @returns true when word is a number, stored in value.
+ */
+static bool parse_number ( const std::string &word, double &value )
+{
+    char *p;
+    value = strtod ( word.c_str (), &p );
+    return p != word.c_str () && *p == '\0';
+}
+
+Script::Script( const char *file ) throw ( PSUError & ) : name ( file )
+{
+    std::ifstream in ( file );
+    if ( !in ) {
+        throw PSUError ( std::string ( "Failed to open \"" ) + file + "\": '" + strerror ( errno ) + "'" );
+    }
+    std::vector<std::string> errors;
+    std::vector<size_t>      open_loops;
+    std::string              text;
+    unsigned int             line = 0;
+    while ( std::getline ( in, text ) ) {
+        line++;
+        std::stringstream        ss ( text.substr ( 0, text.find ( '#' ) ) );
+        std::vector<std::string> tokens;
+        std::string              token;
+        while ( ss >> token ) {
+            tokens.push_back ( token );
+        }
+        if ( !tokens.empty () ) {
+            compile_line ( tokens, line, open_loops, errors );
+        }
+    }
+    for ( auto index : open_loops ) {
+        errors.push_back ( name + ":" + std::to_string ( instructions[index].line ) + ": loop without end" );
+    }
+    if ( !errors.empty () ) {
+        std::string message;
+        for ( auto &error : errors ) {
+            message += ( message.empty () ? "" : "\n" ) + error;
+        }
+        throw PSUError ( message );
+    }
+}
+
+void Script::compile_line ( const std::vector<std::string> &tokens, unsigned int line,
+                            std::vector<size_t> &open_loops, std::vector<std::string> &errors )
+{
+    const std::string &command = tokens[0];
+    size_t            args     = tokens.size () - 1;
+    std::string       where    = name + ":" + std::to_string ( line ) + ": ";
+    Instruction       instruction;
+    instruction.line = line;
+    double            value    = 0.0;
+
+    if ( command == "wait" || command == "until" ) {
+        if ( args != 1 || !parse_number ( tokens[1], value ) || value < 0 ) {
+            errors.push_back ( where + command + " takes a time in seconds" );
+            return;
+        }
+        instruction.op   = command == "wait" ? Op::WAIT : Op::UNTIL;
+        instruction.time = value * 1e9;
+    }
+    else if ( command == "loop" ) {
+        if ( args > 1 || ( args == 1 && ( !parse_number ( tokens[1], value ) || value < 1 ) ) ) {
+            // Keep the loop, so its end does not show up as an error too.
+            errors.push_back ( where + "loop takes an optional count of at least 1" );
+        }
+        instruction.op    = Op::LOOP;
+        instruction.count = value;
+        instruction.loop  = loops++;
+        open_loops.push_back ( instructions.size () );
+    }
+    else if ( command == "end" ) {
+        if ( args != 0 || open_loops.empty () ) {
+            errors.push_back ( where + ( args != 0 ? "end takes no arguments" : "end without loop" ) );
+            return;
+        }
+        instruction.op   = Op::END;
+        instruction.jump = open_loops.back ();
+        open_loops.pop_back ();
+    }
+    else {
+        // Kept for the command, it refers to its words.
+        std::vector<char *> argv;
+        for ( auto &token : tokens ) {
+            words.push_back ( token );
+            argv.push_back ( &words.back ()[0] );
+        }
+        try {
+            instruction.command = Command::parse ( argv.size (), argv.data () );
+        } catch ( PSUError &error ) {
+            errors.push_back ( where + error.what () );
+            return;
+        }
+        size_t used = instruction.command.get_words ();
+        if ( used != argv.size () ) {
+            errors.push_back ( where + "invalid argument '" + tokens[used] + "', usage: " + command + " " +
+                               instruction.command.get_usage () );
+            return;
+        }
+        instruction.op = Op::COMMAND;
+    }
+    instructions.push_back ( std::move ( instruction ) );
+}
+
+/**
+ * Sleep until deadline (CLOCK_MONOTONIC in ns), or until stopped.
+ */
+static void script_sleep ( int64_t deadline, PSU *psu )
+{
+    struct timespec ts     = { (time_t) ( deadline / 1000000000LL ), (long) ( deadline % 1000000000LL ) };
+    int64_t         before = hcs_monotonic_ns ();
+    while ( clock_nanosleep ( CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL ) == EINTR && !hcs_stopped () ) {
+        ;
+    }
+    if ( psu != nullptr ) {
+        psu->get_stats ().sleep += hcs_monotonic_ns () - before;
+    }
+}
+
+void Script::run ( std::function<PSU *( )> get_psu, std::function<void ( const Command &command )> execute ) throw ( PSUError & )
+{
+    StopGuard guard;
+
+    std::vector<unsigned long> counters ( loops, 0 );
+    int64_t                    start = hcs_monotonic_ns ();
+    size_t                     pc    = 0;
+    try {
+        while ( pc < instructions.size () && !hcs_stopped () ) {
+            const Instruction &in = instructions[pc++];
+            switch ( in.op )
+            {
+            case Op::COMMAND:
+                execute ( in.command );
+                break;
+            case Op::WAIT:
+                script_sleep ( hcs_monotonic_ns () + in.time, get_psu () );
+                break;
+            case Op::UNTIL:
+                script_sleep ( start + in.time, get_psu () );
+                break;
+            case Op::LOOP:
+                counters[in.loop] = 0;
+                break;
+            case Op::END:
+            {
+                const Instruction &loop = instructions[in.jump];
+                if ( loop.count == 0 || ++counters[loop.loop] < loop.count ) {
+                    // Back to the first instruction in the loop.
+                    pc = in.jump + 1;
+                }
+                break;
+            }
+            }
+        }
+    } catch ( PSUError &error ) {
+        fflush ( stdout );
+        throw PSUError ( name + ":" + std::to_string ( instructions[pc - 1].line ) + ": " + error.what () );
+    }
+    fflush ( stdout );
+}
@@ -0,0 +1,258 @@
+/**
+ *    This file is part of HCS.
+ *    Written by Qball Cow <qball@gmpclient.org> 2013-2015
+ *
+ *    HCS is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 2 of the License.
+ *
+ *    HCS is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with HCS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <iostream>
+#include <exception>
+#include <functional>
+#include <map>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <termios.h>
+#include <hcs.h>
+#include <hcs-sequence.h>
+
+#include <config.h>
+
+Sequence::Sequence( PSU *psu ) : psu ( psu )
+{
+}
+
+void Sequence::add_step ( int64_t time, float voltage, float current ) throw ( PSUError & )
+{
+    if ( time < 0 || ( !steps.empty () && time <= steps.back ().time ) ) {
+        throw PSUError ( "Sequence times have to increase" );
+    }
+    Step step;
+    step.time    = time;
+    step.voltage = voltage;
+    step.current = current;
+    steps.push_back ( step );
+}
+
+/**
+ * Parse a 'time voltage [current]' point, with the fields split by any of separators.
+ */
+static bool parse_point ( const std::string &point, const char *separators,
+                          double &time, float &voltage, float &current )
+{
+    std::vector<std::string> fields;
+    size_t                   start = point.find_first_not_of ( separators );
+    while ( start != std::string::npos ) {
+        size_t end = point.find_first_of ( separators, start );
+        fields.push_back ( point.substr ( start, end - start ) );
+        start = point.find_first_not_of ( separators, end );
+    }
+    if ( fields.size () < 2 || fields.size () > 3 ) {
+        return false;
+    }
+    char *p;
+    time = strtod ( fields[0].c_str (), &p );
+    if ( *p != '\0' ) {
+        return false;
+    }
+    float *values[2] = { &voltage, &current };
+    for ( size_t i = 1; i < fields.size (); i++ ) {
+        if ( fields[i] == "-" ) {
+            continue;
+        }
+        *values[i - 1] = strtof ( fields[i].c_str (), &p );
+        if ( *p != '\0' ) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void Sequence::load ( const char *spec ) throw ( PSUError & )
+{
+    steps.clear ();
+    double time;
+    float  voltage, current;
+    if ( strchr ( spec, ':' ) != nullptr ) {
+        std::stringstream list ( spec );
+        std::string       point;
+        while ( std::getline ( list, point, ',' ) ) {
+            voltage = current = NAN;
+            if ( !parse_point ( point, ":", time, voltage, current ) ) {
+                throw PSUError ( "Invalid point, expected time:voltage[:current]: " + point );
+            }
+            add_step ( time * 1e9, voltage, current );
+        }
+    }
+    else {
+        std::ifstream file ( spec );
+        if ( !file ) {
+            throw PSUError ( std::string ( "Failed to open \"" ) + spec + "\": '" + strerror ( errno ) + "'" );
+        }
+        std::string  line;
+        unsigned int lineno = 0;
+        while ( std::getline ( file, line ) ) {
+            lineno++;
+            line = line.substr ( 0, line.find ( '#' ) );
+            if ( line.find_first_not_of ( " \t\r" ) == std::string::npos ) {
+                continue;
+            }
+            voltage = current = NAN;
+            if ( !parse_point ( line, " \t\r", time, voltage, current ) ) {
+                throw PSUError ( std::string ( spec ) + ":" + std::to_string ( lineno ) +
+                                 ": expected 'time voltage [current]'" );
+            }
+            add_step ( time * 1e9, voltage, current );
+        }
+    }
+    if ( steps.empty () ) {
+        throw PSUError ( "Sequence has no points" );
+    }
+}
+
+void Sequence::ramp ( bool current, float from, float to, int64_t duration, unsigned int count,
+                      Shape shape ) throw ( PSUError & )
+{
+    if ( count < 2 || duration <= 0 ) {
+        throw PSUError ( "A ramp needs a duration and at least 2 steps" );
+    }
+    if ( shape == Shape::EXPONENTIAL && ( from <= 0.0f || to <= 0.0f ) ) {
+        throw PSUError ( "An exponential ramp needs values above 0" );
+    }
+    steps.clear ();
+    for ( unsigned int i = 0; i < count; i++ ) {
+        double fraction = i / (double) ( count - 1 );
+        float  value    = ( shape == Shape::LINEAR ) ? from + ( to - from ) * fraction :
+                          from * pow ( to / from, fraction );
+        add_step ( duration * fraction, current ? NAN : value, current ? value : NAN );
+    }
+}
+
+void Sequence::run ( FILE *out ) throw ( PSUError & )
+{
+    StopGuard guard;
+
+    if ( out != nullptr ) {
+        fprintf ( out, "step,time,voltage,current,error_ms,applied\n" );
+    }
+    for ( auto &step : steps ) {
+        step.applied = step.skipped = false;
+        step.error   = 0;
+    }
+    float   voltage = NAN, current = NAN;
+    // Setpoints of skipped steps, not yet applied.
+    float   pending_voltage = NAN, pending_current = NAN;
+    int64_t start   = hcs_monotonic_ns ();
+    first = last = 0;
+    for ( size_t i = 0; i < steps.size () && !hcs_stopped (); i++ ) {
+        Step    &step    = steps[i];
+        int64_t deadline = start + step.time;
+        struct timespec ts     = { (time_t) ( deadline / 1000000000LL ), (long) ( deadline % 1000000000LL ) };
+        int64_t         before = hcs_monotonic_ns ();
+        while ( clock_nanosleep ( CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL ) == EINTR && !hcs_stopped () ) {
+            ;
+        }
+        psu->get_stats ().sleep += hcs_monotonic_ns () - before;
+        if ( hcs_stopped () ) {
+            break;
+        }
+        int64_t now = hcs_monotonic_ns ();
+        step.error = now - deadline;
+        // The next step is due already, this one would only be late.
+        if ( i + 1 < steps.size () && now >= start + steps[i + 1].time ) {
+            step.skipped = true;
+            if ( !isnan ( step.voltage ) ) {
+                pending_voltage = step.voltage;
+            }
+            if ( !isnan ( step.current ) ) {
+                pending_current = step.current;
+            }
+            continue;
+        }
+        float set_voltage = isnan ( step.voltage ) ? pending_voltage : step.voltage;
+        float set_current = isnan ( step.current ) ? pending_current : step.current;
+        pending_voltage = pending_current = NAN;
+        // Only write what changes.
+        if ( !isnan ( set_voltage ) && set_voltage != voltage ) {
+            psu->set_voltage ( set_voltage );
+            voltage = set_voltage;
+        }
+        if ( !isnan ( set_current ) && set_current != current ) {
+            psu->set_current ( set_current );
+            current = set_current;
+        }
+        step.applied = true;
+        if ( first == 0 ) {
+            first = now;
+        }
+        last = now;
+    }
+
+    if ( out != nullptr ) {
+        for ( size_t i = 0; i < steps.size (); i++ ) {
+            const Step &step = steps[i];
+            if ( !step.applied && !step.skipped ) {
+                // Not reached, stopped early.
+                break;
+            }
+            // Setpoints left unchanged are empty.
+            char voltage_str[16] = "", current_str[16] = "";
+            if ( !isnan ( step.voltage ) ) {
+                snprintf ( voltage_str, sizeof ( voltage_str ), "%.3f", step.voltage );
+            }
+            if ( !isnan ( step.current ) ) {
+                snprintf ( current_str, sizeof ( current_str ), "%.3f", step.current );
+            }
+            fprintf ( out, "%zu,%.6f,%s,%s,%.3f,%d\n", i, step.time / 1e9, voltage_str, current_str,
+                      step.error / 1e6, step.applied ? 1 : 0 );
+        }
+        fflush ( out );
+    }
+}
+
+void Sequence::print_report ( FILE *out ) const
+{
+    unsigned long applied = 0, skipped = 0;
+    double        error_sum = 0.0, error_sq = 0.0;
+    int64_t       error_max = 0;
+    for ( auto &step : steps ) {
+        if ( step.applied ) {
+            applied++;
+            error_sum += step.error;
+            error_sq  += (double) step.error * step.error;
+            if ( step.error > error_max ) {
+                error_max = step.error;
+            }
+        }
+        else if ( step.skipped ) {
+            skipped++;
+        }
+    }
+    double duration = ( last - first ) / 1e9;
+    fprintf ( out, "Steps:            %20zu\n", steps.size () );
+    fprintf ( out, "Applied:          %20lu\n", applied );
+    fprintf ( out, "Skipped:          %20lu\n", skipped );
+    if ( applied < 2 ) {
+        return;
+    }
+    fprintf ( out, "Duration (s):     %20.03f\n", duration );
+    fprintf ( out, "Rate (Hz):        %20.02f\n", ( applied - 1 ) / duration );
+    fprintf ( out, "Error mean (ms):  %20.03f\n", error_sum / applied / 1e6 );
+    fprintf ( out, "Error rms (ms):   %20.03f\n", sqrt ( error_sq / applied ) / 1e6 );
+    fprintf ( out, "Error max (ms):   %20.03f\n", error_max / 1e6 );
+}
@@ -0,0 +1,224 @@
+/**
+ *    This file is part of HCS.
+ *    Written by Qball Cow <qball@gmpclient.org> 2013-2015
+ *
+ *    HCS is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 2 of the License.
+ *
+ *    HCS is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with HCS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <iostream>
+#include <exception>
+#include <functional>
+#include <algorithm>
+#include <vector>
+#include <map>
+#include <string>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <termios.h>
+#include <sys/epoll.h>
+#include <hcs.h>
+#include <hcs-channel.h>
+#include <hcs-session.h>
+
+#include <config.h>
+
+Session::Session() throw ( PSUError & )
+{
+    epfd = epoll_create1 ( EPOLL_CLOEXEC );
+    if ( epfd < 0 ) {
+        throw PSUError ( std::string ( "Failed to create event loop: " ) + strerror ( errno ) );
+    }
+}
+Session::~Session()
+{
+    clear ();
+    close ( epfd );
+}
+
+void Session::add ( const std::string &name, PSU *psu ) throw ( PSUError & )
+{
+    Device *device = new Device ( name, psu );
+    int    fd      = psu->get_fd ();
+    fcntl ( fd, F_SETFL, fcntl ( fd, F_GETFL ) | O_NONBLOCK );
+
+    struct epoll_event ev;
+    ev.events   = EPOLLIN;
+    ev.data.ptr = device;
+    if ( epoll_ctl ( epfd, EPOLL_CTL_ADD, fd, &ev ) < 0 ) {
+        delete device;
+        delete psu;
+        throw PSUError ( std::string ( "Failed to add device to event loop: " ) + strerror ( errno ) );
+    }
+    device->events = ev.events;
+    devices.push_back ( device );
+}
+
+void Session::remove ( Device *device )
+{
+    for ( auto &group : groups ) {
+        group.second.erase ( std::remove ( group.second.begin (), group.second.end (), device ), group.second.end () );
+    }
+    devices.erase ( std::remove ( devices.begin (), devices.end (), device ), devices.end () );
+    epoll_ctl ( epfd, EPOLL_CTL_DEL, device->psu->get_fd (), NULL );
+    delete device->psu;
+    delete device;
+}
+
+void Session::clear ()
+{
+    groups.clear ();
+    for ( auto device : devices ) {
+        epoll_ctl ( epfd, EPOLL_CTL_DEL, device->psu->get_fd (), NULL );
+        delete device->psu;
+        delete device;
+    }
+    devices.clear ();
+}
+
+void Session::add_group ( const std::string &name, const char *members ) throw ( PSUError & )
+{
+    std::vector<Device *> group;
+    std::string           list = members;
+    size_t                start = 0;
+    while ( start <= list.size () ) {
+        size_t end = list.find ( ',', start );
+        if ( end == std::string::npos ) {
+            end = list.size ();
+        }
+        std::string member = list.substr ( start, end - start );
+        if ( !member.empty () ) {
+            std::vector<Device *> found = resolve ( member );
+            group.insert ( group.end (), found.begin (), found.end () );
+        }
+        start = end + 1;
+    }
+    groups[name] = group;
+}
+
+std::vector<Session::Device *> Session::resolve ( const std::string &target ) const throw ( PSUError & )
+{
+    if ( target == "all" ) {
+        return devices;
+    }
+    auto group = groups.find ( target );
+    if ( group != groups.end () ) {
+        return group->second;
+    }
+    for ( auto device : devices ) {
+        if ( device->name == target ) {
+            return std::vector<Device *> ( 1, device );
+        }
+    }
+    throw PSUError ( "Unknown device or group: " + target );
+}
+
+unsigned int Session::execute ( const std::vector<Device *> &targets, PSU::Operation op, float value,
+                                unsigned int fields )
+{
+    for ( auto device : targets ) {
+        device->error.clear ();
+        device->channel.clear_error ();
+        device->snapshot = PSU::Snapshot ();
+        try {
+            device->psu->queue_operation ( device->channel, op, value, &device->snapshot, fields );
+        } catch ( PSUError &error ) {
+            device->error = error.what ();
+        }
+    }
+    run ();
+    unsigned int failed = 0;
+    for ( auto device : targets ) {
+        if ( device->error.empty () ) {
+            device->error = device->channel.get_error ();
+        }
+        if ( !device->error.empty () ) {
+            failed++;
+        }
+        else {
+            device->psu->remember ( device->snapshot );
+        }
+    }
+    return failed;
+}
+
+void Session::update_events ( Device *device )
+{
+    uint32_t events = (uint32_t) EPOLLIN | ( device->channel.wants_write () ? (uint32_t) EPOLLOUT : 0 );
+    if ( events != device->events ) {
+        struct epoll_event ev;
+        ev.events   = events;
+        ev.data.ptr = device;
+        epoll_ctl ( epfd, EPOLL_CTL_MOD, device->psu->get_fd (), &ev );
+        device->events = events;
+    }
+}
+
+void Session::run ()
+{
+    struct epoll_event events[16];
+    while ( true ) {
+        bool    busy     = false;
+        int64_t deadline = 0;
+        for ( auto device : devices ) {
+            device->channel.handle_write ();
+            update_events ( device );
+            if ( !device->channel.idle () ) {
+                busy = true;
+            }
+            int64_t d = device->channel.deadline ();
+            if ( d != 0 && ( deadline == 0 || d < deadline ) ) {
+                deadline = d;
+            }
+        }
+        if ( !busy ) {
+            break;
+        }
+        int timeout = -1;
+        if ( deadline != 0 ) {
+            int64_t remaining = deadline - hcs_monotonic_ns ();
+            timeout = remaining > 0 ? ( remaining + 999999 ) / 1000000 : 0;
+        }
+        int64_t before = hcs_monotonic_ns ();
+        int     n      = epoll_wait ( epfd, events, 16, timeout );
+        // All busy devices were waited on.
+        int64_t waited = hcs_monotonic_ns () - before;
+        for ( auto device : devices ) {
+            if ( !device->channel.idle () ) {
+                device->psu->get_stats ().io_wait += waited;
+            }
+        }
+        if ( n < 0 && errno != EINTR ) {
+            for ( auto device : devices ) {
+                device->channel.fail_all ( PSUError ( std::string ( "Event loop failed: " ) + strerror ( errno ) ) );
+            }
+            break;
+        }
+        for ( int i = 0; i < n; i++ ) {
+            Device *device = (Device *) events[i].data.ptr;
+            if ( events[i].events & EPOLLOUT ) {
+                device->channel.handle_write ();
+            }
+            if ( events[i].events & ( EPOLLIN | EPOLLERR | EPOLLHUP ) ) {
+                device->channel.handle_read ();
+            }
+        }
+        int64_t now = hcs_monotonic_ns ();
+        for ( auto device : devices ) {
+            device->channel.handle_timeout ( now );
+        }
+    }
+}
@@ -0,0 +1,609 @@
+/**
+ *    This file is part of HCS.
+ *    Written by Qball Cow <qball@gmpclient.org> 2013-2015
+ *
+ *    HCS is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 2 of the License.
+ *
+ *    HCS is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with HCS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Power supply simulator.
+ *
+ * Creates a pseudo terminal that speaks the EA-PS 2000 telegram protocol or the
+ * Voltcraft PPS line protocol, so HCS_DEVICE can point at it. The output is modelled
+ * as a resistive load, so voltage, current and CC/CV mode follow the setpoints.
+ *
+ * Replies can be delayed (fixed latency plus random jitter), paced at a baud rate, and
+ * damaged by dropping bytes or corrupting the checksum.
+ */
+#include <iostream>
+#include <exception>
+#include <functional>
+#include <map>
+#include <deque>
+#include <vector>
+#include <string>
+#include <random>
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <termios.h>
+#include <hcs.h>
+#include <hcs-channel.h>
+#include <hcs-cache.h>
+#include <hcs-pacing.h>
+#include <hcs-ea.h>
+
+#include <config.h>
+
+struct SimOptions
+{
+    // Reply delay, fixed part and maximum random extra (in ns).
+    int64_t latency   = 0;
+    int64_t jitter    = 0;
+    // Time to transmit one byte (in ns), 0 to send replies in one go.
+    int64_t byte_time = 0;
+    // Probability a reply byte is dropped.
+    double  drop      = 0.0;
+    // Probability a reply is corrupted.
+    double  corrupt   = 0.0;
+    // Load on the output (in Ohm).
+    double  load      = 10.0;
+    bool    verbose   = false;
+};
+
+/**
+ * The protocol independent part: output model and reply scheduling.
+ */
+class Simulator
+{
+public:
+    Simulator( const SimOptions &options, unsigned int seed ) : options ( options ), random ( seed )
+    {
+    }
+    virtual ~Simulator()
+    {
+    }
+
+    /**
+     * @param data The bytes received from the host.
+     * @param size The number of bytes.
+     */
+    virtual void receive ( const uint8_t *data, size_t size ) = 0;
+
+    /**
+     * @returns the time the next reply byte is due, 0 if none.
+     */
+    int64_t next_due () const
+    {
+        return output.empty () ? 0 : output.front ().due;
+    }
+
+    /**
+     * @param fd  The pty master.
+     * @param now The current time.
+     *
+     * Write the reply bytes that are due.
+     */
+    void flush ( int fd, int64_t now )
+    {
+        uint8_t buffer[256];
+        size_t  size = 0;
+        while ( size < output.size () && output[size].due <= now && size < sizeof ( buffer ) ) {
+            buffer[size] = output[size].byte;
+            size++;
+        }
+        if ( size == 0 ) {
+            return;
+        }
+        ssize_t r = write ( fd, buffer, size );
+        if ( r < 0 ) {
+            if ( errno != EAGAIN ) {
+                fprintf ( stderr, "Failed to write reply: %s\n", strerror ( errno ) );
+            }
+            return;
+        }
+        // What did not fit is retried on the next call.
+        output.erase ( output.begin (), output.begin () + r );
+    }
+
+protected:
+    const SimOptions &options;
+    std::mt19937     random;
+
+    // Setpoints in SI units and output state.
+    double           set_voltage = 5.0;
+    double           set_current = 0.5;
+    bool             output_on   = false;
+
+    /**
+     * @param voltage Set to the output voltage.
+     * @param current Set to the output current.
+     *
+     * @returns true when the supply limits the current (CC), false in CV.
+     */
+    bool output_state ( double &voltage, double &current ) const
+    {
+        if ( !output_on ) {
+            voltage = current = 0.0;
+            return false;
+        }
+        double load_current = set_voltage / options.load;
+        if ( load_current > set_current ) {
+            current = set_current;
+            voltage = set_current * options.load;
+            return true;
+        }
+        voltage = set_voltage;
+        current = load_current;
+        return false;
+    }
+
+    bool chance ( double probability )
+    {
+        return probability > 0.0 && std::uniform_real_distribution<double> ( 0.0, 1.0 ) ( random ) < probability;
+    }
+
+    /**
+     * @param data The reply.
+     * @param size The length of the reply.
+     *
+     * Schedule a reply, after the configured latency and behind what is still queued.
+     */
+    void send ( const uint8_t *data, size_t size )
+    {
+        int64_t due = hcs_monotonic_ns () + options.latency;
+        if ( options.jitter > 0 ) {
+            due += std::uniform_int_distribution<int64_t> ( 0, options.jitter ) ( random );
+        }
+        if ( !output.empty () && output.back ().due > due ) {
+            due = output.back ().due;
+        }
+        for ( size_t i = 0; i < size; i++ ) {
+            due += options.byte_time;
+            if ( chance ( options.drop ) ) {
+                continue;
+            }
+            output.push_back ( { due, data[i] } );
+        }
+    }
+
+private:
+    struct Byte
+    {
+        int64_t due;
+        uint8_t byte;
+    };
+    std::deque<Byte> output;
+};
+
+/**
+ * EA-PS 2000 series, telegram protocol.
+ */
+class EASimulator : public Simulator
+{
+public:
+    EASimulator( const SimOptions &options, unsigned int seed ) : Simulator ( options, seed )
+    {
+    }
+
+    void receive ( const uint8_t *data, size_t size )
+    {
+        input.append ( (const char *) data, size );
+        while ( !input.empty () ) {
+            uint8_t sd = input[0];
+            // Resync on anything that is not a start delimiter from the host.
+            if ( ( sd & 0x30 ) != ( EAPS2K::cast_type | EAPS2K::direction ) ||
+                 ( ( sd & 0xC0 ) != EAPS2K::SEND && ( sd & 0xC0 ) != EAPS2K::RECEIVE ) ) {
+                input.erase ( 0, 1 );
+                continue;
+            }
+            bool   is_send = ( sd & 0xC0 ) == EAPS2K::SEND;
+            size_t length  = 3 + ( is_send ? ( sd & 0x0F ) + 1 : 0 ) + 2;
+            if ( input.size () < length ) {
+                break;
+            }
+            handle ( (const uint8_t *) input.data (), length );
+            input.erase ( 0, length );
+        }
+    }
+
+private:
+    std::string input;
+    // Ratings of a PS 2042-06B.
+    const float nominal_voltage = 42.0f;
+    const float nominal_current = 6.0f;
+    const float nominal_power   = 100.0f;
+    uint16_t    ovp             = 28160;
+    uint16_t    ocp             = 28160;
+    bool        remote          = false;
+
+    uint16_t to_raw ( double value, double nominal ) const
+    {
+        return ( value * 25600 ) / nominal + 0.5;
+    }
+
+    void reply ( uint8_t object, const uint8_t *data, size_t size )
+    {
+        uint8_t telegram[32];
+        // Answer from the device: the direction bit is left clear.
+        telegram[0] = 0x80 | EAPS2K::cast_type | ( ( size - 1 ) & 0x0F );
+        telegram[1] = 0;
+        telegram[2] = object;
+        memcpy ( &telegram[3], data, size );
+        int crc = EAPS2K::crc16 ( telegram, size + 3 );
+        if ( chance ( options.corrupt ) ) {
+            crc ^= 1 << std::uniform_int_distribution<int> ( 0, 15 ) ( random );
+        }
+        telegram[size + 3] = ( crc >> 8 ) & 0xFF;
+        telegram[size + 4] = crc & 0xFF;
+        send ( telegram, size + 5 );
+    }
+
+    void reply_error ( EAPS2K::ErrorTypes error )
+    {
+        uint8_t code = error;
+        reply ( 0xFF, &code, 1 );
+    }
+
+    void reply_string ( uint8_t object, const char *value )
+    {
+        reply ( object, (const uint8_t *) value, strlen ( value ) + 1 );
+    }
+
+    void reply_float ( uint8_t object, float value )
+    {
+        uint32_t v;
+        memcpy ( &v, &value, sizeof ( v ) );
+        v = htobe32 ( v );
+        reply ( object, (const uint8_t *) &v, sizeof ( v ) );
+    }
+
+    void reply_uint16 ( uint8_t object, uint16_t value )
+    {
+        uint8_t data[2] = { (uint8_t) ( value >> 8 ), (uint8_t) ( value & 0xFF ) };
+        reply ( object, data, 2 );
+    }
+
+    void reply_status ( uint8_t object, double voltage, double current, bool cc )
+    {
+        uint16_t v       = to_raw ( voltage, nominal_voltage );
+        uint16_t i       = to_raw ( current, nominal_current );
+        uint8_t  data[6] = {
+            (uint8_t) ( remote ? 0x01 : 0x00 ),
+            (uint8_t) ( ( output_on ? 0x01 : 0x00 ) | ( cc ? 0x04 : 0x00 ) ),
+            (uint8_t) ( v >> 8 ),          (uint8_t) ( v & 0xFF ),
+            (uint8_t) ( i >> 8 ),          (uint8_t) ( i & 0xFF )
+        };
+        reply ( object, data, sizeof ( data ) );
+    }
+
+    void handle ( const uint8_t *telegram, size_t length )
+    {
+        int crc = EAPS2K::crc16 ( telegram, length - 2 );
+        if ( telegram[length - 2] != ( ( crc >> 8 ) & 0xFF ) || telegram[length - 1] != ( crc & 0xFF ) ) {
+            reply_error ( EAPS2K::CRC_INVALID );
+            return;
+        }
+        uint8_t object = telegram[2];
+        if ( options.verbose ) {
+            fprintf ( stderr, "%s object %d\n", ( telegram[0] & 0xC0 ) == EAPS2K::SEND ? "send" : "query", object );
+        }
+        if ( ( telegram[0] & 0xC0 ) == EAPS2K::SEND ) {
+            handle_send ( object, &telegram[3], length - 5 );
+        }
+        else {
+            handle_query ( object );
+        }
+    }
+
+    void handle_query ( uint8_t object )
+    {
+        double voltage, current;
+        bool   cc;
+        switch ( object )
+        {
+        case EAPS2K::DEVICE_TYPE:       reply_string ( object, "PS 2042-06B" ); break;
+        case EAPS2K::DEVICE_SERIAL_NO:  reply_string ( object, "2690000001" ); break;
+        case EAPS2K::DEVICE_ARTICLE_NO: reply_string ( object, "39200000" ); break;
+        case EAPS2K::MANUFACTURER:      reply_string ( object, "EA" ); break;
+        case EAPS2K::SOFTWARE_VERSION:  reply_string ( object, "V4.02 05.12.12" ); break;
+        case EAPS2K::NOMINAL_VOLTAGE:   reply_float ( object, nominal_voltage ); break;
+        case EAPS2K::NOMINAL_CURRENT:   reply_float ( object, nominal_current ); break;
+        case EAPS2K::NOMINAL_POWER:     reply_float ( object, nominal_power ); break;
+        case EAPS2K::DEVICE_CLASS:      reply_uint16 ( object, 0x0010 ); break;
+        case EAPS2K::OVP_THRESHOLD:     reply_uint16 ( object, ovp ); break;
+        case EAPS2K::OCP_THRESHOLD:     reply_uint16 ( object, ocp ); break;
+        case EAPS2K::SET_VOLTAGE:       reply_uint16 ( object, to_raw ( set_voltage, nominal_voltage ) ); break;
+        case EAPS2K::SET_CURRENT:       reply_uint16 ( object, to_raw ( set_current, nominal_current ) ); break;
+        case EAPS2K::STATUS_ACTUAL:
+            cc = output_state ( voltage, current );
+            reply_status ( object, voltage, current, cc );
+            break;
+        case EAPS2K::STATUS_SET:
+            reply_status ( object, set_voltage, set_current, false );
+            break;
+        default:
+            reply_error ( EAPS2K::OBJECT_INVALID );
+            break;
+        }
+    }
+
+    void handle_send ( uint8_t object, const uint8_t *data, size_t size )
+    {
+        if ( size != 2 ) {
+            reply_error ( EAPS2K::OBJECT_LENGTH_INVALID );
+            return;
+        }
+        uint16_t value = ( data[0] << 8 ) | data[1];
+        if ( object == EAPS2K::POWER_SUPPLY_CONTROL ) {
+            uint8_t mask = data[0], bits = data[1];
+            if ( mask & 0x10 ) {
+                remote = ( bits & 0x10 ) != 0;
+            }
+            if ( mask & 0x01 ) {
+                if ( !remote ) {
+                    reply_error ( EAPS2K::ACCESS_VIOLATION );
+                    return;
+                }
+                output_on = ( bits & 0x01 ) != 0;
+            }
+            reply_error ( EAPS2K::NO_ERROR );
+            return;
+        }
+        if ( object != EAPS2K::SET_VOLTAGE && object != EAPS2K::SET_CURRENT &&
+             object != EAPS2K::OVP_THRESHOLD && object != EAPS2K::OCP_THRESHOLD ) {
+            reply_error ( EAPS2K::ACCESS_VIOLATION );
+            return;
+        }
+        if ( !remote ) {
+            reply_error ( EAPS2K::ACCESS_VIOLATION );
+            return;
+        }
+        // Setpoints go to 100%, the protection thresholds to 110%.
+        bool threshold = object == EAPS2K::OVP_THRESHOLD || object == EAPS2K::OCP_THRESHOLD;
+        if ( value > ( threshold ? 28160 : 25600 ) ) {
+            reply_error ( EAPS2K::OBJECT_OVERFLOW );
+            return;
+        }
+        switch ( object )
+        {
+        case EAPS2K::SET_VOLTAGE:   set_voltage = value * nominal_voltage / 25600.0; break;
+        case EAPS2K::SET_CURRENT:   set_current = value * nominal_current / 25600.0; break;
+        case EAPS2K::OVP_THRESHOLD: ovp = value; break;
+        case EAPS2K::OCP_THRESHOLD: ocp = value; break;
+        }
+        reply_error ( EAPS2K::NO_ERROR );
+    }
+};
+
+/**
+ * Voltcraft PPS 11360, line protocol.
+ */
+class PPSSimulator : public Simulator
+{
+public:
+    PPSSimulator( const SimOptions &options, unsigned int seed ) : Simulator ( options, seed )
+    {
+    }
+
+    void receive ( const uint8_t *data, size_t size )
+    {
+        input.append ( (const char *) data, size );
+        size_t end;
+        while ( ( end = input.find ( '\r' ) ) != std::string::npos ) {
+            handle ( input.substr ( 0, end ) );
+            input.erase ( 0, end + 1 );
+        }
+    }
+
+private:
+    std::string input;
+
+    void reply ( const char *format, ... ) __attribute__ ( ( format ( printf, 2, 3 ) ) )
+    {
+        char    buffer[64];
+        va_list ap;
+        va_start ( ap, format );
+        int     size = vsnprintf ( buffer, sizeof ( buffer ), format, ap );
+        va_end ( ap );
+        if ( size > 0 && chance ( options.corrupt ) ) {
+            // No checksum on this protocol, garble a character instead.
+            buffer[std::uniform_int_distribution<int> ( 0, size - 1 ) ( random )] ^= 0x10;
+        }
+        send ( (const uint8_t *) buffer, size );
+    }
+
+    void handle ( const std::string &line )
+    {
+        if ( options.verbose ) {
+            fprintf ( stderr, "command %s\n", line.c_str () );
+        }
+        double voltage, current;
+        if ( line == "GETD" ) {
+            bool cc = output_state ( voltage, current );
+            // Voltage in 10mV, current in 10mA, limiter.
+            reply ( "%04d%04d%d\rOK\r", (int) ( voltage * 100 + 0.5 ), (int) ( current * 100 + 0.5 ), cc ? 1 : 0 );
+        }
+        else if ( line == "GETS" ) {
+            // Voltage in 100mV, current in 10mA.
+            reply ( "%03d%03d\rOK\r", (int) ( set_voltage * 10 + 0.5 ), (int) ( set_current * 100 + 0.5 ) );
+        }
+        else if ( line == "GMAX" ) {
+            reply ( "362700\rOK\r" );
+        }
+        else if ( line.compare ( 0, 4, "VOLT" ) == 0 ) {
+            set_voltage = strtol ( line.c_str () + 4, nullptr, 10 ) / 10.0;
+            reply ( "OK\r" );
+        }
+        else if ( line.compare ( 0, 4, "CURR" ) == 0 ) {
+            set_current = strtol ( line.c_str () + 4, nullptr, 10 ) / 100.0;
+            reply ( "OK\r" );
+        }
+        else if ( line.compare ( 0, 4, "SOUT" ) == 0 ) {
+            // SOUT0 switches the output on.
+            output_on = line.compare ( 4, 1, "0" ) == 0;
+            reply ( "OK\r" );
+        }
+        else {
+            reply ( "OK\r" );
+        }
+    }
+};
+
+static volatile sig_atomic_t sim_stop = 0;
+
+static void sim_signal ( int sig )
+{
+    sim_stop = 1;
+}
+
+static void usage ( const char *name )
+{
+    fprintf ( stderr, "Usage: %s [options] <ea|pps>\n", name );
+    fprintf ( stderr, "  -l <ms>    Reply latency.\n" );
+    fprintf ( stderr, "  -j <ms>    Maximum random extra latency.\n" );
+    fprintf ( stderr, "  -b <baud>  Pace reply bytes at this baud rate, 0 for no pacing.\n" );
+    fprintf ( stderr, "             Default: 0 for ea, 9600 for pps.\n" );
+    fprintf ( stderr, "  -d <p>     Probability a reply byte is dropped.\n" );
+    fprintf ( stderr, "  -c <p>     Probability a reply is corrupted (checksum for ea).\n" );
+    fprintf ( stderr, "  -r <ohm>   Load resistance on the output (default 10).\n" );
+    fprintf ( stderr, "  -s <seed>  Random seed.\n" );
+    fprintf ( stderr, "  -L <path>  Create a symlink to the pseudo terminal.\n" );
+    fprintf ( stderr, "  -v         Log the requests on stderr.\n" );
+}
+
+int main ( int argc, char **argv )
+{
+    SimOptions   options;
+    unsigned int seed = time ( NULL );
+    long         baud = -1;
+    const char   *link = nullptr;
+    int          c;
+    while ( ( c = getopt ( argc, argv, "l:j:b:d:c:r:s:L:vh" ) ) != -1 ) {
+        switch ( c )
+        {
+        case 'l': options.latency = strtod ( optarg, nullptr ) * 1e6; break;
+        case 'j': options.jitter = strtod ( optarg, nullptr ) * 1e6; break;
+        case 'b': baud = strtol ( optarg, nullptr, 10 ); break;
+        case 'd': options.drop = strtod ( optarg, nullptr ); break;
+        case 'c': options.corrupt = strtod ( optarg, nullptr ); break;
+        case 'r': options.load = strtod ( optarg, nullptr ); break;
+        case 's': seed = strtoul ( optarg, nullptr, 10 ); break;
+        case 'L': link = optarg; break;
+        case 'v': options.verbose = true; break;
+        default:
+            usage ( argv[0] );
+            return EXIT_FAILURE;
+        }
+    }
+    if ( optind >= argc || options.load <= 0.0 ) {
+        usage ( argv[0] );
+        return EXIT_FAILURE;
+    }
+
+    bool is_ea = strcmp ( argv[optind], "ea" ) == 0;
+    if ( !is_ea && strcmp ( argv[optind], "pps" ) != 0 ) {
+        usage ( argv[0] );
+        return EXIT_FAILURE;
+    }
+    if ( baud < 0 ) {
+        // The PPS is a real serial port, bytes trickle in. The EA is USB.
+        baud = is_ea ? 0 : 9600;
+    }
+    // 10 bits per byte: start, 8 data, stop.
+    options.byte_time = baud > 0 ? 10000000000LL / baud : 0;
+    Simulator *sim = nullptr;
+    if ( is_ea ) {
+        sim = new EASimulator ( options, seed );
+    }
+    else {
+        sim = new PPSSimulator ( options, seed );
+    }
+
+    int master = posix_openpt ( O_RDWR | O_NOCTTY );
+    if ( master < 0 || grantpt ( master ) < 0 || unlockpt ( master ) < 0 ) {
+        fprintf ( stderr, "Failed to create pseudo terminal: %s\n", strerror ( errno ) );
+        return EXIT_FAILURE;
+    }
+    const char *name = ptsname ( master );
+    // Keep the slave open, so the master stays usable between clients.
+    int        slave = open ( name, O_RDWR | O_NOCTTY );
+    if ( slave < 0 ) {
+        fprintf ( stderr, "Failed to open %s: %s\n", name, strerror ( errno ) );
+        return EXIT_FAILURE;
+    }
+    struct termios tio;
+    tcgetattr ( slave, &tio );
+    cfmakeraw ( &tio );
+    tcsetattr ( slave, TCSANOW, &tio );
+    fcntl ( master, F_SETFL, fcntl ( master, F_GETFL ) | O_NONBLOCK );
+
+    if ( link != nullptr ) {
+        unlink ( link );
+        if ( symlink ( name, link ) < 0 ) {
+            fprintf ( stderr, "Failed to create %s: %s\n", link, strerror ( errno ) );
+            return EXIT_FAILURE;
+        }
+    }
+    printf ( "%s\n", name );
+    fflush ( stdout );
+
+    struct sigaction sa;
+    memset ( &sa, 0, sizeof ( sa ) );
+    sa.sa_handler = sim_signal;
+    sigemptyset ( &sa.sa_mask );
+    sigaction ( SIGINT, &sa, NULL );
+    sigaction ( SIGTERM, &sa, NULL );
+
+    while ( !sim_stop ) {
+        // Byte pacing needs better than millisecond resolution.
+        struct timespec ts, *timeout = NULL;
+        int64_t         due          = sim->next_due ();
+        if ( due != 0 ) {
+            int64_t remaining = std::max ( due - hcs_monotonic_ns (), (int64_t) 0 );
+            ts.tv_sec  = remaining / 1000000000LL;
+            ts.tv_nsec = remaining % 1000000000LL;
+            timeout    = &ts;
+        }
+        struct pollfd pfd = { master, POLLIN, 0 };
+        if ( ppoll ( &pfd, 1, timeout, NULL ) < 0 && errno != EINTR ) {
+            fprintf ( stderr, "poll failed: %s\n", strerror ( errno ) );
+            break;
+        }
+        if ( pfd.revents & POLLIN ) {
+            uint8_t buffer[256];
+            ssize_t r = read ( master, buffer, sizeof ( buffer ) );
+            if ( r > 0 ) {
+                sim->receive ( buffer, r );
+            }
+        }
+        sim->flush ( master, hcs_monotonic_ns () );
+    }
+
+    if ( link != nullptr ) {
+        unlink ( link );
+    }
+    delete sim;
+    close ( slave );
+    close ( master );
+    return EXIT_SUCCESS;
+}
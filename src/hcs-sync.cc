@@ -0,0 +1,142 @@
+/**
+ *    This file is part of HCS.
+ *    Written by Qball Cow <qball@gmpclient.org> 2013-2015
+ *
+ *    HCS is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 2 of the License.
+ *
+ *    HCS is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with HCS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <iostream>
+#include <exception>
+#include <functional>
+#include <vector>
+#include <map>
+#include <string>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <termios.h>
+#include <hcs.h>
+#include <hcs-channel.h>
+#include <hcs-session.h>
+#include <hcs-bench.h>
+#include <hcs-sync.h>
+
+#include <config.h>
+
+Sync::Sync( Session &session, const std::vector<Session::Device *> &devices ) : session ( session )
+{
+    for ( auto device : devices ) {
+        Column column;
+        column.device = device;
+        columns.push_back ( column );
+    }
+}
+
+void Sync::run ( int64_t interval, unsigned long count, FILE *out )
+{
+    const unsigned int fields = PSU::SNAPSHOT_VOLTAGE_ACTUAL | PSU::SNAPSHOT_CURRENT_ACTUAL | PSU::SNAPSHOT_MODE;
+    std::vector<Session::Device *> devices;
+    for ( auto &column : columns ) {
+        devices.push_back ( column.device );
+        column.samples = column.failed = 0;
+        column.round_trip = 0;
+    }
+    ticks     = missed = 0;
+    skew      = Histogram ();
+    send_skew = Histogram ();
+
+    StopGuard guard;
+
+    fprintf ( out, "tick,time" );
+    for ( auto &column : columns ) {
+        const char *name = column.device->name.c_str ();
+        fprintf ( out, ",%s_sent,%s_received,%s_voltage,%s_current,%s_mode", name, name, name, name, name );
+    }
+    fprintf ( out, "\n" );
+
+    int64_t start = hcs_monotonic_ns ();
+    first = last = start;
+    Ticker ticker ( interval );
+    while ( ( count == 0 || ticks < count ) && ticker.wait ( nullptr ) ) {
+        int64_t tick = hcs_monotonic_ns ();
+        session.execute ( devices, PSU::Operation::SNAPSHOT, 0.0f, fields );
+        if ( ticks == 0 ) {
+            first = tick;
+        }
+        last = tick;
+
+        fprintf ( out, "%lu,%.6f", ticks, ( tick - start ) / 1e9 );
+        int64_t sample_min = 0, sample_max = 0, sent_min = 0, sent_max = 0;
+        bool    any        = false;
+        int     n          = 0;
+        for ( auto &column : columns ) {
+            Session::Device *device = column.device;
+            if ( !device->error.empty () ) {
+                column.failed++;
+                fprintf ( out, ",,,,," );
+                continue;
+            }
+            int64_t sent     = device->channel.get_last_sent ();
+            int64_t received = device->channel.get_last_completed ();
+            int64_t sample   = sent + ( received - sent ) / 2;
+            const PSU::Snapshot &s = device->snapshot;
+            fprintf ( out, ",%.6f,%.6f,%.3f,%.3f,%s", ( sent - start ) / 1e9, ( received - start ) / 1e9,
+                      s.voltage_actual, s.current_actual, device->psu->get_mode_str ( s.mode ) );
+            column.samples++;
+            column.round_trip += received - sent;
+            if ( !any || sample < sample_min ) {
+                sample_min = sample;
+            }
+            if ( !any || sample > sample_max ) {
+                sample_max = sample;
+            }
+            if ( !any || sent < sent_min ) {
+                sent_min = sent;
+            }
+            if ( !any || sent > sent_max ) {
+                sent_max = sent;
+            }
+            any = true;
+            n++;
+        }
+        fprintf ( out, "\n" );
+        if ( n > 1 ) {
+            skew.add ( sample_max - sample_min );
+            send_skew.add ( sent_max - sent_min );
+        }
+        ticks++;
+        missed = ticker.get_missed ();
+    }
+    fflush ( out );
+}
+
+void Sync::print_report ( FILE *out ) const
+{
+    fprintf ( out, "Ticks:            %20lu\n", ticks );
+    if ( ticks > 1 && last > first ) {
+        fprintf ( out, "Tick rate (Hz):   %20.02f\n", ( ticks - 1 ) / ( ( last - first ) / 1e9 ) );
+    }
+    fprintf ( out, "Missed ticks:     %20lu\n", missed );
+    if ( skew.get_count () > 0 ) {
+        fprintf ( out, "Skew mean (ms):   %20.03f\n", skew.get_mean () / 1e6 );
+        fprintf ( out, "Skew p99 (ms):    %20.03f\n", skew.percentile ( 99 ) / 1e6 );
+        fprintf ( out, "Skew max (ms):    %20.03f\n", skew.get_max () / 1e6 );
+        fprintf ( out, "Send skew (ms):   %20.03f\n", send_skew.get_mean () / 1e6 );
+        fprintf ( out, "Send skew max (ms):%19.03f\n", send_skew.get_max () / 1e6 );
+    }
+    for ( auto &column : columns ) {
+        fprintf ( out, " [%2s] samples %lu, failed %lu, round trip %.03f ms\n", column.device->name.c_str (),
+                  column.samples, column.failed, column.samples > 0 ? column.round_trip / 1e6 / column.samples : 0.0 );
+    }
+}
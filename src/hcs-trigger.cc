@@ -0,0 +1,192 @@
+/**
+ *    This file is part of HCS.
+ *    Written by Qball Cow <qball@gmpclient.org> 2013-2015
+ *
+ *    HCS is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 2 of the License.
+ *
+ *    HCS is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with HCS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <iostream>
+#include <exception>
+#include <functional>
+#include <map>
+#include <vector>
+#include <string>
+#include <atomic>
+#include <thread>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <termios.h>
+#include <hcs.h>
+#include <hcs-trigger.h>
+
+#include <config.h>
+
+Trigger::Trigger( PSU *psu, const char *condition, size_t pre, size_t post ) throw ( PSUError & ) :
+    psu ( psu ), pre ( pre ), post ( post ), head ( 0 ), fired ( -1 ), done ( false )
+{
+    static const struct
+    {
+        const char *name;
+        Field      field;
+    } fields[] = {
+        { "voltage", Field::VOLTAGE },
+        { "current", Field::CURRENT },
+        { "power",   Field::POWER   },
+    };
+    bool found = false;
+    if ( strcasecmp ( condition, "cc" ) == 0 || strcasecmp ( condition, "off" ) == 0 ) {
+        field = strcasecmp ( condition, "cc" ) == 0 ? Field::CC : Field::OFF;
+        found = true;
+    }
+    for ( auto &f : fields ) {
+        size_t length = strlen ( f.name );
+        if ( found || strncmp ( condition, f.name, length ) != 0 ||
+             ( condition[length] != '>' && condition[length] != '<' ) ) {
+            continue;
+        }
+        char *p;
+        field = f.field;
+        above = condition[length] == '>';
+        level = strtof ( &condition[length + 1], &p );
+        found = p != &condition[length + 1] && *p == '\0';
+    }
+    if ( !found ) {
+        throw PSUError ( std::string ( "Invalid trigger condition: " ) + condition +
+                         ", expected voltage|current|power followed by > or < and a value, cc or off" );
+    }
+    size_t size = 1;
+    while ( size < pre + post + 1 ) {
+        size <<= 1;
+    }
+    ring.resize ( size );
+}
+
+bool Trigger::test ( const Sample &sample ) const
+{
+    float value;
+    switch ( field )
+    {
+    case Field::CC:
+        return sample.mode == PSU::OperatingMode::CC;
+    case Field::OFF:
+        return sample.mode == PSU::OperatingMode::OFF;
+    case Field::VOLTAGE:
+        value = sample.voltage;
+        break;
+    case Field::CURRENT:
+        value = sample.current;
+        break;
+    default:
+        value = sample.voltage * sample.current;
+        break;
+    }
+    return above ? value > level : value < level;
+}
+
+void Trigger::sample ()
+{
+    const uint64_t mask  = ring.size () - 1;
+    uint64_t       n     = 0;
+    // Only a change into the condition fires, not a state it is already in.
+    bool           armed = false;
+    PSU::Snapshot  snapshot;
+    try {
+        while ( !hcs_stopped () ) {
+            psu->read_snapshot ( snapshot, PSU::SNAPSHOT_VOLTAGE_ACTUAL | PSU::SNAPSHOT_CURRENT_ACTUAL | PSU::SNAPSHOT_MODE );
+            Sample &sample = ring[n & mask];
+            sample.time    = hcs_monotonic_ns ();
+            sample.voltage = snapshot.voltage_actual;
+            sample.current = snapshot.current_actual;
+            sample.mode    = snapshot.mode;
+            head.store ( ++n, std::memory_order_release );
+            int64_t at = fired.load ( std::memory_order_relaxed );
+            if ( at < 0 ) {
+                bool hit = test ( sample );
+                if ( armed && hit ) {
+                    fired.store ( n - 1, std::memory_order_release );
+                }
+                armed = armed || !hit;
+            }
+            else if ( (int64_t) n - at > (int64_t) post ) {
+                break;
+            }
+        }
+    } catch ( PSUError &e ) {
+        error = e.what ();
+    }
+    done.store ( true, std::memory_order_release );
+}
+
+bool Trigger::run ( FILE *out ) throw ( PSUError & )
+{
+    StopGuard guard;
+
+    head      = 0;
+    fired     = -1;
+    done      = false;
+    triggered = false;
+    error.clear ();
+    start = hcs_monotonic_ns ();
+    std::thread thread ( &Trigger::sample, this );
+    // Nothing to do here until the thread is done, check now and then.
+    struct timespec ts = { 0, 10000000L };
+    while ( !done.load ( std::memory_order_acquire ) ) {
+        nanosleep ( &ts, NULL );
+    }
+    thread.join ();
+    if ( !error.empty () ) {
+        throw PSUError ( error );
+    }
+
+    uint64_t n    = head.load ( std::memory_order_acquire );
+    int64_t  at   = fired.load ( std::memory_order_acquire );
+    uint64_t mask = ring.size () - 1;
+    if ( n > 0 ) {
+        end = ring[( n - 1 ) & mask].time;
+    }
+    if ( at < 0 ) {
+        return false;
+    }
+    triggered      = true;
+    trigger_sample = ring[at & mask];
+    // The ring holds pre + post + 1 samples at least, none of these are overwritten.
+    uint64_t first = (uint64_t) at > pre ? at - pre : 0;
+    fprintf ( out, "sample,time,voltage,current,power,mode\n" );
+    for ( uint64_t i = first; i < n; i++ ) {
+        const Sample &sample = ring[i & mask];
+        fprintf ( out, "%lld,%.6f,%.3f,%.3f,%.3f,%s\n", (long long) ( (int64_t) i - at ),
+                  ( sample.time - trigger_sample.time ) / 1e9, sample.voltage, sample.current,
+                  sample.voltage * sample.current, psu->get_mode_str ( sample.mode ) );
+    }
+    fflush ( out );
+    return true;
+}
+
+void Trigger::print_report ( FILE *out ) const
+{
+    uint64_t n = head.load ();
+    fprintf ( out, "Samples:          %20llu\n", (unsigned long long) n );
+    if ( n > 1 && end > start ) {
+        fprintf ( out, "Sample rate (Hz): %20.02f\n", n / ( ( end - start ) / 1e9 ) );
+    }
+    if ( !triggered ) {
+        fprintf ( out, "Triggered:        %20s\n", "no" );
+        return;
+    }
+    fprintf ( out, "Triggered at (s): %20.03f\n", ( trigger_sample.time - start ) / 1e9 );
+    fprintf ( out, "Voltage:          %20.03f\n", trigger_sample.voltage );
+    fprintf ( out, "Current:          %20.03f\n", trigger_sample.current );
+    fprintf ( out, "Mode:             %20s\n", psu->get_mode_str ( trigger_sample.mode ) );
+}
@@ -21,39 +21,145 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <time.h>
 #include <termios.h>
 #include <sys/signal.h>
 #include <sys/types.h>
 #include <string.h>
 #include <string>
 #include <errno.h>
+#include <math.h>
 #include <readline/readline.h>
 
 #include <vector>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <map>
+#include <deque>
+#include <functional>
+#include <memory>
 #include <config.h>
 
-
-#ifdef HAVE_LIBUDEV_H
-#include <libudev.h>
-#endif
-
 #include <hcs.h>
+#include <hcs-channel.h>
+#include <hcs-session.h>
+#include <hcs-cache.h>
+#include <hcs-pacing.h>
 #include <hcs-ea.h>
 #include <hcs-pps.h>
+#include <hcs-monitor.h>
+#include <hcs-capture.h>
+#include <hcs-registry.h>
+#include <hcs-daemon.h>
+#include <hcs-bench.h>
+#include <hcs-sequence.h>
+#include <hcs-command.h>
+#include <hcs-script.h>
+#include <hcs-power.h>
+#include <hcs-trigger.h>
+#include <hcs-energy.h>
+#include <hcs-shm.h>
+#include <hcs-publish.h>
+#include <hcs-metrics.h>
+#include <hcs-sync.h>
 
-void PSU::open_device ()
+bool PSU::refresh_cache = false;
+
+// Lock free, so it can be set from a signal handler and read from a sampling thread.
+static std::atomic<bool> hcs_stop_flag ( false );
+// Nesting depth of StopGuard and the SIGINT handler the outermost one replaced.
+static unsigned int      hcs_stop_depth = 0;
+static struct sigaction  hcs_stop_old_sa;
+
+static void hcs_stop_sigint ( int sig )
+{
+    hcs_stop_flag = true;
+}
+
+void hcs_stop ( void )
+{
+    hcs_stop_flag = true;
+}
+
+bool hcs_stopped ( void )
+{
+    return hcs_stop_flag.load ( std::memory_order_relaxed );
+}
+
+StopGuard::StopGuard()
 {
-    if ( getenv ( "HCS_DEVICE" ) == nullptr ) {
-        open_device ( MODEMDEVICE );
+    if ( hcs_stop_depth++ > 0 ) {
+        return;
     }
-    else{
-        const char *path = getenv ( "HCS_DEVICE" );
-        open_device ( path );
+    struct sigaction sa;
+    memset ( &sa, 0, sizeof ( sa ) );
+    sa.sa_handler = hcs_stop_sigint;
+    sigemptyset ( &sa.sa_mask );
+    hcs_stop_flag = false;
+    sigaction ( SIGINT, &sa, &hcs_stop_old_sa );
+}
+
+StopGuard::~StopGuard()
+{
+    if ( --hcs_stop_depth > 0 ) {
+        return;
     }
+    sigaction ( SIGINT, &hcs_stop_old_sa, NULL );
+}
+
+Ticker::Ticker( int64_t interval ) : interval ( interval ), deadline ( hcs_monotonic_ns () )
+{
+}
+
+bool Ticker::wait ( PSU *psu )
+{
+    if ( interval <= 0 ) {
+        return !hcs_stopped ();
+    }
+    if ( ticks++ > 0 ) {
+        deadline += interval;
+        // A tick less than an interval late still runs, late. Only whole intervals are skipped.
+        int64_t now  = hcs_monotonic_ns ();
+        int64_t skip = now > deadline ? ( now - deadline ) / interval : 0;
+        if ( skip > 0 ) {
+            missed   += skip;
+            deadline += skip * interval;
+        }
+    }
+    struct timespec ts     = { (time_t) ( deadline / 1000000000LL ), (long) ( deadline % 1000000000LL ) };
+    int64_t         before = hcs_monotonic_ns ();
+    while ( clock_nanosleep ( CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL ) == EINTR && !hcs_stopped () ) {
+        ;
+    }
+    int64_t now = hcs_monotonic_ns ();
+    if ( psu != nullptr ) {
+        psu->get_stats ().sleep += now - before;
+    }
+    lateness = now - deadline;
+    return !hcs_stopped ();
+}
+
+const char *const PSU::OperatingModeStr[3] = {
+    "Off",
+    "CV",
+    "CC"
+};
+
+const char *PSU::get_default_device ()
+{
+    const char *path = getenv ( "HCS_DEVICE" );
+    return path != nullptr ? path : MODEMDEVICE;
+}
+void PSU::open_device ()
+{
+    open_device ( get_default_device () );
 }
 void PSU::open_device ( const char *dev_node ) throw ( PSUError & )
 {
     fd = open ( dev_node, O_RDWR | O_NOCTTY );
+    device_node = dev_node;
     if ( fd < 0 ) {
         printf ( "failed: %s\n", strerror ( errno ) );
         // TODO: THROW error
@@ -88,20 +194,192 @@ void PSU::close_device ()
     tcsetattr ( fd, TCSANOW, &oldtio );
     close ( fd );
 }
+void PSU::read_deadline ( uint8_t *buffer, size_t size, int64_t deadline ) throw ( PSUError & )
+{
+    size_t received = 0;
+    while ( received < size ) {
+        int64_t remaining = deadline - hcs_monotonic_ns ();
+        if ( remaining <= 0 ) {
+            stats.timeouts++;
+            std::stringstream ss;
+            ss << "Timeout waiting for reply: received " << received << " out of " << size << " bytes";
+            throw PSUError ( ss.str () );
+        }
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        // Round up, so we do not spin on the last partial millisecond.
+        int64_t       before = hcs_monotonic_ns ();
+        int           rv     = poll ( &pfd, 1, ( remaining + 999999 ) / 1000000 );
+        stats.io_wait += hcs_monotonic_ns () - before;
+        if ( rv < 0 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            throw PSUError ( std::string ( "Failed to wait for reply: " ) + strerror ( errno ) );
+        }
+        if ( rv == 0 ) {
+            continue;
+        }
+        ssize_t r = read ( fd, &buffer[received], size - received );
+        if ( r < 0 ) {
+            if ( errno == EINTR || errno == EAGAIN ) {
+                continue;
+            }
+            throw PSUError ( std::string ( "Failed to read reply: " ) + strerror ( errno ) );
+        }
+        if ( r == 0 ) {
+            throw PSUError ( "Failed to read reply: device closed" );
+        }
+        received         += r;
+        stats.reads++;
+        stats.bytes_read += r;
+    }
+}
+void PSU::read_snapshot ( Snapshot &snapshot, unsigned int fields ) throw( PSUError & )
+{
+    if ( fields & SNAPSHOT_VOLTAGE ) {
+        snapshot.voltage = this->get_voltage ();
+    }
+    if ( fields & SNAPSHOT_CURRENT ) {
+        snapshot.current = this->get_current ();
+    }
+    if ( fields & SNAPSHOT_VOLTAGE_ACTUAL ) {
+        snapshot.voltage_actual = this->get_voltage_actual ();
+    }
+    if ( fields & SNAPSHOT_CURRENT_ACTUAL ) {
+        snapshot.current_actual = this->get_current_actual ();
+    }
+    if ( fields & SNAPSHOT_OVER_VOLTAGE ) {
+        snapshot.over_voltage = this->get_over_voltage ();
+    }
+    if ( fields & SNAPSHOT_OVER_CURRENT ) {
+        snapshot.over_current = this->get_over_current ();
+    }
+    if ( fields & SNAPSHOT_MODE ) {
+        snapshot.mode = this->get_operating_mode ();
+    }
+    // Default resolution is 1mV and 1mA.
+    snapshot.voltage_actual_raw = lroundf ( snapshot.voltage_actual * 1000.0f );
+    snapshot.current_actual_raw = lroundf ( snapshot.current_actual * 1000.0f );
+    snapshot.fields            |= fields;
+    remember ( snapshot );
+}
+void PSU::remember ( const Snapshot &snapshot )
+{
+    if ( snapshot.fields == 0 ) {
+        return;
+    }
+    if ( snapshot.fields & SNAPSHOT_VOLTAGE ) {
+        last_snapshot.voltage = snapshot.voltage;
+    }
+    if ( snapshot.fields & SNAPSHOT_CURRENT ) {
+        last_snapshot.current = snapshot.current;
+    }
+    if ( snapshot.fields & SNAPSHOT_VOLTAGE_ACTUAL ) {
+        last_snapshot.voltage_actual     = snapshot.voltage_actual;
+        last_snapshot.voltage_actual_raw = snapshot.voltage_actual_raw;
+    }
+    if ( snapshot.fields & SNAPSHOT_CURRENT_ACTUAL ) {
+        last_snapshot.current_actual     = snapshot.current_actual;
+        last_snapshot.current_actual_raw = snapshot.current_actual_raw;
+    }
+    if ( snapshot.fields & SNAPSHOT_OVER_VOLTAGE ) {
+        last_snapshot.over_voltage = snapshot.over_voltage;
+    }
+    if ( snapshot.fields & SNAPSHOT_OVER_CURRENT ) {
+        last_snapshot.over_current = snapshot.over_current;
+    }
+    if ( snapshot.fields & SNAPSHOT_MODE ) {
+        last_snapshot.mode = snapshot.mode;
+    }
+    last_snapshot.fields |= snapshot.fields;
+    last_snapshot_time    = hcs_monotonic_ns ();
+}
+void PSU::get_identity ( Identity &identity ) throw( PSUError & )
+{
+}
+size_t PSU::reply_length ( const uint8_t *buffer, size_t size ) const
+{
+    return 0;
+}
+void PSU::queue_operation ( Channel &channel, Operation op, float value,
+                            Snapshot *snapshot, unsigned int fields ) throw( PSUError & )
+{
+    throw PSUError ( "Current feature is not supported for this power supply" );
+}
 void PSU::print_device_info () throw( PSUError & )
 {
+    Snapshot snapshot;
+    this->read_snapshot ( snapshot );
+
+    printf ( " Set OVP:          %20.02f\n", snapshot.over_voltage );
+    printf ( " Set OCP:          %20.02f\n", snapshot.over_current );
+    printf ( " Set voltage:      %20.02f\n", snapshot.voltage );
+    printf ( " Set current:      %20.02f\n", snapshot.current );
+    printf ( " Current voltage:  %20.02f\n", snapshot.voltage_actual );
+    printf ( " Current current:  %20.02f\n", snapshot.current_actual );
+    printf ( " Current power:    %20.02f\n", snapshot.voltage_actual * snapshot.current_actual );
+    printf ( " Current mode:     %20s\n", get_mode_str ( snapshot.mode ) );
+}
+void PSU::print_stats ( FILE *out ) const
+{
+    double uptime = ( hcs_monotonic_ns () - stats.start ) / 1e9;
+    fprintf ( out, " Device:           %20s\n", device_node.c_str () );
+    fprintf ( out, " Uptime (s):       %20.03f\n", uptime );
+    fprintf ( out, " Transactions:     %20lu\n", stats.transactions );
+    fprintf ( out, " Failed:           %20lu\n", stats.failed );
+    fprintf ( out, " Timeouts:         %20lu\n", stats.timeouts );
+    fprintf ( out, " CRC errors:       %20lu\n", stats.crc_errors );
+    fprintf ( out, " Retries:          %20lu\n", stats.retries );
+    fprintf ( out, " Resyncs:          %20lu\n", stats.resyncs );
+    for ( auto &error : stats.device_errors ) {
+        fprintf ( out, " Device error %-4d:%20lu %s\n", error.first, error.second,
+                  get_device_error_str ( error.first ) );
+    }
+    fprintf ( out, " Bytes written:    %20lu\n", stats.bytes_written );
+    fprintf ( out, " Bytes read:       %20lu\n", stats.bytes_read );
+    fprintf ( out, " Reads/transaction:%20.02f\n",
+              stats.transactions > 0 ? stats.reads / (double) stats.transactions : 0.0 );
+    fprintf ( out, " I/O wait (s):     %20.03f\n", stats.io_wait / 1e9 );
+    fprintf ( out, " Sleep (s):        %20.03f\n", stats.sleep / 1e9 );
+    print_pacing ( out );
+}
+void PSU::write_stats_json ( FILE *out ) const
+{
+    // Device nodes are paths, escape what JSON does not allow in a string.
+    std::string node;
+    for ( char c : device_node ) {
+        if ( c == '"' || c == '\\' ) {
+            node.push_back ( '\\' );
+        }
+        if ( (unsigned char) c >= 0x20 ) {
+            node.push_back ( c );
+        }
+    }
+    fprintf ( out, "{\"device\":\"%s\",\"uptime\":%.3f,\"transactions\":%lu,\"failed\":%lu,"
+              "\"timeouts\":%lu,\"crc_errors\":%lu,\"retries\":%lu,\"resyncs\":%lu,\"device_errors\":{",
+              node.c_str (), ( hcs_monotonic_ns () - stats.start ) / 1e9, stats.transactions,
+              stats.failed, stats.timeouts, stats.crc_errors, stats.retries, stats.resyncs );
+    const char *separator = "";
+    for ( auto &error : stats.device_errors ) {
+        // By code, the names are not JSON safe.
+        fprintf ( out, "%s\"%d\":%lu", separator, error.first, error.second );
+        separator = ",";
+    }
+    fprintf ( out, "},\"bytes_written\":%lu,\"bytes_read\":%lu,\"reads\":%lu,"
+              "\"io_wait\":%.6f,\"sleep\":%.6f}",
+              stats.bytes_written, stats.bytes_read, stats.reads, stats.io_wait / 1e9, stats.sleep / 1e9 );
+}
 
-    printf ( " Set OVP:          %20.02f\n", this->get_over_voltage () );
-    printf ( " Set OCP:          %20.02f\n", this->get_over_current () );
-    printf ( " Set voltage:      %20.02f\n", this->get_voltage () );
-    printf ( " Set current:      %20.02f\n", this->get_current () );
-    auto volt = this->get_voltage_actual ();
-    auto curr = this->get_current_actual ();
-    printf ( " Current voltage:  %20.02f\n", volt );
-    printf ( " Current current:  %20.02f\n", curr );
-    printf ( " Current power:    %20.02f\n", volt * curr );
-    printf ( " Current mode:     %20s\n", get_mode_str ( this->get_operating_mode () ) );
+// Line handed over by the readline callback interface.
+static char *interactive_line      = NULL;
+static bool interactive_have_line = false;
 
+static void interactive_handler ( char *line )
+{
+    interactive_line      = line;
+    interactive_have_line = true;
+    // Remove it here, otherwise readline shows the prompt again right away.
+    rl_callback_handler_remove ();
 }
 
 /**
@@ -110,13 +388,56 @@ void PSU::print_device_info () throw( PSUError & )
 class HCS
 {
 private:
-    int            fd = 0;
-    struct termios oldtio;
-    PSU            *power_supply = nullptr;
+    int             fd = 0;
+    struct termios  oldtio;
+    PSU             *power_supply = nullptr;
+    // Where and how monitor writes its samples, empty log_file is stdout.
+    std::string     log_file;
+    Monitor::Format log_format = Monitor::Format::CSV;
+    // Devices opened with 'open', and the device(s) commands go to when set.
+    Session         session;
+    std::string     target;
+    // Exporter of the state of the open devices, when enabled.
+    std::unique_ptr<Metrics> metrics;
+
+    /**
+     * @param render Rebuild the exported page too.
+     *
+     * Point the exporter at the devices that are open now.
+     */
+    void update_metrics ( bool render )
+    {
+        if ( !metrics ) {
+            return;
+        }
+        std::vector<PSU *> psus;
+        if ( power_supply != nullptr ) {
+            psus.push_back ( power_supply );
+        }
+        for ( auto device : session.get_devices () ) {
+            psus.push_back ( device->psu );
+        }
+        metrics->set_devices ( psus );
+        if ( render ) {
+            metrics->update ( true );
+        }
+    }
 
 public:
     ~HCS()
     {
+        // Keep the counters of the run, when asked for.
+        const char *stats_file = getenv ( "HCS_STATS_FILE" );
+        if ( stats_file != nullptr && ( power_supply != nullptr || !session.empty () ) ) {
+            FILE *out = fopen ( stats_file, "w" );
+            if ( out != nullptr ) {
+                write_stats_json ( out );
+                fclose ( out );
+            }
+            else {
+                fprintf ( stderr, "Failed to write stats to \"%s\": '%s'\n", stats_file, strerror ( errno ) );
+            }
+        }
         if ( power_supply != nullptr ) {
             delete power_supply;
             power_supply = nullptr;
@@ -125,6 +446,52 @@ public:
 
     HCS()
     {
+        registry.on_add = [this] ( const DeviceRegistry::Entry &entry ) {
+                              device_added ( entry );
+                          };
+        registry.on_remove = [this] ( const DeviceRegistry::Entry &entry ) {
+                                 device_removed ( entry );
+                             };
+    }
+
+    /**
+     * @param prompt The prompt to show.
+     *
+     * Like readline (), but keeps processing device hotplug events while waiting.
+     *
+     * @returns the line read, NULL on end of input.
+     */
+    char *read_line ( const char *prompt )
+    {
+        interactive_have_line = false;
+        rl_callback_handler_install ( prompt, interactive_handler );
+        prompt_active = true;
+        while ( !interactive_have_line ) {
+            struct pollfd fds[2] = {
+                { fileno ( stdin ), POLLIN, 0 },
+                // Ignored by poll when -1.
+                { registry.get_fd (), POLLIN, 0 }
+            };
+            if ( poll ( fds, 2, -1 ) < 0 ) {
+                if ( errno == EINTR ) {
+                    continue;
+                }
+                rl_callback_handler_remove ();
+                interactive_line = NULL;
+                break;
+            }
+            if ( fds[1].revents & POLLIN ) {
+                if ( registry.update () ) {
+                    rl_on_new_line ();
+                    rl_redisplay ();
+                }
+            }
+            if ( fds[0].revents & ( POLLIN | POLLHUP | POLLERR ) ) {
+                rl_callback_read_char ();
+            }
+        }
+        prompt_active = false;
+        return interactive_line;
     }
 
     /**
@@ -133,7 +500,7 @@ public:
     int interactive ()
     {
         while ( TRUE ) {
-            char *message = readline ( "> " );
+            char *message = read_line ( "> " );
 
             if ( message == NULL ) {
                 break;
@@ -159,12 +526,17 @@ public:
                     argc++;
                 }
 
-                for ( int i = 0; i < argc; i++ ) {
-                    int retv = this->parse_command ( argc - i, &argv[i] );
-                    if ( retv < 0 ) {
-                        return EXIT_FAILURE;
+                int status;
+                if ( !forward ( argc, argv, status ) ) {
+                    for ( int i = 0; i < argc; i++ ) {
+                        int retv = this->parse_command ( argc - i, &argv[i] );
+                        update_metrics ( true );
+                        if ( retv < 0 ) {
+                            // Skip the rest of the line, the session goes on.
+                            break;
+                        }
+                        i += retv;
                     }
-                    i += retv;
                 }
 
                 if ( argv ) {
@@ -179,140 +551,535 @@ public:
     }
     int parse_command ( int argc, char **argv )
     {
-        int        index    = 0;
-        const char *command = argv[0];
         try {
-            if ( strncmp ( command, "auto", 4 ) == 0 ) {
+            Command command = Command::parse ( argc, argv );
+            execute ( command );
+            return command.get_words () - 1;
+        }catch ( PSUError error ) {
+            std::cerr << "Parse command failed: " << error.what () << std::endl;
+            return -1;
+        }
+    }
+
+    /**
+     * Run a parsed command: on the target devices when set, else on the power supply.
+     */
+    void execute ( const Command &command ) throw ( PSUError & )
+    {
+        // Catch up on hotplug events, once devices are being tracked.
+        if ( registry.get_fd () >= 0 ) {
+            registry.update ();
+        }
+        update_metrics ( false );
+        switch ( command.get_id () )
+        {
+        case Command::Id::AUTO:
+        {
+            // Get list of connected devices.
+            detect_devices ();
+            // Autoconnect.
+            size_t dev_num = command.get_count ( 0, 0 );
+            if ( psu_list.size () > dev_num ) {
+                auto &psu = psu_list[dev_num];
+                if ( is_connected ( psu.type, psu.device_name ) ) {
+                    return;
+                }
                 if ( power_supply != nullptr ) {
                     delete power_supply;
                     power_supply = nullptr;
                 }
-                // Get list of connected devices.
-                detect_devices ();
-                int dev_num = 0;
-                // Autoconnect.
-                if ( argc > ( index + 1 ) ) {
-                    char *p;
-                    int  val = strtol ( argv[1], &p, 10 );
-                    if ( p != argv[1] ) {
-                        dev_num = val;
-                        index++;
-                    }
-                }
-                if ( psu_list.size () > dev_num ) {
-                    auto &psu = psu_list[dev_num];
-                    if ( power_supply != nullptr ) {
-                        delete power_supply;
-                        power_supply = nullptr;
-                    }
-                    power_supply = psu.connect ();
-                }
-                else {
-                    fprintf ( stderr, "No device available to open.\n" );
-                }
+                power_supply = psu.connect ();
             }
-            else if ( strncmp ( command, "pps", 3 ) == 0 ) {
+            else {
                 if ( power_supply != nullptr ) {
                     delete power_supply;
+                    power_supply = nullptr;
                 }
-                power_supply = new PPS11360 ();
-                power_supply->open_device ();
+                fprintf ( stderr, "No device available to open.\n" );
             }
-            else if ( strncmp ( command, "eaps", 4 ) == 0 ) {
-                if ( power_supply != nullptr ) {
-                    delete power_supply;
-                }
-                power_supply = new EAPS2K ();
-                power_supply->open_device ();
+            break;
+        }
+        case Command::Id::PPS:
+            if ( is_connected ( PSU::PSUTypes::PPS11360, PSU::get_default_device () ) ) {
+                return;
             }
-            else if ( strncmp ( command, "list", 4 ) == 0 ) {
-                // Find devices.
-                detect_devices ();
-                printf ( "Found %zd power suppl%s:\n", psu_list.size (), ( psu_list.size () == 1 ) ? "y" : "ies" );
-                int index = 0;
-                for ( auto psu : psu_list ) {
-                    printf ( " [%2d] %s at '%s'\n",
-                             index,
-                             psu.type == PSU::PSUTypes::EAPS2K ? "Elektro-Automatik" : "Voltcraft",
-                             psu.device_name );
-                    index++;
-                }
+            if ( power_supply != nullptr ) {
+                delete power_supply;
             }
-            else if ( power_supply != nullptr ) {
-                if ( strncmp ( command, "status", 6 ) == 0 ) {
-                    power_supply->print_device_info ();
+            power_supply = new PPS11360 ();
+            power_supply->open_device ();
+            break;
+        case Command::Id::EAPS:
+            if ( is_connected ( PSU::PSUTypes::EAPS2K, PSU::get_default_device () ) ) {
+                return;
+            }
+            if ( power_supply != nullptr ) {
+                delete power_supply;
+            }
+            power_supply = new EAPS2K ();
+            power_supply->open_device ();
+            break;
+        case Command::Id::LIST:
+        {
+            // Find devices.
+            detect_devices ();
+            printf ( "Found %zd power suppl%s:\n", psu_list.size (), ( psu_list.size () == 1 ) ? "y" : "ies" );
+            int index = 0;
+            for ( auto psu : psu_list ) {
+                printf ( " [%2d] %s at '%s'\n",
+                         index,
+                         psu.type == PSU::PSUTypes::EAPS2K ? "Elektro-Automatik" : "Voltcraft",
+                         psu.device_name );
+                index++;
+            }
+            break;
+        }
+        case Command::Id::REFRESH:
+            // Applies to the devices opened after this.
+            PSU::set_refresh_cache ( true );
+            break;
+        case Command::Id::FORMAT:
+            if ( command.has ( 0 ) && !Monitor::parse_format ( command.get_word ( 0 ), log_format ) ) {
+                throw PSUError ( std::string ( "Unknown format: " ) + command.get_word ( 0 ) );
+            }
+            break;
+        case Command::Id::LOGFILE:
+            if ( command.has ( 0 ) ) {
+                // '-' goes back to stdout.
+                log_file = strcmp ( command.get_word ( 0 ), "-" ) == 0 ? "" : command.get_word ( 0 );
+            }
+            break;
+        case Command::Id::METRICS:
+            if ( command.has ( 0 ) ) {
+                const char *value = command.get_word ( 0 );
+                // Stop the old one first, it may hold the port.
+                metrics.reset ();
+                if ( strcmp ( value, "none" ) != 0 ) {
+                    metrics = std::unique_ptr<Metrics> ( new Metrics ( value ) );
                 }
-                else if ( strncmp ( command, "on", 2 ) == 0 ) {
-                    power_supply->state_enable ();
+            }
+            else if ( metrics ) {
+                printf ( "%s\n", metrics->get_target ().c_str () );
+            }
+            break;
+        case Command::Id::DECODE:
+        {
+            CaptureReader reader ( command.get_word ( 0 ) );
+            FILE          *out = stdout;
+            if ( !log_file.empty () ) {
+                out = fopen ( log_file.c_str (), "w" );
+                if ( out == nullptr ) {
+                    throw PSUError ( "Failed to open \"" + log_file + "\": '" + strerror ( errno ) + "'" );
                 }
-                else if ( strncmp ( command, "off", 3 ) == 0 ) {
-                    power_supply->state_disable ();
+            }
+            unsigned long samples = 0;
+            try {
+                samples = reader.export_csv ( out );
+            } catch ( PSUError &error ) {
+                if ( out != stdout ) {
+                    fclose ( out );
                 }
-                else if ( strncmp ( command, "ovp", 3 ) == 0 ) {
-                    if ( argc > ( index + 1 ) ) {
-                        // write
-                        const char *value = argv[++index];
-                        float      volt   = strtof ( value, nullptr );
-                        power_supply->set_over_voltage ( volt );
+                throw;
+            }
+            if ( out != stdout ) {
+                fclose ( out );
+            }
+            const CaptureHeader &header = reader.get_header ();
+            fprintf ( stderr, "Decoded %lu samples of %.32s %.32s\n", samples, header.type, header.serial );
+            break;
+        }
+        case Command::Id::OPEN:
+            session.clear ();
+            target.clear ();
+            if ( command.has ( 0 ) ) {
+                // Explicit list: type:device[,type:device...]
+                psu_list.clear ();
+                std::stringstream list ( command.get_word ( 0 ) );
+                std::string       item;
+                while ( std::getline ( list, item, ',' ) ) {
+                    size_t colon = item.find ( ':' );
+                    if ( colon == std::string::npos ) {
+                        throw PSUError ( "Expected type:device, got: " + item );
                     }
-                    else{
-                        float voltage = power_supply->get_over_voltage ();
-                        printf ( "%.2f\n", voltage );
+                    std::string type = item.substr ( 0, colon );
+                    if ( type == "eaps" ) {
+                        psu_list.push_back ( PSU_dev ( PSU::PSUTypes::EAPS2K, item.substr ( colon + 1 ).c_str () ) );
                     }
-                }
-                else if ( strncmp ( command, "ocp", 3 ) == 0 ) {
-                    if ( argc > ( index + 1 ) ) {
-                        // write
-                        const char *value = argv[++index];
-                        float      curr   = strtof ( value, nullptr );
-                        power_supply->set_over_current ( curr );
+                    else if ( type == "pps" ) {
+                        psu_list.push_back ( PSU_dev ( PSU::PSUTypes::PPS11360, item.substr ( colon + 1 ).c_str () ) );
                     }
-                    else{
-                        float current = power_supply->get_over_current ();
-                        printf ( "%.2f\n", current );
+                    else {
+                        throw PSUError ( "Unknown power supply type: " + type );
                     }
                 }
-                else if ( strncmp ( command, "mode", 4 ) == 0 ) {
-                    printf ( "%s", power_supply->get_mode_str ( power_supply->get_operating_mode () ) );
+            }
+            else {
+                detect_devices ();
+            }
+            for ( size_t i = 0; i < psu_list.size (); i++ ) {
+                try {
+                    session.add ( std::to_string ( i ), psu_list[i].connect () );
+                } catch ( PSUError &error ) {
+                    fprintf ( stderr, " [%2zu] %s: %s\n", i, psu_list[i].device_name, error.what () );
                 }
-                else if ( strncmp ( command, "voltage", 7 ) == 0 ) {
-                    if ( argc > ( index + 1 ) ) {
-                        // write
-                        const char *value = argv[++index];
-                        float      volt   = strtof ( value, nullptr );
-                        power_supply->set_voltage ( volt );
-                    }
-                    else{
-                        float voltage;
-                        // read
-                        voltage = power_supply->get_voltage_actual ();
-                        printf ( "%.2f\n", voltage );
-                    }
+            }
+            printf ( "Opened %zd power suppl%s\n", session.get_devices ().size (),
+                     ( session.get_devices ().size () == 1 ) ? "y" : "ies" );
+            if ( !session.empty () ) {
+                target = "all";
+            }
+            break;
+        case Command::Id::GROUP:
+            session.add_group ( command.get_word ( 0 ), command.get_word ( 1 ) );
+            break;
+        case Command::Id::TARGET:
+            if ( command.has ( 0 ) ) {
+                const char *value = command.get_word ( 0 );
+                if ( strcmp ( value, "none" ) == 0 ) {
+                    target.clear ();
+                }
+                else {
+                    // Check it exists.
+                    session.resolve ( value );
+                    target = value;
+                }
+            }
+            else {
+                printf ( "%s\n", target.empty () ? "none" : target.c_str () );
+            }
+            break;
+        case Command::Id::STATS:
+            if ( command.has ( 0 ) ) {
+                write_stats_json ( stdout );
+            }
+            else {
+                print_stats ( stdout );
+            }
+            break;
+        case Command::Id::SCRIPT:
+        {
+            // Compiling checks the whole script before anything runs.
+            Script script ( command.get_word ( 0 ) );
+            script.run ( [this] () {
+                             return target.empty () ? power_supply : nullptr;
+                         },
+                         [this] ( const Command &command ) {
+                             execute ( command );
+                         } );
+            break;
+        }
+        default:
+            if ( !target.empty () ) {
+                execute_session ( command );
+            }
+            else if ( power_supply != nullptr ) {
+                execute_device ( command );
+            }
+            else {
+                throw PSUError ( std::string ( "No power supply selected for " ) + command.get_name () );
+            }
+            break;
+        }
+    }
+
+    /**
+     * Run a command on the power supply.
+     */
+    void execute_device ( const Command &command ) throw ( PSUError & )
+    {
+        switch ( command.get_id () )
+        {
+        case Command::Id::STATUS:
+            power_supply->print_device_info ();
+            break;
+        case Command::Id::ON:
+            power_supply->state_enable ();
+            break;
+        case Command::Id::OFF:
+            power_supply->state_disable ();
+            break;
+        case Command::Id::OVP:
+            if ( command.has ( 0 ) ) {
+                power_supply->set_over_voltage ( command.get_number ( 0 ) );
+            }
+            else{
+                float voltage = power_supply->get_over_voltage ();
+                printf ( "%.2f\n", voltage );
+            }
+            break;
+        case Command::Id::OCP:
+            if ( command.has ( 0 ) ) {
+                power_supply->set_over_current ( command.get_number ( 0 ) );
+            }
+            else{
+                float current = power_supply->get_over_current ();
+                printf ( "%.2f\n", current );
+            }
+            break;
+        case Command::Id::MONITOR:
+        {
+            // Optional interval (in seconds) and number of samples.
+            double        interval = command.get_number ( 0, 0.0 );
+            unsigned long count    = command.get_count ( 1, 0 );
+            if ( log_format == Monitor::Format::CAPTURE ) {
+                if ( log_file.empty () ) {
+                    throw PSUError ( "The capture format needs a logfile" );
+                }
+                PSU::Identity identity;
+                power_supply->get_identity ( identity );
+                CaptureWriter capture ( log_file.c_str (), identity );
+                Monitor       monitor ( power_supply, &capture );
+                monitor.set_metrics ( metrics.get () );
+                monitor.run ( interval * 1e9, count );
+                monitor.print_report ( stderr );
+                return;
+            }
+            FILE *out = stdout;
+            if ( !log_file.empty () ) {
+                out = fopen ( log_file.c_str (), "a" );
+                if ( out == nullptr ) {
+                    throw PSUError ( "Failed to open \"" + log_file + "\": '" + strerror ( errno ) + "'" );
                 }
-                else if ( strncmp ( command, "current", 7 ) == 0 ) {
-                    if ( argc > ( index + 1 ) ) {
-                        // write
-                        const char *value  = argv[++index];
-                        float      current = strtof ( value, nullptr );
-                        power_supply->set_current ( current );
+            }
+            Monitor monitor ( power_supply, out, log_format );
+            monitor.set_metrics ( metrics.get () );
+            try {
+                monitor.run ( interval * 1e9, count );
+            } catch ( PSUError &error ) {
+                if ( out != stdout ) {
+                    fclose ( out );
+                }
+                throw;
+            }
+            if ( out != stdout ) {
+                fclose ( out );
+            }
+            monitor.print_report ( stderr );
+            break;
+        }
+        case Command::Id::BENCH:
+        {
+            // Optional operation and number of iterations.
+            Bench bench ( power_supply );
+            bench.run ( command.get_word ( 0, "all" ), command.get_count ( 1, 100 ), stdout );
+            break;
+        }
+        case Command::Id::RAMP:
+        {
+            // ramp [voltage|current] <from> <to> <seconds> [steps] [lin|exp]
+            bool            current  = command.get_keyword ( 0 ) == 1;
+            double          duration = command.get_number ( 3 );
+            // Default to 10 steps a second.
+            unsigned int    steps    = command.get_count ( 4, duration * 10 + 1 );
+            Sequence::Shape shape    = command.get_keyword ( 5 ) == 1 ? Sequence::Shape::EXPONENTIAL : Sequence::Shape::LINEAR;
+            Sequence        sequence ( power_supply );
+            sequence.ramp ( current, command.get_number ( 1 ), command.get_number ( 2 ), duration * 1e9, steps, shape );
+            run_sequence ( sequence );
+            break;
+        }
+        case Command::Id::SEQUENCE:
+        {
+            Sequence sequence ( power_supply );
+            sequence.load ( command.get_word ( 0 ) );
+            run_sequence ( sequence );
+            break;
+        }
+        case Command::Id::CP:
+        {
+            // Optional duration (0 runs until stopped) and voltage limit.
+            ConstantPower loop ( power_supply );
+            FILE          *out = open_output ();
+            try {
+                loop.run ( command.get_number ( 0 ), command.get_number ( 1, 0.0 ) * 1e9, command.get_number ( 2, 0.0 ), out );
+            } catch ( PSUError &error ) {
+                close_output ( out );
+                throw;
+            }
+            close_output ( out );
+            loop.print_report ( stderr );
+            break;
+        }
+        case Command::Id::TRIGGER:
+        {
+            // Samples before and after the trigger.
+            Trigger trigger ( power_supply, command.get_word ( 0 ), command.get_count ( 1, 100 ), command.get_count ( 2, 100 ) );
+            FILE    *out = open_output ();
+            try {
+                trigger.run ( out );
+            } catch ( PSUError &error ) {
+                close_output ( out );
+                throw;
+            }
+            close_output ( out );
+            trigger.print_report ( stderr );
+            break;
+        }
+        case Command::Id::PUBLISH:
+        {
+            // publish [name] [interval] [count]
+            Publisher publisher ( power_supply, command.get_word ( 0 ) );
+            fprintf ( stderr, "Publishing to %s\n", publisher.get_name ().c_str () );
+            publisher.run ( command.get_number ( 1, 0.0 ) * 1e9, command.get_count ( 2, 0 ) );
+            publisher.print_report ( stderr );
+            break;
+        }
+        case Command::Id::ENERGY:
+        {
+            // energy [run [seconds]|reset]
+            Energy energy ( power_supply );
+            if ( command.get_keyword ( 0 ) == 0 ) {
+                FILE *out = open_output ();
+                try {
+                    energy.run ( command.get_number ( 1, 0.0 ) * 1e9, out );
+                } catch ( PSUError &error ) {
+                    close_output ( out );
+                    throw;
+                }
+                close_output ( out );
+                energy.print_report ( stderr );
+            }
+            else if ( command.get_keyword ( 0 ) == 1 ) {
+                energy.reset ();
+            }
+            else {
+                energy.print_totals ( stdout );
+            }
+            break;
+        }
+        case Command::Id::MODE:
+        {
+            PSU::Snapshot snapshot;
+            power_supply->read_snapshot ( snapshot, PSU::SNAPSHOT_MODE );
+            printf ( "%s\n", power_supply->get_mode_str ( snapshot.mode ) );
+            break;
+        }
+        case Command::Id::VOLTAGE:
+            if ( command.has ( 0 ) ) {
+                power_supply->set_voltage ( command.get_number ( 0 ) );
+            }
+            else{
+                PSU::Snapshot snapshot;
+                power_supply->read_snapshot ( snapshot, PSU::SNAPSHOT_VOLTAGE_ACTUAL );
+                printf ( "%.2f\n", snapshot.voltage_actual );
+            }
+            break;
+        case Command::Id::CURRENT:
+            if ( command.has ( 0 ) ) {
+                power_supply->set_current ( command.get_number ( 0 ) );
+            }
+            else{
+                PSU::Snapshot snapshot;
+                power_supply->read_snapshot ( snapshot, PSU::SNAPSHOT_CURRENT_ACTUAL );
+                printf ( "%.2f\n", snapshot.current_actual );
+            }
+            break;
+        default:
+            throw PSUError ( std::string ( command.get_name () ) + " needs devices opened with 'open'" );
+        }
+    }
+
+    /**
+     * Run a command on all devices in target at the same time.
+     */
+    void execute_session ( const Command &command ) throw ( PSUError & )
+    {
+        std::vector<Session::Device *>  targets = session.resolve ( target );
+        PSU::Operation                  op      = PSU::Operation::SNAPSHOT;
+        unsigned int                    fields  = PSU::SNAPSHOT_ALL;
+        float                           value   = command.get_number ( 0 );
+
+        switch ( command.get_id () )
+        {
+        case Command::Id::SYNC:
+        {
+            // sync [interval] [count]
+            Sync sync ( session, targets );
+            FILE *out = open_output ();
+            try {
+                sync.run ( command.get_number ( 0, 0.0 ) * 1e9, command.get_count ( 1, 0 ), out );
+            } catch ( PSUError &error ) {
+                close_output ( out );
+                throw;
+            }
+            close_output ( out );
+            sync.print_report ( stderr );
+            return;
+        }
+        case Command::Id::STATUS:
+            fields = PSU::SNAPSHOT_ALL;
+            break;
+        case Command::Id::MODE:
+            fields = PSU::SNAPSHOT_MODE;
+            break;
+        case Command::Id::ON:
+            op = PSU::Operation::STATE_ENABLE;
+            break;
+        case Command::Id::OFF:
+            op = PSU::Operation::STATE_DISABLE;
+            break;
+        default:
+        {
+            // Commands that take an optional value to set.
+            static const struct
+            {
+                Command::Id    id;
+                PSU::Operation set;
+                unsigned int   get;
+            } setters[] = {
+                { Command::Id::VOLTAGE, PSU::Operation::SET_VOLTAGE,      PSU::SNAPSHOT_VOLTAGE_ACTUAL },
+                { Command::Id::CURRENT, PSU::Operation::SET_CURRENT,      PSU::SNAPSHOT_CURRENT_ACTUAL },
+                { Command::Id::OVP,     PSU::Operation::SET_OVER_VOLTAGE, PSU::SNAPSHOT_OVER_VOLTAGE   },
+                { Command::Id::OCP,     PSU::Operation::SET_OVER_CURRENT, PSU::SNAPSHOT_OVER_CURRENT   },
+            };
+            bool found = false;
+            for ( auto &setter : setters ) {
+                if ( setter.id == command.get_id () ) {
+                    found = true;
+                    if ( command.has ( 0 ) ) {
+                        op = setter.set;
                     }
-                    else{
-                        float current;
-                        // read
-                        current = power_supply->get_current_actual ();
-                        printf ( "%.2f\n", current );
+                    else {
+                        fields = setter.get;
                     }
                 }
             }
-        }catch ( PSUError error ) {
-            std::cerr << "Parse command failed: " << error.what () << std::endl;
-            return -1;
+            if ( !found ) {
+                throw PSUError ( std::string ( "Command not supported on multiple devices: " ) + command.get_name () );
+            }
+            break;
+        }
         }
 
-        return index;
+        unsigned int failed = session.execute ( targets, op, value, fields );
+        for ( auto device : targets ) {
+            const PSU::Snapshot &s = device->snapshot;
+            if ( !device->error.empty () ) {
+                fprintf ( stderr, " [%2s] %s\n", device->name.c_str (), device->error.c_str () );
+            }
+            else if ( op != PSU::Operation::SNAPSHOT ) {
+                continue;
+            }
+            else if ( fields == PSU::SNAPSHOT_ALL ) {
+                printf ( " [%2s] set %6.2fV %6.2fA  ovp %6.2fV ocp %6.2fA  actual %6.2fV %6.2fA %7.2fW %4s\n",
+                         device->name.c_str (), s.voltage, s.current, s.over_voltage, s.over_current,
+                         s.voltage_actual, s.current_actual, s.voltage_actual * s.current_actual,
+                         device->psu->get_mode_str ( s.mode ) );
+            }
+            else if ( fields == PSU::SNAPSHOT_MODE ) {
+                printf ( " [%2s] %s\n", device->name.c_str (), device->psu->get_mode_str ( s.mode ) );
+            }
+            else {
+                float v = ( fields == PSU::SNAPSHOT_VOLTAGE_ACTUAL ) ? s.voltage_actual :
+                          ( fields == PSU::SNAPSHOT_CURRENT_ACTUAL ) ? s.current_actual :
+                          ( fields == PSU::SNAPSHOT_OVER_VOLTAGE ) ? s.over_voltage : s.over_current;
+                printf ( " [%2s] %.2f\n", device->name.c_str (), v );
+            }
+        }
+        if ( failed > 0 ) {
+            throw PSUError ( "Command failed on " + std::to_string ( failed ) + " device(s)" );
+        }
     }
 
-
     int run ( int argc, char **argv )
     {
         for ( int i = 0; i < argc; i++ ) {
@@ -322,7 +1089,21 @@ public:
                 return this->interactive ();
             }
             else{
+                // Let a running hcsd execute everything up to 'interactive'.
+                int n = i;
+                while ( n < argc && strncmp ( argv[n], "interactive", 11 ) != 0 ) {
+                    n++;
+                }
+                int status;
+                if ( forward ( n - i, &argv[i], status ) ) {
+                    if ( status != EXIT_SUCCESS ) {
+                        return status;
+                    }
+                    i = n - 1;
+                    continue;
+                }
                 int retv = this->parse_command ( argc - i, &argv[i] );
+                update_metrics ( true );
                 if ( retv < 0 ) {
                     std::cerr << "Failed to parse command" << std::endl;
                     return EXIT_FAILURE;
@@ -366,51 +1147,207 @@ private:
     void detect_devices ()
     {
         psu_list.clear ();
-#ifdef HAVE_LIBUDEV_H
-        struct udev           *ud = udev_new ();
-
-        struct udev_enumerate *enumerate = udev_enumerate_new ( ud );
-        udev_enumerate_add_match_subsystem ( enumerate, "tty" );
-        udev_enumerate_scan_devices ( enumerate );
-        struct udev_list_entry *list = udev_enumerate_get_list_entry ( enumerate );
-        struct udev_list_entry *entry;
-        udev_list_entry_foreach ( entry, list )
-        {
-            const char         *path;
-            struct udev_device *dev;
-
-
-            // Have to grab the actual udev device here...
-            path = udev_list_entry_get_name ( entry );
-            dev  = udev_device_new_from_syspath ( ud, path );
-            const char *vendor_id  = udev_device_get_property_value ( dev, "ID_VENDOR_ID" );
-            const char *product_id = udev_device_get_property_value ( dev, "ID_MODEL_ID" );
-            const char *dev_name   = udev_device_get_property_value ( dev, "DEVNAME" );
-            if ( vendor_id == nullptr || product_id == nullptr || dev_name == nullptr ) {
-                udev_device_unref ( dev );
-                continue;
-            }
-            // Types
-            if ( EAPS2K::check_supported_type ( vendor_id, product_id ) ) {
-                psu_list.push_back ( PSU_dev ( PSU::PSUTypes::EAPS2K, dev_name ) );
-            }
-            else if ( PPS11360::check_supported_type ( vendor_id, product_id ) ) {
-                psu_list.push_back ( PSU_dev ( PSU::PSUTypes::PPS11360, dev_name ) );
+        for ( auto &entry : registry.get_devices () ) {
+            psu_list.push_back ( PSU_dev ( entry.type, entry.device_name.c_str () ) );
+        }
+    }
+
+    /**
+     * @returns where monitor writes its samples: the logfile, or stdout.
+     */
+    FILE *open_output () throw ( PSUError & )
+    {
+        if ( log_file.empty () ) {
+            return stdout;
+        }
+        FILE *out = fopen ( log_file.c_str (), "a" );
+        if ( out == nullptr ) {
+            throw PSUError ( "Failed to open \"" + log_file + "\": '" + strerror ( errno ) + "'" );
+        }
+        return out;
+    }
+    void close_output ( FILE *out )
+    {
+        if ( out != stdout ) {
+            fclose ( out );
+        }
+    }
+
+    /**
+     * Run a sequence, with the per step timing going where monitor writes its samples.
+     */
+    void run_sequence ( Sequence &sequence ) throw ( PSUError & )
+    {
+        FILE *out = open_output ();
+        try {
+            sequence.run ( out );
+        } catch ( PSUError &error ) {
+            close_output ( out );
+            throw;
+        }
+        close_output ( out );
+        sequence.print_report ( stderr );
+    }
+
+    /**
+     * @param out File to print the transport counters of the open power supplies to.
+     */
+    void print_stats ( FILE *out ) const
+    {
+        if ( power_supply != nullptr ) {
+            power_supply->print_stats ( out );
+        }
+        for ( auto device : session.get_devices () ) {
+            fprintf ( out, "[%s]\n", device->name.c_str () );
+            device->psu->print_stats ( out );
+        }
+    }
+    /**
+     * @param out File to write the transport counters of the open power supplies to, as a JSON array.
+     */
+    void write_stats_json ( FILE *out ) const
+    {
+        const char *separator = "";
+        fprintf ( out, "[" );
+        if ( power_supply != nullptr ) {
+            power_supply->write_stats_json ( out );
+            separator = ",";
+        }
+        for ( auto device : session.get_devices () ) {
+            fprintf ( out, "%s", separator );
+            device->psu->write_stats_json ( out );
+            separator = ",";
+        }
+        fprintf ( out, "]\n" );
+    }
+
+    /**
+     * In hcsd, a command that connects the supply that is already open keeps it.
+     */
+    bool is_connected ( PSU::PSUTypes type, const char *device_name ) const
+    {
+        if ( !in_daemon || power_supply == nullptr || power_supply->get_device_node () != device_name ) {
+            return false;
+        }
+        if ( type == PSU::PSUTypes::EAPS2K ) {
+            return dynamic_cast<EAPS2K *> ( power_supply ) != nullptr;
+        }
+        return dynamic_cast<PPS11360 *> ( power_supply ) != nullptr;
+    }
+
+    /**
+     * Run the commands in hcsd, if it is running.
+     *
+     * @returns false when they have to be run here.
+     */
+    bool forward ( int argc, char **argv, int &status )
+    {
+        if ( in_daemon || !use_daemon ) {
+            return false;
+        }
+        if ( !Daemon::forward ( argc, argv, status ) ) {
+            // Do not try again for every command.
+            use_daemon = false;
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * @param message The message to show.
+     *
+     * Show a message that did not come from a command, without messing up the prompt.
+     */
+    void notify ( const std::string &message )
+    {
+        fprintf ( stderr, "%s%s\n", prompt_active ? "\n" : "", message.c_str () );
+    }
+
+    void device_removed ( const DeviceRegistry::Entry &entry )
+    {
+        if ( power_supply != nullptr && power_supply->get_device_node () == entry.device_name ) {
+            notify ( "Power supply at '" + entry.device_name + "' disconnected" );
+            // Nothing to release on a device that is gone.
+            delete power_supply;
+            power_supply = nullptr;
+            lost         = std::unique_ptr<DeviceRegistry::Entry> ( new DeviceRegistry::Entry ( entry ) );
+            update_metrics ( true );
+        }
+        // Drop it from the session, so commands do not wait out its timeouts.
+        std::vector<Session::Device *> devices = session.get_devices ();
+        for ( auto device : devices ) {
+            if ( device->psu->get_device_node () == entry.device_name ) {
+                notify ( " [" + device->name + "] '" + entry.device_name + "' disconnected" );
+                session.remove ( device );
             }
-            // Done with this device
-            udev_device_unref ( dev );
         }
-        // Done with the list and this udev
-        udev_enumerate_unref ( enumerate );
-        udev_unref ( ud );
-#endif
+    }
+
+    void device_added ( const DeviceRegistry::Entry &entry )
+    {
+        if ( power_supply != nullptr || !lost || lost->type != entry.type ) {
+            return;
+        }
+        // Same unit back, possibly on another node.
+        if ( lost->serial.empty () ? lost->device_name != entry.device_name : lost->serial != entry.serial ) {
+            return;
+        }
+        lost.reset ();
+        try {
+            power_supply = PSU_dev ( entry.type, entry.device_name.c_str () ).connect ();
+            notify ( "Power supply reconnected at '" + entry.device_name + "'" );
+            update_metrics ( true );
+        } catch ( PSUError &error ) {
+            notify ( "Failed to reconnect power supply: " + std::string ( error.what () ) );
+        }
     }
 private:
-    std::vector<struct PSU_dev> psu_list;
+    std::vector<struct PSU_dev>             psu_list;
+    DeviceRegistry                          registry;
+    // The supply that was unplugged while in use, to reconnect it when it comes back.
+    std::unique_ptr<DeviceRegistry::Entry> lost;
+    // True while readline shows a prompt.
+    bool                                    prompt_active = false;
+    // Running as hcsd: keep devices open between requests.
+    bool                                    in_daemon = false;
+    // Send commands to hcsd while it answers.
+    bool                                    use_daemon = true;
+
+public:
+    /**
+     * @param argc Number of commands to run before serving.
+     * @param argv The commands, e.g. to open the power supplies.
+     *
+     * Run as hcsd.
+     */
+    int daemon ( int argc, char **argv )
+    {
+        in_daemon = true;
+        try {
+            Daemon daemon;
+            daemon.listen ();
+            if ( run ( argc, argv ) != EXIT_SUCCESS ) {
+                return EXIT_FAILURE;
+            }
+            daemon.serve ( [this] ( int argc, char **argv ) {
+                               // Per request, like a fresh hcs.
+                               PSU::set_refresh_cache ( false );
+                               return run ( argc, argv );
+                           } );
+        } catch ( PSUError &error ) {
+            fprintf ( stderr, "hcsd: %s\n", error.what () );
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+    }
 };
 
 int main ( int argc, char **argv )
 {
     HCS hcs;
-    return hcs.run ( argc, argv );
+#ifdef HCSD
+    return hcs.daemon ( argc - 1, &argv[1] );
+#else
+    return hcs.run ( argc - 1, &argv[1] );
+#endif
 }